@@ -0,0 +1,453 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/rbtree_augmented.h>
+#include "osfs.h"
+
+/**
+ * Struct: osfs_free_extent
+ * Description: One run of free data blocks in the free-space index.
+ *              Nodes are keyed by start block; every node also caches the
+ *              longest run found in its subtree so that a first-fit search
+ *              for a run of any length only follows one root-to-leaf path.
+ */
+struct osfs_free_extent {
+    struct rb_node node;
+    uint32_t start;              // First free block of the run
+    uint32_t len;                // Number of free blocks in the run
+    uint32_t subtree_max;        // Longest run in this subtree
+};
+
+static inline uint32_t osfs_free_extent_len(const struct osfs_free_extent *fe)
+{
+    return fe->len;
+}
+
+RB_DECLARE_CALLBACKS_MAX(static, osfs_free_extent_cb, struct osfs_free_extent,
+                         node, uint32_t, subtree_max, osfs_free_extent_len)
+
+#define to_free_extent(n) rb_entry_safe(n, struct osfs_free_extent, node)
+
+/**
+ * Function: osfs_bitmap_next_run
+ * Description: Finds the next run of clear bits using the word-at-a-time
+ *              bitmap primitives: find_next_zero_bit locates the start of the
+ *              run and find_next_bit locates its end.
+ * Inputs:
+ *   - bitmap: The bitmap to search.
+ *   - size: Number of valid bits in the bitmap.
+ *   - start: Bit to start searching from.
+ *   - run_len: Pointer to store the length of the run found.
+ * Returns:
+ *   - The first bit of the run, or @size (with *run_len = 0) if none is left.
+ */
+unsigned long osfs_bitmap_next_run(const unsigned long *bitmap, unsigned long size,
+                                   unsigned long start, unsigned long *run_len)
+{
+    unsigned long first, end;
+
+    first = find_next_zero_bit(bitmap, size, start);
+    if (first >= size) {
+        *run_len = 0;
+        return size;
+    }
+
+    end = find_next_bit(bitmap, size, first);
+    *run_len = end - first;
+    return first;
+}
+
+/**
+ * Function: osfs_bitmap_alloc_run
+ * Description: Finds the first run of at least @len clear bits at or after
+ *              @start and marks @len bits of it with one bitmap_set.
+ * Inputs:
+ *   - bitmap: The bitmap to allocate from.
+ *   - size: Number of valid bits in the bitmap.
+ *   - start: Lowest bit that may be allocated.
+ *   - len: Number of contiguous bits required.
+ * Returns:
+ *   - The first allocated bit on success.
+ *   - -ENOSPC if no run is long enough.
+ */
+long osfs_bitmap_alloc_run(unsigned long *bitmap, unsigned long size,
+                           unsigned long start, unsigned long len)
+{
+    unsigned long first, run_len;
+
+    for (first = osfs_bitmap_next_run(bitmap, size, start, &run_len);
+         first < size;
+         first = osfs_bitmap_next_run(bitmap, size, first + run_len, &run_len)) {
+        if (run_len >= len) {
+            bitmap_set(bitmap, first, len);
+            return first;
+        }
+    }
+
+    return -ENOSPC;
+}
+
+/**
+ * Function: osfs_free_extent_new
+ * Description: Returns a node for a group's free-space index. Under the
+ *              group lock the spare set aside by osfs_group_lock is used,
+ *              since a spinlock holder cannot sleep in kmalloc; every locked
+ *              update needs at most one new node. Without the lock (only
+ *              while the index is built at mount) the node is allocated.
+ */
+static struct osfs_free_extent *osfs_free_extent_new(struct osfs_group *grp)
+{
+    struct osfs_free_extent *fe = grp->free_extent_spare;
+
+    if (fe) {
+        grp->free_extent_spare = NULL;
+        return fe;
+    }
+    return kmalloc(sizeof(*fe), GFP_NOFS | __GFP_NOFAIL);
+}
+
+/**
+ * Function: osfs_group_lock
+ * Description: Takes the lock of a block group, which protects its part of
+ *              the bitmaps, its free counters and its free-space index, with
+ *              a spare index node set aside so the locked section never has
+ *              to allocate memory.
+ * Inputs:
+ *   - grp: The block group.
+ * Returns:
+ *   - None. The lock is held on return.
+ */
+void osfs_group_lock(struct osfs_group *grp)
+{
+    struct osfs_free_extent *fe;
+
+    spin_lock(&grp->lock);
+    while (!grp->free_extent_spare) {
+        spin_unlock(&grp->lock);
+        fe = kmalloc(sizeof(*fe), GFP_NOFS | __GFP_NOFAIL);
+        spin_lock(&grp->lock);
+        if (grp->free_extent_spare)
+            kfree(fe);
+        else
+            grp->free_extent_spare = fe;
+    }
+}
+
+void osfs_group_unlock(struct osfs_group *grp)
+{
+    spin_unlock(&grp->lock);
+}
+
+static void osfs_free_index_link(struct rb_root *root, struct osfs_free_extent *new)
+{
+    struct rb_node **link = &root->rb_node, *parent = NULL;
+    struct osfs_free_extent *fe;
+
+    while (*link) {
+        parent = *link;
+        fe = to_free_extent(parent);
+        // Update the cached maximum on the way down, as rb_insert_augmented expects
+        if (fe->subtree_max < new->len)
+            fe->subtree_max = new->len;
+        if (new->start < fe->start)
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+
+    new->subtree_max = new->len;
+    rb_link_node(&new->node, parent, link);
+    rb_insert_augmented(&new->node, root, &osfs_free_extent_cb);
+}
+
+static void osfs_free_index_erase(struct osfs_group *grp, struct osfs_free_extent *fe)
+{
+    rb_erase_augmented(&fe->node, &grp->free_extents, &osfs_free_extent_cb);
+    // Keep the node as the spare if there is none, saving the next locked update a kmalloc
+    if (!grp->free_extent_spare)
+        grp->free_extent_spare = fe;
+    else
+        kfree(fe);
+}
+
+/**
+ * Function: osfs_free_index_first_fit
+ * Description: Finds the lowest-addressed free run of at least @len blocks.
+ * Inputs:
+ *   - root: The free-space index.
+ *   - len: Required run length in blocks.
+ * Returns:
+ *   - The matching run, or NULL if no run is long enough.
+ */
+static struct osfs_free_extent *osfs_free_index_first_fit(struct rb_root *root, uint32_t len)
+{
+    struct rb_node *node = root->rb_node;
+    struct osfs_free_extent *fe, *left;
+
+    if (!node || to_free_extent(node)->subtree_max < len)
+        return NULL;
+
+    while (node) {
+        fe = to_free_extent(node);
+        left = to_free_extent(node->rb_left);
+        if (left && left->subtree_max >= len) {
+            node = node->rb_left;
+            continue;
+        }
+        if (fe->len >= len)
+            return fe;
+        node = node->rb_right;
+    }
+
+    return NULL;
+}
+
+/**
+ * Function: osfs_free_index_insert
+ * Description: Returns the block range [start, start + len) to the free-space
+ *              index, merging it with the neighbouring runs when they touch.
+ *              The range must lie inside the group. Like every index update,
+ *              it runs under osfs_group_lock once the filesystem is mounted.
+ * Inputs:
+ *   - grp: The block group.
+ *   - start: First block of the range.
+ *   - len: Number of blocks in the range.
+ * Returns:
+ *   - None.
+ */
+void osfs_free_index_insert(struct osfs_group *grp, uint32_t start, uint32_t len)
+{
+    struct rb_root *root = &grp->free_extents;
+    struct rb_node *node = root->rb_node;
+    struct osfs_free_extent *fe, *prev = NULL, *next = NULL;
+
+    if (!len)
+        return;
+
+    // Locate the runs immediately before and after the range
+    while (node) {
+        fe = to_free_extent(node);
+        if (start < fe->start) {
+            next = fe;
+            node = node->rb_left;
+        } else {
+            prev = fe;
+            node = node->rb_right;
+        }
+    }
+
+    if (prev && prev->start + prev->len != start)
+        prev = NULL;
+    if (next && start + len != next->start)
+        next = NULL;
+
+    if (prev && next) {
+        prev->len += len + next->len;
+        osfs_free_index_erase(grp, next);
+        osfs_free_extent_cb_propagate(&prev->node, NULL);
+    } else if (prev) {
+        prev->len += len;
+        osfs_free_extent_cb_propagate(&prev->node, NULL);
+    } else if (next) {
+        next->start = start;
+        next->len += len;
+        osfs_free_extent_cb_propagate(&next->node, NULL);
+    } else {
+        fe = osfs_free_extent_new(grp);
+        fe->start = start;
+        fe->len = len;
+        osfs_free_index_link(root, fe);
+    }
+}
+
+/**
+ * Function: osfs_free_index_alloc
+ * Description: Takes the first free run of @len blocks out of the free-space
+ *              index. The caller is responsible for the block bitmap.
+ * Inputs:
+ *   - grp: The block group.
+ *   - len: Number of contiguous blocks required.
+ *   - start: Pointer to store the first block of the run.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if no free run is long enough.
+ */
+int osfs_free_index_alloc(struct osfs_group *grp, uint32_t len, uint32_t *start)
+{
+    struct osfs_free_extent *fe;
+
+    if (!len)
+        return -EINVAL;
+
+    fe = osfs_free_index_first_fit(&grp->free_extents, len);
+    if (!fe)
+        return -ENOSPC;
+
+    *start = fe->start;
+    if (fe->len == len) {
+        osfs_free_index_erase(grp, fe);
+    } else {
+        // Shrinking from the front keeps the node in key order
+        fe->start += len;
+        fe->len -= len;
+        osfs_free_extent_cb_propagate(&fe->node, NULL);
+    }
+
+    return 0;
+}
+
+/**
+ * Function: osfs_free_index_max_run
+ * Description: Returns the length of the longest free run, read from the root.
+ * Inputs:
+ *   - grp: The block group.
+ * Returns:
+ *   - The longest free run in blocks; 0 if the data area is full.
+ */
+uint32_t osfs_free_index_max_run(struct osfs_group *grp)
+{
+    struct osfs_free_extent *root = to_free_extent(grp->free_extents.rb_node);
+
+    return root ? root->subtree_max : 0;
+}
+
+/**
+ * Function: osfs_free_index_alloc_at
+ * Description: Takes up to @len free blocks starting exactly at @goal out of the
+ *              free-space index, so that a file can grow its last extent in place.
+ * Inputs:
+ *   - grp: The block group.
+ *   - goal: The block the run has to start at.
+ *   - len: Maximum number of blocks wanted.
+ * Returns:
+ *   - The number of blocks taken; 0 if @goal is not free.
+ */
+uint32_t osfs_free_index_alloc_at(struct osfs_group *grp, uint32_t goal, uint32_t len)
+{
+    struct rb_root *root = &grp->free_extents;
+    struct rb_node *node = root->rb_node;
+    struct osfs_free_extent *fe = NULL, *tail;
+    uint32_t run_end, taken;
+
+    // Find the run with the greatest start that is not above the goal
+    while (node) {
+        struct osfs_free_extent *cur = to_free_extent(node);
+
+        if (goal < cur->start) {
+            node = node->rb_left;
+        } else {
+            fe = cur;
+            node = node->rb_right;
+        }
+    }
+
+    if (!fe || goal >= fe->start + fe->len || !len)
+        return 0;
+
+    run_end = fe->start + fe->len;
+    taken = min(len, run_end - goal);
+
+    if (goal == fe->start) {
+        if (taken == fe->len) {
+            osfs_free_index_erase(grp, fe);
+        } else {
+            fe->start += taken;
+            fe->len -= taken;
+            osfs_free_extent_cb_propagate(&fe->node, NULL);
+        }
+    } else {
+        // Keep the head in place and split off whatever is left after the taken range
+        fe->len = goal - fe->start;
+        osfs_free_extent_cb_propagate(&fe->node, NULL);
+        if (goal + taken < run_end) {
+            tail = osfs_free_extent_new(grp);
+            tail->start = goal + taken;
+            tail->len = run_end - tail->start;
+            osfs_free_index_link(root, tail);
+        }
+    }
+
+    return taken;
+}
+
+/**
+ * Function: osfs_groups_init
+ * Description: Splits the data area and the inode table into groups and
+ *              builds the free-space index of every group from the bitmaps.
+ *              Groups cover whole bitmap words, so the bitmaps of two groups
+ *              never share a word and each group lock guards its own part.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the group descriptors cannot be allocated.
+ */
+int osfs_groups_init(struct osfs_sb_info *sb_info)
+{
+    struct osfs_group *grp;
+    unsigned long start, end, run_len;
+    uint32_t g;
+
+    sb_info->group_count = DIV_ROUND_UP(sb_info->block_count, OSFS_BLOCKS_PER_GROUP);
+    sb_info->inodes_per_group = round_up(DIV_ROUND_UP(sb_info->inode_count, sb_info->group_count),
+                                         BITS_PER_LONG);
+
+    sb_info->groups = kvcalloc(sb_info->group_count, sizeof(*sb_info->groups), GFP_KERNEL);
+    sb_info->group_rotor = alloc_percpu(unsigned int);
+    if (!sb_info->groups || !sb_info->group_rotor)
+        return -ENOMEM;
+
+    for (g = 0; g < sb_info->group_count; g++) {
+        grp = &sb_info->groups[g];
+        spin_lock_init(&grp->lock);
+        grp->free_extents = RB_ROOT;
+
+        grp->first_block = g * OSFS_BLOCKS_PER_GROUP;
+        grp->nr_blocks = min(sb_info->block_count - grp->first_block, OSFS_BLOCKS_PER_GROUP);
+        grp->first_inode = min(g * sb_info->inodes_per_group, sb_info->inode_count);
+        grp->nr_inodes = min(sb_info->inode_count - grp->first_inode, sb_info->inodes_per_group);
+
+        end = grp->first_block + grp->nr_blocks;
+        for (start = osfs_bitmap_next_run(sb_info->block_bitmap, end, grp->first_block, &run_len);
+             start < end;
+             start = osfs_bitmap_next_run(sb_info->block_bitmap, end, start + run_len, &run_len)) {
+            osfs_free_index_insert(grp, start, run_len);
+            grp->free_blocks += run_len;
+        }
+
+        end = grp->first_inode + grp->nr_inodes;
+        for (start = osfs_bitmap_next_run(sb_info->inode_bitmap, end, grp->first_inode, &run_len);
+             start < end;
+             start = osfs_bitmap_next_run(sb_info->inode_bitmap, end, start + run_len, &run_len))
+            grp->free_inodes += run_len;
+    }
+
+    return 0;
+}
+
+/**
+ * Function: osfs_groups_destroy
+ * Description: Releases the groups and every node of their free-space indexes.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_groups_destroy(struct osfs_sb_info *sb_info)
+{
+    struct osfs_free_extent *fe, *tmp;
+    struct osfs_group *grp;
+    uint32_t g;
+
+    if (sb_info->groups) {
+        for (g = 0; g < sb_info->group_count; g++) {
+            grp = &sb_info->groups[g];
+            rbtree_postorder_for_each_entry_safe(fe, tmp, &grp->free_extents, node)
+                kfree(fe);
+            kfree(grp->free_extent_spare);
+        }
+        kvfree(sb_info->groups);
+        sb_info->groups = NULL;
+    }
+    free_percpu(sb_info->group_rotor);
+    sb_info->group_rotor = NULL;
+}
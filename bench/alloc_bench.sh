@@ -0,0 +1,36 @@
+#!/bin/sh
+# Inode creation and block allocation throughput at 1K, 64K and 1M blocks,
+# and a 100K-file create burst.
+# Run from the repository root after `make`; needs root to load and mount.
+set -e
+
+MNT=${MNT:-mnt}
+BENCH=bench/osfs_bench
+
+cc -O2 -Wall -I. -pthread -o "$BENCH" bench/osfs_bench.c
+mkdir -p "$MNT"
+insmod osfs.ko
+
+for blocks in 1024 65536 1048576; do
+    # Each file needs one inode; keep a few spare for the root
+    files=$((blocks / 8))
+    mount -t osfs -o inodes=$((files + 2)),blocks=$blocks none "$MNT"
+    printf 'blocks=%s ' "$blocks"
+    "$BENCH" create "$MNT" "$files" || true
+    umount "$MNT"
+
+    mount -t osfs -o inodes=$((files + 2)),blocks=$blocks none "$MNT"
+    printf 'blocks=%s ' "$blocks"
+    "$BENCH" alloc "$MNT" "$files" 1024 || true
+    umount "$MNT"
+done
+
+# A burst of 100K empty files in one directory: files per second, and the
+# blocks they use, all of them directory blocks
+files=100000
+mount -t osfs -o inodes=$((files + 2)),blocks=65536 none "$MNT"
+printf 'burst '
+"$BENCH" create "$MNT" "$files" || true
+umount "$MNT"
+
+rmmod osfs
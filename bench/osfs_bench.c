@@ -0,0 +1,474 @@
+/*
+ * osfs_bench: userspace microbenchmarks for a mounted osfs.
+ *
+ * Usage:
+ *   osfs_bench create <dir> <count>          create <count> empty files
+ *   osfs_bench alloc  <dir> <count> <bytes>  create <count> files and write <bytes> to each
+ *   osfs_bench rw <dir> <seq|rand> <read|write> <file_bytes> <io_bytes> [direct]
+ *                                            I/O on <dir>/rw.dat; a read needs a write first
+ *   osfs_bench dirops <dir> <count>          create, look up, miss and unlink in a
+ *                                            directory of <count> entries
+ *   osfs_bench readdir <dir> <count> <passes>
+ *                                            list a directory of <count> entries
+ *   osfs_bench threads <dir> <threads> <files> <bytes>
+ *                                            each thread creates <files> files of <bytes>
+ *   osfs_bench frag <dir> <files> <bytes> <big_bytes>
+ *                                            free every other of <files> files, then
+ *                                            write and defragment one file of <big_bytes>
+ *
+ * Every run prints one line of key=value pairs per measurement so results can
+ * be collected by scripts and compared across builds (bench/suite.sh, make
+ * bench). blocks_used is the change in used filesystem blocks over the run,
+ * as reported by statfs. Build with -I. for osfs_ioctl.h and -pthread.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include "osfs_ioctl.h"
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long used_blocks(const char *dir)
+{
+    struct statvfs st;
+
+    if (statvfs(dir, &st))
+        return 0;
+    return (long)(st.f_blocks - st.f_bfree);
+}
+
+static void report(const char *test, long done, long requested, double elapsed, long bytes,
+                   long blocks)
+{
+    printf("test=%s files=%ld requested=%ld seconds=%.6f files_per_sec=%.1f blocks_used=%ld",
+           test, done, requested, elapsed, elapsed > 0 ? done / elapsed : 0.0, blocks);
+    if (bytes)
+        printf(" bytes=%ld mb_per_sec=%.2f", bytes, elapsed > 0 ? bytes / elapsed / 1e6 : 0.0);
+    printf("\n");
+}
+
+static int bench_create(const char *dir, long count)
+{
+    char path[4096];
+    double start;
+    long i, used;
+    int fd;
+
+    used = used_blocks(dir);
+    start = now_sec();
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/c%ld", dir, i);
+        fd = open(path, O_CREAT | O_WRONLY | O_EXCL, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "create %s: %s\n", path, strerror(errno));
+            break;
+        }
+        close(fd);
+    }
+    report("create", i, count, now_sec() - start, 0, used_blocks(dir) - used);
+    return i == count ? 0 : 1;
+}
+
+static int bench_alloc(const char *dir, long count, long bytes)
+{
+    char path[4096];
+    char *buf;
+    double start;
+    long i, used;
+    int fd;
+
+    buf = malloc(bytes);
+    if (!buf)
+        return 1;
+    memset(buf, 'a', bytes);
+
+    used = used_blocks(dir);
+    start = now_sec();
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/a%ld", dir, i);
+        fd = open(path, O_CREAT | O_WRONLY | O_EXCL, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "create %s: %s\n", path, strerror(errno));
+            break;
+        }
+        if (write(fd, buf, bytes) != bytes) {
+            fprintf(stderr, "write %s: %s\n", path, strerror(errno));
+            close(fd);
+            break;
+        }
+        close(fd);
+    }
+    report("alloc", i, count, now_sec() - start, i * bytes, used_blocks(dir) - used);
+    free(buf);
+    return i == count ? 0 : 1;
+}
+
+// xorshift64: the same offsets on every run, so random results compare
+static uint64_t next_rand(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void drop_dir_caches(void)
+{
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+
+    // Without root the lookups below may be served by the dcache
+    if (fd < 0)
+        return;
+    sync();
+    if (write(fd, "2", 1) != 1)
+        fprintf(stderr, "drop_caches: %s\n", strerror(errno));
+    close(fd);
+}
+
+static int bench_rw(const char *dir, const char *pattern, const char *op, long file_bytes,
+                    long io_bytes, int direct)
+{
+    int rnd = !strcmp(pattern, "rand"), wr = !strcmp(op, "write");
+    long ops = file_bytes / io_bytes, i, done = 0;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    char path[4096];
+    double start, elapsed;
+    off_t off;
+    void *buf;
+    ssize_t n;
+    int fd, flags;
+
+    if (io_bytes <= 0 || ops <= 0)
+        return 2;
+    if (posix_memalign(&buf, 4096, io_bytes))
+        return 1;
+    memset(buf, 'w', io_bytes);
+
+    snprintf(path, sizeof(path), "%s/rw.dat", dir);
+    flags = wr ? O_RDWR | O_CREAT : O_RDONLY;
+    fd = open(path, flags | (direct ? O_DIRECT : 0), 0644);
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        free(buf);
+        return 1;
+    }
+    // Reads should hit the data area rather than pages left by the write
+    if (!wr)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    start = now_sec();
+    for (i = 0; i < ops; i++) {
+        off = rnd ? (off_t)(next_rand(&state) % ops) * io_bytes : (off_t)i * io_bytes;
+        n = wr ? pwrite(fd, buf, io_bytes, off) : pread(fd, buf, io_bytes, off);
+        if (n != io_bytes) {
+            fprintf(stderr, "%s %s at %lld: %s\n", op, path, (long long)off,
+                    n < 0 ? strerror(errno) : "short");
+            break;
+        }
+        done += n;
+    }
+    if (wr)
+        fsync(fd);
+    elapsed = now_sec() - start;
+    if (wr)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+
+    printf("test=rw pattern=%s op=%s direct=%d file_bytes=%ld io_bytes=%ld ops=%ld seconds=%.6f "
+           "mb_per_sec=%.2f iops=%.1f\n", rnd ? "rand" : "seq", wr ? "write" : "read", direct,
+           file_bytes, io_bytes, i, elapsed, elapsed > 0 ? done / elapsed / 1e6 : 0.0,
+           elapsed > 0 ? i / elapsed : 0.0);
+    free(buf);
+    return i == ops ? 0 : 1;
+}
+
+static void report_rate(const char *test, long entries, long done, double elapsed)
+{
+    printf("test=%s dir_entries=%ld ops=%ld seconds=%.6f ops_per_sec=%.1f\n",
+           test, entries, done, elapsed, elapsed > 0 ? done / elapsed : 0.0);
+}
+
+static int bench_dirops(const char *dir, long count)
+{
+    char path[4096];
+    struct stat st;
+    double start;
+    long i;
+    int fd, ret = 0;
+
+    start = now_sec();
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/d%ld", dir, i);
+        fd = open(path, O_CREAT | O_WRONLY | O_EXCL, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "create %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        close(fd);
+    }
+    report_rate("dir_create", count, i, now_sec() - start);
+
+    drop_dir_caches();
+    start = now_sec();
+    for (i = 0; i < count; i++) {
+        // Stride through the names so lookups do not follow creation order
+        snprintf(path, sizeof(path), "%s/d%ld", dir, (i * 7919) % count);
+        if (stat(path, &st)) {
+            fprintf(stderr, "stat %s: %s\n", path, strerror(errno));
+            ret = 1;
+            break;
+        }
+    }
+    report_rate("dir_lookup", count, i, now_sec() - start);
+
+    // Every name is new, so each one reaches osfs_lookup
+    start = now_sec();
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/missing%ld", dir, i);
+        if (!stat(path, &st) || errno != ENOENT) {
+            ret = 1;
+            break;
+        }
+    }
+    report_rate("dir_lookup_miss", count, i, now_sec() - start);
+
+    start = now_sec();
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/d%ld", dir, i);
+        if (unlink(path)) {
+            fprintf(stderr, "unlink %s: %s\n", path, strerror(errno));
+            ret = 1;
+            break;
+        }
+    }
+    report_rate("dir_unlink", count, i, now_sec() - start);
+    return ret;
+}
+
+static int bench_readdir(const char *dir, long count, long passes)
+{
+    struct dirent *de;
+    char path[4096];
+    long i, seen = 0;
+    double start;
+    DIR *d;
+    int fd;
+
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/r%ld", dir, i);
+        fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "create %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        close(fd);
+    }
+
+    start = now_sec();
+    for (i = 0; i < passes; i++) {
+        d = opendir(dir);
+        if (!d) {
+            fprintf(stderr, "opendir %s: %s\n", dir, strerror(errno));
+            return 1;
+        }
+        while ((de = readdir(d)))
+            seen++;
+        closedir(d);
+    }
+    report_rate("readdir", count, seen, now_sec() - start);
+    return 0;
+}
+
+struct thread_arg {
+    const char *dir;
+    int id;
+    long files;
+    long bytes;
+    long done;
+};
+
+static void *thread_create(void *p)
+{
+    struct thread_arg *arg = p;
+    char path[4096];
+    char *buf;
+    int fd;
+
+    buf = malloc(arg->bytes ? arg->bytes : 1);
+    if (!buf)
+        return NULL;
+    memset(buf, 't', arg->bytes);
+    for (arg->done = 0; arg->done < arg->files; arg->done++) {
+        snprintf(path, sizeof(path), "%s/t%d_%ld", arg->dir, arg->id, arg->done);
+        fd = open(path, O_CREAT | O_WRONLY | O_EXCL, 0644);
+        if (fd < 0)
+            break;
+        if (arg->bytes && write(fd, buf, arg->bytes) != arg->bytes) {
+            close(fd);
+            break;
+        }
+        close(fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int bench_threads(const char *dir, int threads, long files, long bytes)
+{
+    struct thread_arg *args;
+    pthread_t *tids;
+    long done = 0;
+    double start, elapsed;
+    int i;
+
+    if (threads <= 0)
+        return 2;
+    args = calloc(threads, sizeof(*args));
+    tids = calloc(threads, sizeof(*tids));
+    if (!args || !tids)
+        return 1;
+
+    start = now_sec();
+    for (i = 0; i < threads; i++) {
+        args[i] = (struct thread_arg){ .dir = dir, .id = i, .files = files, .bytes = bytes };
+        pthread_create(&tids[i], NULL, thread_create, &args[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        done += args[i].done;
+    }
+    elapsed = now_sec() - start;
+
+    printf("test=threads threads=%d files=%ld requested=%ld bytes=%ld seconds=%.6f "
+           "files_per_sec=%.1f mb_per_sec=%.2f\n", threads, done, files * threads, bytes,
+           elapsed, elapsed > 0 ? done / elapsed : 0.0,
+           elapsed > 0 ? done * bytes / elapsed / 1e6 : 0.0);
+    free(args);
+    free(tids);
+    return done == files * threads ? 0 : 1;
+}
+
+// Extents mapping a file, from FS_IOC_FIEMAP with no room for the list itself
+static long count_extents(int fd)
+{
+    struct fiemap fm = { .fm_length = FIEMAP_MAX_OFFSET };
+
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm))
+        return -1;
+    return fm.fm_mapped_extents;
+}
+
+static int bench_frag(const char *dir, long files, long bytes, long big_bytes)
+{
+    struct osfs_defrag_info info;
+    char path[4096];
+    char *buf;
+    double start, elapsed;
+    long i, written = 0, chunk;
+    int fd, ret = 0;
+
+    buf = malloc(bytes > 65536 ? bytes : 65536);
+    if (!buf)
+        return 1;
+    memset(buf, 'f', bytes > 65536 ? bytes : 65536);
+
+    // Fill the area with small files and punch holes in the free space
+    for (i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+        fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (fd < 0 || write(fd, buf, bytes) != bytes) {
+            fprintf(stderr, "fill %s: %s\n", path, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            break;
+        }
+        close(fd);
+    }
+    files = i;
+    for (i = 0; i < files; i += 2) {
+        snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+        unlink(path);
+    }
+
+    snprintf(path, sizeof(path), "%s/big", dir);
+    fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(buf);
+        return 1;
+    }
+    start = now_sec();
+    while (written < big_bytes) {
+        chunk = big_bytes - written < 65536 ? big_bytes - written : 65536;
+        if (write(fd, buf, chunk) != chunk) {
+            fprintf(stderr, "write %s: %s\n", path, strerror(errno));
+            ret = 1;
+            break;
+        }
+        written += chunk;
+    }
+    fsync(fd);
+    elapsed = now_sec() - start;
+    printf("test=frag files=%ld bytes=%ld big_bytes=%ld written=%ld seconds=%.6f mb_per_sec=%.2f "
+           "extents=%ld\n", files, bytes, big_bytes, written, elapsed,
+           elapsed > 0 ? written / elapsed / 1e6 : 0.0, count_extents(fd));
+
+    start = now_sec();
+    if (ioctl(fd, OSFS_IOC_DEFRAG, &info)) {
+        printf("test=defrag error=%d\n", errno);
+    } else {
+        printf("test=defrag seconds=%.6f extents_before=%u extents_after=%u blocks=%u\n",
+               now_sec() - start, info.extents_before, info.extents_after, info.blocks);
+    }
+    close(fd);
+    free(buf);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 4 && !strcmp(argv[1], "create"))
+        return bench_create(argv[2], atol(argv[3]));
+    if (argc >= 5 && !strcmp(argv[1], "alloc"))
+        return bench_alloc(argv[2], atol(argv[3]), atol(argv[4]));
+    if (argc >= 7 && !strcmp(argv[1], "rw"))
+        return bench_rw(argv[2], argv[3], argv[4], atol(argv[5]), atol(argv[6]),
+                        argc >= 8 && !strcmp(argv[7], "direct"));
+    if (argc >= 4 && !strcmp(argv[1], "dirops"))
+        return bench_dirops(argv[2], atol(argv[3]));
+    if (argc >= 5 && !strcmp(argv[1], "readdir"))
+        return bench_readdir(argv[2], atol(argv[3]), atol(argv[4]));
+    if (argc >= 6 && !strcmp(argv[1], "threads"))
+        return bench_threads(argv[2], atoi(argv[3]), atol(argv[4]), atol(argv[5]));
+    if (argc >= 6 && !strcmp(argv[1], "frag"))
+        return bench_frag(argv[2], atol(argv[3]), atol(argv[4]), atol(argv[5]));
+
+    fprintf(stderr,
+            "usage: %s create <dir> <count>\n"
+            "       %s alloc <dir> <count> <bytes>\n"
+            "       %s rw <dir> <seq|rand> <read|write> <file_bytes> <io_bytes> [direct]\n"
+            "       %s dirops <dir> <count>\n"
+            "       %s readdir <dir> <count> <passes>\n"
+            "       %s threads <dir> <threads> <files> <bytes>\n"
+            "       %s frag <dir> <files> <bytes> <big_bytes>\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return 2;
+}
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Full benchmark suite, run by `make bench`: sequential and random I/O at
+# several sizes, directory operations against directory size, readdir,
+# multi-threaded create/write scaling and allocation under fragmentation.
+# Every result is one line of key=value pairs, prefixed with the mount it ran
+# on, so runs can be saved (OUT=file) and compared across releases. Errors
+# of the benchmark go to stderr and stay out of the results.
+# Run from the repository root after `make`; needs root to load and mount.
+set -e
+
+MNT=${MNT:-mnt}
+BENCH=bench/osfs_bench
+OUT=${OUT:-/dev/stdout}
+MEM=${MEM:-vmalloc}
+
+cc -O2 -Wall -I. -pthread -o "$BENCH" bench/osfs_bench.c
+mkdir -p "$MNT"
+insmod osfs.ko
+
+# run <inodes> <blocks> <bench args...>: one benchmark on a fresh mount
+run() {
+    inodes=$1
+    blocks=$2
+    cmd=$3
+    shift 3
+    mount -t osfs -o inodes="$inodes",blocks="$blocks",mem="$MEM" none "$MNT"
+    "$BENCH" "$cmd" "$MNT" "$@" | sed "s/^/mem=$MEM blocks=$blocks /" >> "$OUT" || true
+    umount "$MNT"
+}
+
+# rw <file_bytes> <io_bytes> [direct]: write then read in both patterns
+rw() {
+    mount -t osfs -o inodes=16,blocks=$(($1 / 1024 + 4096)),mem="$MEM" none "$MNT"
+    for pattern in seq rand; do
+        for op in write read; do
+            "$BENCH" rw "$MNT" $pattern $op "$@" |
+                sed "s/^/mem=$MEM /" >> "$OUT" || true
+        done
+    done
+    umount "$MNT"
+}
+
+date -u +"suite=osfs date=%Y-%m-%dT%H:%M:%SZ kernel=$(uname -r) cpus=$(nproc)" >> "$OUT"
+
+for io in 4096 65536 1048576; do
+    rw 268435456 $io
+    rw 268435456 $io direct
+done
+
+for entries in 1000 10000 100000; do
+    run $((entries + 16)) 65536 dirops $entries
+    run $((entries + 16)) 65536 readdir $entries 10
+done
+
+for threads in 1 2 4 8 16; do
+    run $((threads * 2000 + 16)) 262144 threads $threads 2000 4096
+done
+
+# Half of the area in 4K files, every other one freed, then a 64M file
+run 16400 131072 frag 16384 4096 67108864
+
+rmmod osfs
@@ -0,0 +1,324 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/xarray.h>
+#include "osfs.h"
+
+/**
+ * Block access
+ *
+ * A memory mount keeps the inode table in a vmalloc region and the data
+ * area either in the same region (mem=vmalloc), in huge page chunks
+ * (mem=huge) or in pages allocated as blocks are (mem=sparse), and hands out
+ * plain addresses into them. A block device mount reads device blocks on
+ * first use through buffer heads and keeps them pinned in sb_info->bh_cache,
+ * so the addresses handed out stay valid exactly as they do in memory.
+ * Writers mark what they changed dirty and the block device's own writeback
+ * takes it to disk.
+ */
+
+/**
+ * Function: osfs_disk_bh
+ * Description: Returns the pinned buffer head of a device block, reading it on
+ *              first use. Block device mounts only.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - nr: The device block number.
+ *   - new: The caller overwrites the whole block, so a block that is not
+ *          cached yet is not read from the device.
+ * Returns:
+ *   - The buffer head, owned by the cache; NULL on I/O or allocation failure.
+ */
+struct buffer_head *osfs_disk_bh(struct osfs_sb_info *sb_info, sector_t nr, bool new)
+{
+    struct buffer_head *bh, *old;
+
+    bh = xa_load(&sb_info->bh_cache, nr);
+    if (bh)
+        return bh;
+
+    if (new) {
+        bh = sb_getblk(sb_info->sb, nr);
+        if (bh && !buffer_uptodate(bh)) {
+            lock_buffer(bh);
+            memset(bh->b_data, 0, bh->b_size);
+            set_buffer_uptodate(bh);
+            unlock_buffer(bh);
+        }
+    } else {
+        bh = sb_bread(sb_info->sb, nr);
+    }
+    if (!bh) {
+        pr_err("osfs_disk_bh: Failed to read device block %llu\n", (unsigned long long)nr);
+        return NULL;
+    }
+
+    // Another thread may have cached the block meanwhile; keep the first one
+    old = xa_cmpxchg(&sb_info->bh_cache, nr, NULL, bh, GFP_NOFS);
+    if (old) {
+        brelse(bh);
+        return xa_is_err(old) ? NULL : old;
+    }
+    return bh;
+}
+
+/**
+ * Function: osfs_data_area_init
+ * Description: Sets up the chunk table of a memory mount whose data area is
+ *              not one vmalloc region. mem=huge fills every chunk with a
+ *              PMD-sized run of pages, which the direct map covers with huge
+ *              TLB entries; mem=sparse fills chunks of one page only when
+ *              osfs_data_blocks_prepare first needs them.
+ * Inputs:
+ *   - sb_info: The superblock information; block_count and mem_mode are set.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the table or a huge chunk cannot be allocated.
+ */
+int osfs_data_area_init(struct osfs_sb_info *sb_info)
+{
+    uint32_t nr_chunks, i;
+    struct page *page;
+
+    sb_info->data_chunk_order = sb_info->mem_mode == OSFS_MEM_HUGE ? OSFS_HUGE_ORDER : 0;
+    sb_info->data_chunk_shift = sb_info->data_chunk_order + PAGE_SHIFT - BLOCK_SIZE_BITS;
+    nr_chunks = DIV_ROUND_UP(sb_info->block_count, 1U << sb_info->data_chunk_shift);
+
+    sb_info->data_chunks = kvcalloc(nr_chunks, sizeof(*sb_info->data_chunks), GFP_KERNEL);
+    if (!sb_info->data_chunks)
+        return -ENOMEM;
+    if (sb_info->mem_mode != OSFS_MEM_HUGE)
+        return 0;
+
+    for (i = 0; i < nr_chunks; i++) {
+        page = alloc_pages(GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_COMP,
+                           sb_info->data_chunk_order);
+        if (!page) {
+            pr_err("osfs_data_area_init: Out of huge pages after %u of %u chunks\n",
+                   i, nr_chunks);
+            return -ENOMEM;
+        }
+        sb_info->data_chunks[i] = page_address(page);
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_data_area_destroy
+ * Description: Frees the chunks of a memory mount and their table.
+ */
+void osfs_data_area_destroy(struct osfs_sb_info *sb_info)
+{
+    uint32_t nr_chunks, i;
+
+    if (!sb_info->data_chunks)
+        return;
+
+    nr_chunks = DIV_ROUND_UP(sb_info->block_count, 1U << sb_info->data_chunk_shift);
+    for (i = 0; i < nr_chunks; i++)
+        if (sb_info->data_chunks[i])
+            free_pages((unsigned long)sb_info->data_chunks[i], sb_info->data_chunk_order);
+    kvfree(sb_info->data_chunks);
+    sb_info->data_chunks = NULL;
+}
+
+/**
+ * Function: osfs_data_block
+ * Description: Returns the address of a data block, whichever way the data
+ *              area is backed.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block: The data block number.
+ * Returns:
+ *   - A pointer to the BLOCK_SIZE bytes of the block.
+ *   - NULL if the block is out of range, not backed yet or cannot be read.
+ */
+void *osfs_data_block(struct osfs_sb_info *sb_info, uint32_t block)
+{
+    struct buffer_head *bh;
+    void *chunk;
+
+    if (block >= sb_info->block_count)
+        return NULL;
+
+    if (osfs_on_bdev(sb_info)) {
+        bh = osfs_disk_bh(sb_info, sb_info->disk.s_data_start + block, false);
+        return bh ? bh->b_data : NULL;
+    }
+
+    if (!sb_info->data_chunks)
+        return sb_info->data_blocks + (size_t)block * BLOCK_SIZE;
+
+    chunk = READ_ONCE(sb_info->data_chunks[block >> sb_info->data_chunk_shift]);
+    if (!chunk)
+        return NULL;
+    return chunk + (size_t)(block & osfs_chunk_mask(sb_info)) * BLOCK_SIZE;
+}
+
+/**
+ * Function: osfs_data_contig
+ * Description: Returns how many blocks from @block on are contiguous in
+ *              memory, so that one copy can cover them.
+ */
+uint32_t osfs_data_contig(struct osfs_sb_info *sb_info, uint32_t block)
+{
+    if (osfs_on_bdev(sb_info))
+        return 1;
+    if (!sb_info->data_chunks)
+        return sb_info->block_count - block;
+    return (1U << sb_info->data_chunk_shift) - (block & osfs_chunk_mask(sb_info));
+}
+
+/**
+ * Function: osfs_data_block_dirty
+ * Description: Records that a data block returned by osfs_data_block was
+ *              modified. Called after the change, as with mark_buffer_dirty.
+ */
+void osfs_data_block_dirty(struct osfs_sb_info *sb_info, uint32_t block)
+{
+    struct buffer_head *bh;
+
+    if (!osfs_on_bdev(sb_info) || block >= sb_info->block_count)
+        return;
+
+    bh = xa_load(&sb_info->bh_cache, sb_info->disk.s_data_start + block);
+    if (bh)
+        mark_buffer_dirty(bh);
+}
+
+/**
+ * Function: osfs_meta_block_dirty
+ * Description: Like osfs_data_block_dirty, for a data block holding
+ *              metadata (an extent tree node or a directory block): with a
+ *              journal the block joins the running transaction, so it is
+ *              called inside the handle of the change.
+ */
+void osfs_meta_block_dirty(struct osfs_sb_info *sb_info, uint32_t block)
+{
+    struct buffer_head *bh;
+
+    if (!osfs_on_bdev(sb_info) || block >= sb_info->block_count)
+        return;
+
+    bh = xa_load(&sb_info->bh_cache, sb_info->disk.s_data_start + block);
+    if (bh)
+        osfs_journal_dirty(sb_info, bh);
+}
+
+/**
+ * Function: osfs_data_blocks_prepare
+ * Description: Backs and clears newly allocated data blocks, so that no file
+ *              sees what a block held before. mem=sparse allocates the pages
+ *              under the blocks here; on a block device the blocks are set up
+ *              in the cache without being read first.
+ *              Called after the blocks are claimed, without the group lock.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block of the run.
+ *   - count: Number of blocks in the run.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if a sparse chunk cannot be allocated.
+ */
+int osfs_data_blocks_prepare(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count)
+{
+    uint32_t first, last, i;
+    struct buffer_head *bh;
+    struct page *page;
+
+    if (osfs_on_bdev(sb_info)) {
+        for (i = 0; i < count; i++) {
+            // A block that cannot be cached now is read on first use
+            bh = osfs_disk_bh(sb_info, sb_info->disk.s_data_start + start + i, true);
+            if (!bh)
+                continue;
+            lock_buffer(bh);
+            memset(bh->b_data, 0, bh->b_size);
+            unlock_buffer(bh);
+            mark_buffer_dirty(bh);
+        }
+        return 0;
+    }
+
+    if (sb_info->mem_mode == OSFS_MEM_SPARSE) {
+        first = start >> sb_info->data_chunk_shift;
+        last = (start + count - 1) >> sb_info->data_chunk_shift;
+        for (i = first; i <= last; i++) {
+            if (READ_ONCE(sb_info->data_chunks[i]))
+                continue;
+            page = alloc_page(GFP_NOFS | __GFP_ZERO);
+            if (!page)
+                return -ENOMEM;
+            // Blocks of one chunk may be claimed by several threads at once
+            if (cmpxchg(&sb_info->data_chunks[i], NULL, page_address(page)))
+                __free_page(page);
+        }
+    }
+
+    for (i = 0; i < count; i += osfs_data_contig(sb_info, start + i))
+        memset(osfs_data_block(sb_info, start + i), 0,
+               (size_t)min(count - i, osfs_data_contig(sb_info, start + i)) * BLOCK_SIZE);
+    return 0;
+}
+
+/**
+ * Function: osfs_data_blocks_release
+ * Description: Lets go of what backs freed data blocks. On a block device
+ *              the blocks leave the cache and pending writes of them are
+ *              discarded. With mem=sparse a chunk whose blocks are now all
+ *              free goes back to the page allocator.
+ *              Called with the group lock held, after the blocks are cleared
+ *              in the bitmap and before anyone can claim them again.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block of the run.
+ *   - count: Number of blocks in the run, all in one group.
+ * Returns:
+ *   - None.
+ */
+void osfs_data_blocks_release(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count)
+{
+    uint32_t first, last, i, cstart, cend;
+    struct buffer_head *bh;
+    void *chunk;
+
+    if (osfs_on_bdev(sb_info)) {
+        for (i = 0; i < count; i++) {
+            bh = xa_erase(&sb_info->bh_cache, sb_info->disk.s_data_start + start + i);
+            if (bh)
+                bforget(bh);
+        }
+        return;
+    }
+
+    if (sb_info->mem_mode != OSFS_MEM_SPARSE)
+        return;
+
+    // Chunks never span groups, so the group lock covers every bit looked at
+    first = start >> sb_info->data_chunk_shift;
+    last = (start + count - 1) >> sb_info->data_chunk_shift;
+    for (i = first; i <= last; i++) {
+        cstart = i << sb_info->data_chunk_shift;
+        cend = min(cstart + (1U << sb_info->data_chunk_shift), sb_info->block_count);
+        if (find_next_bit(sb_info->block_bitmap, cend, cstart) < cend)
+            continue;
+        chunk = xchg(&sb_info->data_chunks[i], NULL);
+        if (chunk)
+            free_page((unsigned long)chunk);
+    }
+}
+
+/**
+ * Function: osfs_block_cache_release
+ * Description: Unpins every cached device block at unmount. Dirty buffers
+ *              stay queued on the block device and are written by the
+ *              sync_blockdev in kill_block_super.
+ */
+void osfs_block_cache_release(struct osfs_sb_info *sb_info)
+{
+    struct buffer_head *bh;
+    unsigned long nr;
+
+    xa_for_each(&sb_info->bh_cache, nr, bh)
+        brelse(bh);
+    xa_destroy(&sb_info->bh_cache);
+}
@@ -0,0 +1,508 @@
+#include <linux/fs.h>
+#include <linux/lz4.h>
+#include <linux/pagemap.h>
+#include <linux/workqueue.h>
+#include "osfs.h"
+#include "osfs_trace.h"
+
+/**
+ * Compressed extents
+ *
+ * A memory mount with -o compress stores the data of cold files compressed
+ * with LZ4, so the same vmalloc region holds more of it. A file is queued
+ * when its page cache is written back, and OSFS_COMPRESS_DELAY after its
+ * last writeback a worker compresses its written extents in chunks of up to
+ * OSFS_COMPRESS_CHUNK blocks. A chunk is compressed into its own first
+ * blocks, behind an osfs_cext_header, the rest of them are freed, and the
+ * chunk becomes an extent of its own with OSFS_EXT_COMPRESSED set. A chunk
+ * that would not free at least one block, or whose blocks another file
+ * shares, stays as it is.
+ *
+ * Reads decompress a whole chunk into a buffer of the mount and copy from
+ * there into the page cache, so reading a chunk folio by folio decompresses
+ * it once. Anything that modifies the blocks of a compressed extent first
+ * inflates it back into ordinary blocks with osfs_inflate_blocks: writes,
+ * copy-on-write, a truncation into the middle of a block and the edges of a
+ * clone. Truncation at a block boundary only trims the extent, and freeing
+ * it frees its blocks; defragmentation moves a compressed extent as it is.
+ */
+
+#define OSFS_CEXT_MAGIC 0x051AC0DE
+#define OSFS_COMPRESS_CHUNK 32U         // Blocks compressed together, at most
+#define OSFS_COMPRESS_DELAY (30 * HZ)   // Time since the last writeback before a file is compressed
+
+// At the start of the first block of a compressed extent
+struct osfs_cext_header {
+    uint32_t ch_magic;                  // OSFS_CEXT_MAGIC
+    uint32_t ch_len;                    // Bytes of LZ4 data following the header
+    uint32_t ch_blocks;                 // Blocks the data decompresses to
+    uint32_t ch_reserved;
+};
+
+/**
+ * Struct: osfs_compress
+ * Description: Compression state of a mount: the buffers the worker and the
+ *              readers share under @lock and the queue of files to compress.
+ */
+struct osfs_compress {
+    struct osfs_sb_info *sb_info;
+
+    // Lock order: i_rwsem, invalidate lock, folio locks, journal handle, extent lock, then @lock
+    struct mutex lock;
+    void *data;                         // A chunk decompressed, or the source of a compression
+    void *packed;                       // A chunk compressed
+    void *wrkmem;                       // LZ4_MEM_COMPRESS bytes of state for LZ4_compress_default
+    uint32_t cached;                    // First block of the chunk @data holds, U32_MAX if none
+
+    spinlock_t queue_lock;
+    struct list_head queue;             // osfs_inode_info.i_compress_list, oldest writeback first
+    bool stopped;                       // Unmounting: nothing is queued any more
+    struct delayed_work work;
+};
+
+/**
+ * Function: osfs_ext_blocks
+ * Description: Returns the data blocks an extent occupies: its block count,
+ *              or what the header of a compressed extent says it takes.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ext: The extent.
+ * Returns:
+ *   - The number of data blocks; 1 for a compressed extent whose header is
+ *     corrupted, which is all it is known to take.
+ */
+uint32_t osfs_ext_blocks(struct osfs_sb_info *sb_info, const struct osfs_extent *ext)
+{
+    const struct osfs_cext_header *hdr;
+
+    if (!osfs_ext_is_compressed(ext))
+        return ext->block_count;
+
+    hdr = osfs_data_block(sb_info, osfs_ext_pblk(ext));
+    if (!hdr || hdr->ch_magic != OSFS_CEXT_MAGIC ||
+        hdr->ch_len > OSFS_COMPRESS_CHUNK * BLOCK_SIZE - sizeof(*hdr)) {
+        pr_err("osfs_ext_blocks: Corrupted compressed extent at block %u\n", osfs_ext_pblk(ext));
+        return 1;
+    }
+    return DIV_ROUND_UP(sizeof(*hdr) + hdr->ch_len, BLOCK_SIZE);
+}
+
+/**
+ * Function: osfs_compress_free
+ * Description: Frees the blocks of a compressed extent removed from a file
+ *              and forgets the chunk if the read buffer holds it. Compressed
+ *              blocks are never shared.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ext: The compressed extent.
+ * Returns:
+ *   - The number of blocks freed.
+ */
+uint32_t osfs_compress_free(struct osfs_sb_info *sb_info, const struct osfs_extent *ext)
+{
+    struct osfs_compress *c = sb_info->compress;
+    uint32_t blocks = osfs_ext_blocks(sb_info, ext);
+
+    if (c) {
+        mutex_lock(&c->lock);
+        if (c->cached == osfs_ext_pblk(ext))
+            c->cached = U32_MAX;
+        mutex_unlock(&c->lock);
+    }
+    osfs_free_blocks(sb_info, osfs_ext_pblk(ext), blocks);
+    return blocks;
+}
+
+/**
+ * Function: osfs_compress_load
+ * Description: Decompresses the chunk of a compressed extent into c->data,
+ *              unless it is there already. Called with c->lock held.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if the chunk is corrupted or a block cannot be read.
+ */
+static int osfs_compress_load(struct osfs_compress *c, const struct osfs_extent *ext)
+{
+    struct osfs_sb_info *sb_info = c->sb_info;
+    uint32_t pblk = osfs_ext_pblk(ext), len, chunk, blocks, i;
+    const struct osfs_cext_header *hdr;
+    void *src, *from;
+    int out;
+
+    if (c->cached == pblk)
+        return 0;
+
+    hdr = osfs_data_block(sb_info, pblk);
+    if (!hdr)
+        return -EIO;
+    len = hdr->ch_len;
+    chunk = hdr->ch_blocks;
+    if (hdr->ch_magic != OSFS_CEXT_MAGIC || len > OSFS_COMPRESS_CHUNK * BLOCK_SIZE - sizeof(*hdr) ||
+        chunk > OSFS_COMPRESS_CHUNK || chunk < ext->block_count) {
+        pr_err("osfs_compress_load: Corrupted compressed extent at block %u\n", pblk);
+        return -EIO;
+    }
+
+    // The blocks of a chunk may straddle two chunks of a mem=huge or mem=sparse data area
+    blocks = DIV_ROUND_UP(sizeof(*hdr) + len, BLOCK_SIZE);
+    src = (void *)hdr;
+    if (osfs_data_contig(sb_info, pblk) < blocks) {
+        for (i = 0; i < blocks; i++) {
+            from = osfs_data_block(sb_info, pblk + i);
+            if (!from)
+                return -EIO;
+            memcpy(c->packed + (size_t)i * BLOCK_SIZE, from, BLOCK_SIZE);
+        }
+        src = c->packed;
+    }
+
+    c->cached = U32_MAX;
+    out = LZ4_decompress_safe(src + sizeof(*hdr), c->data, len, chunk * BLOCK_SIZE);
+    if (out != chunk * BLOCK_SIZE) {
+        pr_err("osfs_compress_load: Compressed extent at block %u does not decompress (%d)\n",
+               pblk, out);
+        return -EIO;
+    }
+    c->cached = pblk;
+    osfs_stat_inc(sb_info, OSFS_STAT_DECOMPRESS_CHUNKS);
+    return 0;
+}
+
+/**
+ * Function: osfs_compress_read
+ * Description: Copies decompressed file data out of the compressed extent
+ *              holding @pos, for reads that osfs_map_file_offset turned away
+ *              with -ENODATA. The caller holds the inode's extent lock,
+ *              shared is enough.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - pos: Byte offset in the file.
+ *   - buf: Where to copy to.
+ *   - len: Bytes to copy; they must not run past the extent.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if @pos is not in a compressed extent, or the extent cannot be
+ *     decompressed.
+ */
+int osfs_compress_read(struct inode *inode, loff_t pos, void *buf, size_t len)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_compress *c = sb_info->compress;
+    struct osfs_extent ext;
+    size_t offset;
+    int ret;
+
+    ret = osfs_ext_lookup(sb_info, OSFS_I(inode)->raw, pos / BLOCK_SIZE, &ext);
+    if (ret || !c || !osfs_ext_is_compressed(&ext))
+        return -EIO;
+    offset = pos - (loff_t)ext.logical_block * BLOCK_SIZE;
+    if (offset + len > (size_t)ext.block_count * BLOCK_SIZE)
+        return -EIO;
+
+    mutex_lock(&c->lock);
+    ret = osfs_compress_load(c, &ext);
+    if (!ret)
+        memcpy(buf, c->data + offset, len);
+    mutex_unlock(&c->lock);
+    return ret;
+}
+
+/**
+ * Function: osfs_compress_chunk
+ * Description: Compresses [@lblk, @lblk + @count) of a file, which one
+ *              written extent maps at @pblk, into the first of its blocks,
+ *              makes it a compressed extent and frees the blocks left over.
+ *              Called with the extent lock held exclusively and c->lock.
+ * Returns:
+ *   - The number of blocks freed, 0 if compressing would not free any.
+ *   - -ENOSPC or -ENOMEM if the extent cannot be split; the data is restored.
+ *   - -EIO if a block cannot be read or the tree is corrupted.
+ */
+static long osfs_compress_chunk(struct osfs_compress *c, struct inode *inode, uint32_t lblk,
+                                uint32_t pblk, uint32_t count)
+{
+    struct osfs_sb_info *sb_info = c->sb_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    struct osfs_cext_header *hdr = c->packed;
+    uint32_t blocks, i;
+    void *addr;
+    int len, ret;
+
+    c->cached = U32_MAX;
+    for (i = 0; i < count; i++) {
+        addr = osfs_data_block(sb_info, pblk + i);
+        if (!addr)
+            return -EIO;
+        memcpy(c->data + (size_t)i * BLOCK_SIZE, addr, BLOCK_SIZE);
+    }
+
+    // Output that does not fit in one block less is not worth keeping
+    len = LZ4_compress_default(c->data, c->packed + sizeof(*hdr), count * BLOCK_SIZE,
+                               (count - 1) * BLOCK_SIZE - sizeof(*hdr), c->wrkmem);
+    if (len <= 0)
+        return 0;
+    hdr->ch_magic = OSFS_CEXT_MAGIC;
+    hdr->ch_len = len;
+    hdr->ch_blocks = count;
+    hdr->ch_reserved = 0;
+    blocks = DIV_ROUND_UP(sizeof(*hdr) + len, BLOCK_SIZE);
+
+    for (i = 0; i < blocks; i++) {
+        memcpy(osfs_data_block(sb_info, pblk + i), c->packed + (size_t)i * BLOCK_SIZE,
+               BLOCK_SIZE);
+        osfs_data_block_dirty(sb_info, pblk + i);
+    }
+    ret = osfs_ext_remap(sb_info, osfs_inode, lblk, count, pblk | OSFS_EXT_COMPRESSED);
+    if (ret) {
+        for (i = 0; i < blocks; i++)
+            memcpy(osfs_data_block(sb_info, pblk + i), c->data + (size_t)i * BLOCK_SIZE,
+                   BLOCK_SIZE);
+        return ret;
+    }
+
+    // c->data still holds the chunk decompressed
+    c->cached = pblk;
+    osfs_free_blocks(sb_info, pblk + blocks, count - blocks);
+    osfs_inode->i_blocks -= count - blocks;
+    osfs_stat_inc(sb_info, OSFS_STAT_COMPRESS_CHUNKS);
+    osfs_stat_add(sb_info, OSFS_STAT_COMPRESS_SAVED, count - blocks);
+    trace_osfs_compress_extent(sb_info, osfs_inode->i_ino, lblk, count, blocks);
+    return count - blocks;
+}
+
+/**
+ * Function: osfs_compress_extents
+ * Description: Compresses every chunk of the written extents of a file that
+ *              is worth it. Extents already compressed, unwritten extents,
+ *              single blocks and shared blocks are skipped. Called with the
+ *              extent lock held exclusively and c->lock.
+ * Returns:
+ *   - The number of blocks freed.
+ */
+static long osfs_compress_extents(struct osfs_compress *c, struct inode *inode)
+{
+    struct osfs_sb_info *sb_info = c->sb_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    uint32_t lblk = 0, start, count, pblk, shared, shared_len;
+    struct osfs_extent ext;
+    long freed = 0, ret;
+
+    while (!osfs_ext_next(sb_info, osfs_inode, lblk, &ext)) {
+        start = max(lblk, ext.logical_block);
+        count = min(ext.logical_block + ext.block_count - start, OSFS_COMPRESS_CHUNK);
+        pblk = osfs_ext_pblk(&ext) + (start - ext.logical_block);
+        lblk = start + count;
+        if ((ext.start_block & OSFS_EXT_FLAGS) || count < 2 ||
+            osfs_share_find(sb_info, pblk, count, &shared, &shared_len))
+            continue;
+
+        ret = osfs_compress_chunk(c, inode, start, pblk, count);
+        if (ret < 0) {
+            pr_err("osfs_compress_extents: Failed to compress blocks %u-%u of inode %lu (%ld)\n",
+                   start, start + count - 1, inode->i_ino, ret);
+            break;
+        }
+        freed += ret;
+        cond_resched();
+    }
+    return freed;
+}
+
+/**
+ * Function: osfs_compress_inode
+ * Description: Compresses a cold file. i_rwsem and the invalidate lock keep
+ *              writes, faults and direct I/O out; a file that got dirty
+ *              again is left for the writeback that queues it anew.
+ */
+static void osfs_compress_inode(struct osfs_compress *c, struct inode *inode)
+{
+    struct address_space *mapping = inode->i_mapping;
+    struct osfs_handle handle;
+    long freed = 0;
+
+    inode_lock(inode);
+    inode_dio_wait(inode);
+    filemap_invalidate_lock(mapping);
+    if (!inode->i_nlink || mapping_tagged(mapping, PAGECACHE_TAG_DIRTY) ||
+        mapping_tagged(mapping, PAGECACHE_TAG_WRITEBACK))
+        goto out;
+
+    osfs_journal_start(c->sb_info, &handle);
+    down_write(osfs_ext_sem(inode));
+    if (!osfs_inode_is_inline(OSFS_I(inode)->raw)) {
+        mutex_lock(&c->lock);
+        freed = osfs_compress_extents(c, inode);
+        mutex_unlock(&c->lock);
+    }
+    osfs_ext_cache_reset(inode);
+    up_write(osfs_ext_sem(inode));
+    // The extent root lives in the inode
+    if (freed)
+        mark_inode_dirty(inode);
+    osfs_journal_stop(&handle);
+out:
+    filemap_invalidate_unlock(mapping);
+    inode_unlock(inode);
+}
+
+/**
+ * Function: osfs_compress_work
+ * Description: Compresses the queued files whose last writeback is at least
+ *              OSFS_COMPRESS_DELAY old, and runs again when the next one is.
+ *              A file being evicted is dropped from the queue instead.
+ */
+static void osfs_compress_work(struct work_struct *work)
+{
+    struct osfs_compress *c = container_of(to_delayed_work(work), struct osfs_compress, work);
+    struct super_block *sb = c->sb_info->sb;
+    unsigned long delay = 0;
+    struct osfs_inode_info *oi;
+    struct inode *inode;
+
+    // A frozen filesystem is tried again later
+    if (!sb_start_write_trylock(sb)) {
+        delay = OSFS_COMPRESS_DELAY;
+        goto requeue;
+    }
+
+    spin_lock(&c->queue_lock);
+    while (!list_empty(&c->queue) && !c->stopped) {
+        oi = list_first_entry(&c->queue, struct osfs_inode_info, i_compress_list);
+        if (time_before(jiffies, oi->i_compress_time + OSFS_COMPRESS_DELAY)) {
+            delay = oi->i_compress_time + OSFS_COMPRESS_DELAY - jiffies;
+            break;
+        }
+        list_del_init(&oi->i_compress_list);
+        inode = igrab(&oi->vfs_inode);
+        spin_unlock(&c->queue_lock);
+
+        if (inode) {
+            osfs_compress_inode(c, inode);
+            iput(inode);
+        }
+        cond_resched();
+        spin_lock(&c->queue_lock);
+    }
+    spin_unlock(&c->queue_lock);
+    sb_end_write(sb);
+
+requeue:
+    spin_lock(&c->queue_lock);
+    if (delay && !c->stopped)
+        queue_delayed_work(system_unbound_wq, &c->work, delay);
+    spin_unlock(&c->queue_lock);
+}
+
+/**
+ * Function: osfs_compress_queue
+ * Description: Queues a regular file for compression after its page cache
+ *              was written back; a file already queued moves to the end, as
+ *              it is not cold yet.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ * Returns:
+ *   - None.
+ */
+void osfs_compress_queue(struct inode *inode)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_compress *c = sb_info->compress;
+    struct osfs_inode_info *oi = OSFS_I(inode);
+
+    if (!c || !S_ISREG(inode->i_mode))
+        return;
+
+    spin_lock(&c->queue_lock);
+    if (!c->stopped) {
+        oi->i_compress_time = jiffies;
+        list_move_tail(&oi->i_compress_list, &c->queue);
+        queue_delayed_work(system_unbound_wq, &c->work, OSFS_COMPRESS_DELAY);
+    }
+    spin_unlock(&c->queue_lock);
+}
+
+/**
+ * Function: osfs_compress_forget
+ * Description: Takes an inode being evicted off the compression queue.
+ */
+void osfs_compress_forget(struct inode *inode)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_compress *c = sb_info->compress;
+
+    if (!c)
+        return;
+
+    spin_lock(&c->queue_lock);
+    list_del_init(&OSFS_I(inode)->i_compress_list);
+    spin_unlock(&c->queue_lock);
+}
+
+/**
+ * Function: osfs_compress_init
+ * Description: Sets up compression for a memory mount with -o compress.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the buffers cannot be allocated.
+ */
+int osfs_compress_init(struct osfs_sb_info *sb_info)
+{
+    struct osfs_compress *c;
+
+    c = kzalloc(sizeof(*c), GFP_KERNEL);
+    if (!c)
+        return -ENOMEM;
+    c->sb_info = sb_info;
+    mutex_init(&c->lock);
+    c->cached = U32_MAX;
+    spin_lock_init(&c->queue_lock);
+    INIT_LIST_HEAD(&c->queue);
+    INIT_DELAYED_WORK(&c->work, osfs_compress_work);
+    // From here on osfs_compress_destroy frees it if the mount fails
+    sb_info->compress = c;
+
+    c->data = kvmalloc(OSFS_COMPRESS_CHUNK * BLOCK_SIZE, GFP_KERNEL);
+    c->packed = kvmalloc(OSFS_COMPRESS_CHUNK * BLOCK_SIZE, GFP_KERNEL);
+    c->wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+    if (!c->data || !c->packed || !c->wrkmem)
+        return -ENOMEM;
+    return 0;
+}
+
+/**
+ * Function: osfs_compress_stop
+ * Description: Stops the compression worker before the filesystem shuts
+ *              down, so that it holds no inode while they are evicted.
+ */
+void osfs_compress_stop(struct osfs_sb_info *sb_info)
+{
+    struct osfs_compress *c = sb_info->compress;
+
+    if (!c)
+        return;
+
+    spin_lock(&c->queue_lock);
+    c->stopped = true;
+    spin_unlock(&c->queue_lock);
+    cancel_delayed_work_sync(&c->work);
+}
+
+/**
+ * Function: osfs_compress_destroy
+ * Description: Frees the compression state once every inode is evicted.
+ */
+void osfs_compress_destroy(struct osfs_sb_info *sb_info)
+{
+    struct osfs_compress *c = sb_info->compress;
+
+    if (!c)
+        return;
+
+    kvfree(c->wrkmem);
+    kvfree(c->packed);
+    kvfree(c->data);
+    kfree(c);
+    sb_info->compress = NULL;
+}
@@ -1,7 +1,9 @@
 #include <linux/fs.h>
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/iversion.h>
 #include "osfs.h"
+#include "osfs_trace.h"
 //
 /**
  * Function: osfs_lookup
@@ -16,49 +18,60 @@
  */
 static struct dentry *osfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
 {
-    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
-    struct osfs_inode *parent_inode = dir->i_private;
-    struct osfs_dir_entry *dir_entries;
-    int dir_entry_count = 0;
-    int i, j;
     struct inode *inode = NULL;
+    uint32_t ino = 0;
+    int ret;
 
-    pr_info("osfs_lookup: Looking up '%.*s' in inode %lu\n",
-            (int)dentry->d_name.len, dentry->d_name.name, dir->i_ino);
-
-    // 遍歷每個 extent 來讀取目錄數據
-    for (i = 0; i < parent_inode->extent_count; i++) {
-        void *extent_start = sb_info->data_blocks + parent_inode->extents[i].start_block * BLOCK_SIZE;
-        int extent_size = parent_inode->extents[i].block_count * BLOCK_SIZE;
-        int extent_entry_count = extent_size / sizeof(struct osfs_dir_entry);
-
-        dir_entries = (struct osfs_dir_entry *)extent_start;
-
-        //  extent 中的所有目錄項
-        for (j = 0; j < extent_entry_count; j++) {
-            if (strlen(dir_entries[j].filename) == dentry->d_name.len &&
-                strncmp(dir_entries[j].filename, dentry->d_name.name, dentry->d_name.len) == 0) {
-                // 找到文件，獲取 inode
-                pr_info("CHECKING %s",dir_entries[j].filename);
-                inode = osfs_iget(dir->i_sb, dir_entries[j].inode_no);
-                if (IS_ERR(inode)) {
-                    pr_err("osfs_lookup: Error getting inode %u\n", dir_entries[j].inode_no);
-                    return ERR_CAST(inode);
-                }
-                return d_splice_alias(inode, dentry);
-            }
+    // 以名稱的 hash 查詢目錄索引，只需檢查一個 bucket
+    ret = osfs_dir_index_find(dir, dentry->d_name.name, dentry->d_name.len, &ino);
+    trace_osfs_lookup(dir, &dentry->d_name, ino, ret == 0);
+    if (ret == 0 || ret == -ENOENT)
+        osfs_stat_inc(dir->i_sb->s_fs_info, ret ? OSFS_STAT_LOOKUP_MISSES : OSFS_STAT_LOOKUP_HITS);
+    if (ret == 0) {
+        inode = osfs_iget(dir->i_sb, ino);
+        if (IS_ERR(inode)) {
+            pr_err("osfs_lookup: Error getting inode %u\n", ino);
+            return ERR_CAST(inode);
         }
-        dir_entry_count += extent_entry_count;
+    } else if (ret != -ENOENT) {
+        return ERR_PTR(ret);
     }
 
-    // 如果找不到文件，返回 NULL
-    return NULL;
+    // 找不到時 inode 為 NULL，建立 negative dentry
+    return d_splice_alias(inode, dentry);
 }
 
 
+/**
+ * Function: osfs_dir_revalidate_offset
+ * Description: Moves a readdir cookie that may no longer sit on a record
+ *              boundary forward to the next record of its block.
+ * Inputs:
+ *   - data: The directory block.
+ *   - offset: Offset of the cookie within the block.
+ * Returns:
+ *   - The offset of the first record at or after @offset.
+ */
+static unsigned int osfs_dir_revalidate_offset(char *data, unsigned int offset)
+{
+    struct osfs_dir_entry *entry;
+    unsigned int i;
+
+    for (i = 0; i < offset; i += entry->rec_len) {
+        entry = (struct osfs_dir_entry *)(data + i);
+        if (!osfs_dir_rec_ok(entry, i))
+            break;
+    }
+    return i;
+}
+
 /**
  * Function: osfs_iterate
  * Description: Iterates over the entries in a directory.
+ *              ctx->pos is 2 plus the byte offset of the next record, so each
+ *              call resumes exactly where the last one stopped. Records never
+ *              move, but when the directory changed since the last call the
+ *              cookie is re-aligned to a record boundary first.
  * Inputs:
  *   - filp: The file pointer representing the directory.
  *   - ctx: The directory context used for iteration.
@@ -70,41 +83,49 @@ static int osfs_iterate(struct file *filp, struct dir_context *ctx)
 {
     struct inode *inode = file_inode(filp);
     struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
-    struct osfs_inode *osfs_inode = inode->i_private;
-    struct osfs_dir_entry *dir_entries;
-    int i, j;
-    size_t extent_size, extent_entry_count;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    struct osfs_dir_entry *entry;
+    uint32_t block, nr_blocks;
+    unsigned int offset;
+    bool need_revalidate = !inode_eq_iversion(inode, filp->f_version);
+    char *data;
 
     // Output initial dot entries like '.' and '..'
-    if (ctx->pos == 0) {
-        if (!dir_emit_dots(filp, ctx))
-            return 0;
-    }
-
-    // Iterate through each extent to read directory entries
-    for (i = 0; i < osfs_inode->extent_count; i++) {
-        void *extent_start = sb_info->data_blocks + osfs_inode->extents[i].start_block * BLOCK_SIZE;
-        extent_size = osfs_inode->extents[i].block_count * BLOCK_SIZE;
-        extent_entry_count = extent_size / sizeof(struct osfs_dir_entry);
-        dir_entries = (struct osfs_dir_entry *)extent_start;
-
-        // Traverse the entries within this extent
-        for (j = ctx->pos - 2; j < extent_entry_count; j++) {
-            struct osfs_dir_entry *entry = &dir_entries[j];
-            unsigned int type = DT_UNKNOWN;
-
-            if (entry->inode_no == 0)
-                continue;  // Skip unused entries
-
-            // Emit the directory entry
-            pr_info("osfs_iterate: Emitting entry '%s' with inode %u\n", entry->filename, entry->inode_no);
+    if (!dir_emit_dots(filp, ctx))
+        return 0;
+
+    nr_blocks = osfs_ext_end(sb_info, osfs_inode);
+    block = (ctx->pos - 2) / BLOCK_SIZE;
+    offset = (ctx->pos - 2) % BLOCK_SIZE;
+
+    // Walk the records of every directory block from the cookie on
+    for (; block < nr_blocks; block++, offset = 0) {
+        data = osfs_dir_block(inode, block);
+        if (!data)
+            return -EIO;
+
+        if (need_revalidate) {
+            offset = osfs_dir_revalidate_offset(data, offset);
+            ctx->pos = 2 + (loff_t)block * BLOCK_SIZE + offset;
+            filp->f_version = inode_query_iversion(inode);
+            need_revalidate = false;
+        }
 
-            if (!dir_emit(ctx, entry->filename, strlen(entry->filename), entry->inode_no, type)) {
-                pr_err("osfs_iterate: dir_emit failed for entry '%s'\n", entry->filename);
-                return -EINVAL;
+        for (; offset < BLOCK_SIZE; offset += entry->rec_len) {
+            entry = (struct osfs_dir_entry *)(data + offset);
+            if (!osfs_dir_rec_ok(entry, offset)) {
+                pr_err("osfs_iterate: Bad record in block %u of directory %lu\n",
+                       block, inode->i_ino);
+                return -EIO;
             }
 
-            ctx->pos++;  // Update position after successfully emitting an entry
+            // Unused records are stepped over but still advance the cookie
+            if (entry->inode_no &&
+                !dir_emit(ctx, entry->name, entry->name_len, entry->inode_no,
+                          fs_ftype_to_dtype(entry->file_type)))
+                return 0;  // The user buffer is full; resume here next time
+
+            ctx->pos = 2 + (loff_t)block * BLOCK_SIZE + offset + entry->rec_len;
         }
     }
 
@@ -118,14 +139,16 @@ static int osfs_iterate(struct file *filp, struct dir_context *ctx)
 
 /**
  * Function: osfs_new_inode
- * Description: Creates a new inode within the filesystem.
+ * Description: Creates a new inode within the filesystem. The inode starts
+ *              with no data blocks; they are allocated on first write. A
+ *              regular file starts with inline data.
  * Inputs:
  *   - dir: The inode of the directory where the new inode will be created.
  *   - mode: The mode (permissions and type) for the new inode.
  * Returns:
  *   - A pointer to the newly created inode on success.
  *   - ERR_PTR(-EINVAL) if the file type is not supported.
- *   - ERR_PTR(-ENOSPC) if there are no free inodes or blocks.
+ *   - ERR_PTR(-ENOSPC) if there are no free inodes.
  *   - ERR_PTR(-ENOMEM) if memory allocation fails.
  *   - ERR_PTR(-EIO) if an I/O error occurs.
  */
@@ -135,8 +158,7 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
     struct osfs_sb_info *sb_info = sb->s_fs_info;
     struct inode *inode;
     struct osfs_inode *osfs_inode;
-    int ino, ret;
-    uint32_t required_blocks = 1;  // 假設初始分配1個data block
+    int ino;
 
     /* Check if the mode is supported */
     if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode)) {
@@ -144,19 +166,21 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
         return ERR_PTR(-EINVAL);
     }
 
-    /* Check if there are free inodes and blocks */
-    if (sb_info->nr_free_inodes == 0 || sb_info->nr_free_blocks == 0)
+    /* Check if there are free inodes */
+    if (percpu_counter_read_positive(&sb_info->nr_free_inodes) == 0)
         return ERR_PTR(-ENOSPC);
 
-    /* Allocate a new inode number */
-    ino = osfs_get_free_inode(sb_info);
-    if (ino < 0 || ino >= sb_info->inode_count)
+    /* Allocate a new inode number; it also updates the free inode count */
+    ino = osfs_get_free_inode(sb_info, dir, mode);
+    if (ino < 0)
         return ERR_PTR(-ENOSPC);
 
     /* Allocate a new VFS inode */
     inode = new_inode(sb);
-    if (!inode)
+    if (!inode) {
+        osfs_put_free_inode(sb_info, ino);
         return ERR_PTR(-ENOMEM);
+    }
 
     /* Initialize inode owner and permissions */
     inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
@@ -174,6 +198,7 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
     } else if (S_ISREG(mode)) {
         inode->i_op = &osfs_file_inode_operations;
         inode->i_fop = &osfs_file_operations;
+        inode->i_mapping->a_ops = &osfs_aops;
         set_nlink(inode, 1);
         inode->i_size = 0;
     } else if (S_ISLNK(mode)) {
@@ -187,31 +212,37 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
     if (!osfs_inode) {
         pr_err("osfs_new_inode: Failed to get osfs_inode for inode %d\n", ino);
         iput(inode);
+        osfs_put_free_inode(sb_info, ino);
         return ERR_PTR(-EIO);
     }
     memset(osfs_inode, 0, sizeof(*osfs_inode));
 
     /* Initialize osfs_inode */
     osfs_inode->i_ino = ino;
+    if (S_ISREG(mode))
+        osfs_inode->i_flags = OSFS_INLINE_DATA_FL;  // Small files never need a data block
+    else
+        osfs_ext_init(osfs_inode);
     osfs_inode->i_mode = inode->i_mode;
+    osfs_inode->i_links_count = inode->i_nlink;
     osfs_inode->i_uid = i_uid_read(inode);
     osfs_inode->i_gid = i_gid_read(inode);
     osfs_inode->i_size = inode->i_size;
     osfs_inode->i_blocks = 0;  // 初始化為 0
     osfs_inode->__i_atime = osfs_inode->__i_mtime = osfs_inode->__i_ctime = current_time(inode);
-    inode->i_private = osfs_inode;
-
-    /* Allocate extent */
-    ret = osfs_alloc_extent(sb_info, required_blocks, osfs_inode);
-    if (ret) {
-        pr_err("osfs_new_inode: Failed to allocate extent\n");
+    OSFS_I(inode)->raw = osfs_inode;
+
+    /* Hash the inode so that osfs_iget finds it; it stays I_NEW until the caller instantiates it */
+    if (insert_inode_locked(inode) < 0) {
+        pr_err("osfs_new_inode: Inode %d is already in use\n", ino);
+        /* Evict must neither treat the inode as live nor release the number a second time */
+        clear_nlink(inode);
+        OSFS_I(inode)->raw = NULL;
         iput(inode);
-        return ERR_PTR(ret);
+        osfs_put_free_inode(sb_info, ino);
+        return ERR_PTR(-EIO);
     }
 
-    /* Update superblock information */
-    sb_info->nr_free_inodes--;
-
     /* Mark inode as dirty */
     mark_inode_dirty(inode);
 
@@ -219,13 +250,25 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
 }
 
 
-static int osfs_add_dir_entry(struct inode *dir, uint32_t inode_no, const char *name, size_t name_len)
+/**
+ * Function: osfs_add_dir_entry
+ * Description: Adds an entry to a directory. The free slot comes from the
+ *              directory index, so no entries are scanned.
+ * Inputs:
+ *   - dir: The directory inode.
+ *   - inode_no: Inode number of the new entry.
+ *   - mode: Mode of the new inode, recorded as the entry's file type.
+ *   - name: Name of the new entry.
+ *   - name_len: Length of the name.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENAMETOOLONG if the name is too long.
+ *   - A negative error code from the directory index on failure.
+ */
+static int osfs_add_dir_entry(struct inode *dir, uint32_t inode_no, umode_t mode,
+                              const char *name, size_t name_len)
 {
-    struct osfs_inode *parent_inode = dir->i_private;
-    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
-    struct osfs_dir_entry *dir_entries;
-    void *data_block;
-    int i, j, dir_entry_count, ret;
+    int ret;
 
     // 確認名字的長度
     if (name_len > MAX_FILENAME_LEN) {
@@ -233,42 +276,37 @@ static int osfs_add_dir_entry(struct inode *dir, uint32_t inode_no, const char *
         return -ENAMETOOLONG;
     }
 
-    // 確定目錄的data block位置
-    for (i = 0; i < parent_inode->extent_count; i++) {
-        data_block = sb_info->data_blocks + parent_inode->extents[i].start_block * BLOCK_SIZE;
-        dir_entries = (struct osfs_dir_entry *)data_block;
-        dir_entry_count = parent_inode->extents[i].block_count * (BLOCK_SIZE / sizeof(struct osfs_dir_entry));
-
-        // 查找空閒目錄
-        for (j = 0; j < dir_entry_count; j++) {
-            if (dir_entries[j].inode_no == 0) {
-                dir_entries[j].inode_no = inode_no;
-                strncpy(dir_entries[j].filename, name, name_len);
-                dir_entries[j].filename[name_len] = '\0';
-                pr_info("osfs_add_dir_entry: Added entry '%s' with inode %u\n", name, inode_no);
-                return 0;
-            }
-        }
-    }
-
-    // 如果沒有找到空閒目錄項，分配新的 extent
-    pr_info("osfs_add_dir_entry: No free entry found, allocating new extent\n");
-    ret = osfs_alloc_extent(sb_info, 1, parent_inode); 
+    ret = osfs_dir_index_add(dir, name, name_len, inode_no, fs_umode_to_ftype(mode));
     if (ret) {
-        pr_err("osfs_add_dir_entry: Failed to allocate new extent\n");
+        pr_err("osfs_add_dir_entry: Failed to add entry '%.*s'\n", (int)name_len, name);
         return ret;
     }
 
-
-    return osfs_add_dir_entry(dir, inode_no, name, name_len);
+    return 0;
 }
 
 
 
 
+/**
+ * Function: osfs_discard_new_inode
+ * Description: Drops an inode returned by osfs_new_inode that could not be
+ *              linked into the directory. With no links it is evicted right
+ *              away instead of staying in the inode cache.
+ */
+static void osfs_discard_new_inode(struct inode *inode)
+{
+    clear_nlink(inode);
+    discard_new_inode(inode);
+}
+
 /**
  * Function: osfs_create
- * Description: Creates a new file within a directory.
+ * Description: Creates a new file within a directory. The directory entry
+ *              is reserved before the inode is allocated, so both are taken
+ *              in one pass, and the file holds no data block until its first
+ *              write. Everything it changes goes into one journal
+ *              transaction.
  * Inputs:
  *   - idmap: The mount namespace ID map.
  *   - dir: The inode of the parent directory.
@@ -284,11 +322,9 @@ static int osfs_add_dir_entry(struct inode *dir, uint32_t inode_no, const char *
  */
 static int osfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
 {
-    struct osfs_inode *parent_inode = dir->i_private;
-    struct osfs_inode *osfs_inode;
+    struct osfs_handle handle;
     struct inode *inode;
     int ret;
-    struct osfs_extent extent;
 
     // Step 1: Validate the file name length
     if (dentry->d_name.len > MAX_FILENAME_LEN) {
@@ -296,67 +332,85 @@ static int osfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry
         return -ENAMETOOLONG;
     }
 
-    // Step 2: Allocate and initialize VFS & osfs inode
-    inode = osfs_new_inode(dir, mode);
-    if (IS_ERR(inode)) {
-        pr_err("osfs_create: Failed to allocate inode\n");
-        return PTR_ERR(inode);
-    }
-    osfs_inode = inode->i_private;
-    if (!osfs_inode) {
-        pr_err("osfs_create: Failed to get osfs_inode for inode %lu\n", inode->i_ino);
-        iput(inode);
-        return -EIO;
-    }
-
-    // Step 3: Initialize osfs_inode attributes
-    osfs_inode->i_size = 0;
-    osfs_inode->i_blocks = 0;
+    osfs_journal_start(dir->i_sb->s_fs_info, &handle);
 
-    // Step 4: Allocate extent for the new file
-    ret = osfs_alloc_extent(dir->i_sb->s_fs_info, 1, osfs_inode);  // Assuming we need only 1 block initially
+    // Step 2: Reserve the directory entry first, so a full directory fails before any inode is taken
+    ret = osfs_dir_index_reserve(dir, dentry->d_name.len);
     if (ret) {
-        pr_err("osfs_create: Failed to allocate extent\n");
-        iput(inode);
-        return ret;
+        pr_err("osfs_create: No room for '%.*s' in directory %lu\n",
+               (int)dentry->d_name.len, dentry->d_name.name, dir->i_ino);
+        goto out;
     }
 
-    // Initialize extent information
-    osfs_inode->extent_count = 1;
+    // Step 3: Allocate and initialize VFS & osfs inode; it holds no data blocks until written
+    inode = osfs_new_inode(dir, mode);
+    if (IS_ERR(inode)) {
+        pr_err("osfs_create: Failed to allocate inode\n");
+        ret = PTR_ERR(inode);
+        goto out;
+    }
 
-    // Step 5: Parent directory entry update for the new file
-    ret = osfs_add_dir_entry(dir, inode->i_ino, dentry->d_name.name, dentry->d_name.len);
+    // Step 4: Fill the reserved directory entry
+    ret = osfs_add_dir_entry(dir, inode->i_ino, inode->i_mode,
+                             dentry->d_name.name, dentry->d_name.len);
     if (ret) {
         pr_err("osfs_create: Failed to add directory entry\n");
-        iput(inode);
-        return ret;
+        osfs_discard_new_inode(inode);
+        goto out;
     }
 
-    // Step 6: Update the parent directory's metadata
-    parent_inode->i_size += sizeof(struct osfs_dir_entry);
+    // Step 5: Update the parent directory's times; its size follows the blocks it holds
+    dir->__i_ctime = dir->__i_mtime = current_time(dir);
     mark_inode_dirty(dir);
-    parent_inode->__i_mtime = parent_inode->__i_atime = current_time(dir);
-    dir->__i_atime = dir->__i_mtime = current_time(dir);
-
-    dir->i_size = parent_inode->i_size;
-
-    // Step 7: Bind the inode to the VFS dentry
-    d_instantiate(dentry, inode);
 
-    pr_info("osfs_create: File '%.*s' created with inode %lu\n",
-            (int)dentry->d_name.len, dentry->d_name.name, inode->i_ino);
+    // Step 6: Bind the inode to the VFS dentry and clear I_NEW
+    d_instantiate_new(dentry, inode);
 
-    return 0;
+    trace_osfs_create(dir, &dentry->d_name, inode->i_ino);
+out:
+    osfs_journal_stop(&handle);
+    return ret;
 }
+/**
+ * Function: osfs_unlink
+ * Description: Removes a name from a directory. The inode itself, with its
+ *              blocks and inode number, is released by osfs_evict_inode once
+ *              its last link and last user are gone.
+ * Inputs:
+ *   - dir: The directory holding the name.
+ *   - dentry: The dentry of the name to remove.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from osfs_dir_index_remove on failure.
+ */
+static int osfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+    struct inode *inode = d_inode(dentry);
+    struct osfs_handle handle;
+    int ret;
 
+    osfs_journal_start(dir->i_sb->s_fs_info, &handle);
+    ret = osfs_dir_index_remove(dir, dentry->d_name.name, dentry->d_name.len);
+    if (ret) {
+        pr_err("osfs_unlink: Failed to remove '%.*s' from directory %lu\n",
+               (int)dentry->d_name.len, dentry->d_name.name, dir->i_ino);
+        goto out;
+    }
 
-
-
-
+    dir->__i_ctime = dir->__i_mtime = current_time(dir);
+    inode->__i_ctime = dir->__i_ctime;
+    drop_nlink(inode);
+    mark_inode_dirty(inode);
+    mark_inode_dirty(dir);
+out:
+    osfs_journal_stop(&handle);
+    return ret;
+}
 
 const struct inode_operations osfs_dir_inode_operations = {
     .lookup = osfs_lookup,
     .create = osfs_create,
+    .unlink = osfs_unlink,
     // Add other operations as needed
 };
 
@@ -0,0 +1,740 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/stringhash.h>
+#include <linux/iversion.h>
+#include "osfs.h"
+
+#define OSFS_DIR_INDEX_MIN_BITS 4
+#define OSFS_DIR_GROW_MAX       8       // Most blocks a directory grows by at once
+
+/**
+ * Struct: osfs_dir_slot
+ * Description: One live directory record known to the index, kept in the hash
+ *              bucket of its name.
+ */
+struct osfs_dir_slot {
+    struct hlist_node node;
+    uint32_t hash;                      // Hash of the name
+    loff_t pos;                         // Byte offset of the record in the directory
+};
+
+/**
+ * Struct: osfs_dir_gap
+ * Description: A record with room for at least one more entry: either an
+ *              unused record or a live one with slack after its name. Gaps
+ *              are keyed by position, and every node also caches the largest
+ *              room in its subtree, so that finding the first gap a record
+ *              fits in follows one root-to-leaf path.
+ */
+struct osfs_dir_gap {
+    struct rb_node node;
+    loff_t pos;                         // Byte offset of the record in the directory
+    uint16_t room;                      // Bytes a new record could take from it
+    uint16_t subtree_max;               // Largest room in this subtree
+};
+
+static inline uint16_t osfs_dir_gap_room(const struct osfs_dir_gap *gap)
+{
+    return gap->room;
+}
+
+RB_DECLARE_CALLBACKS_MAX(static, osfs_dir_gap_cb, struct osfs_dir_gap,
+                         node, uint16_t, subtree_max, osfs_dir_gap_room)
+
+#define to_dir_gap(n) rb_entry_safe(n, struct osfs_dir_gap, node)
+
+/**
+ * Struct: osfs_dir_index
+ * Description: In-memory hash index of one directory, built on first access,
+ *              hung off its osfs_inode_info and kept in sync by
+ *              osfs_dir_index_add and osfs_dir_index_remove.
+ */
+struct osfs_dir_index {
+    struct hlist_head *buckets;
+    unsigned int bits;                  // log2 of the bucket count
+    unsigned int nr_used;               // Number of hashed entries
+    struct rb_root gaps;                // Records new entries can be placed in
+    uint32_t nr_blocks;                 // Directory blocks scanned so far
+    struct osfs_dir_slot *spare;        // Slot set aside by osfs_dir_index_reserve
+};
+
+static inline uint32_t osfs_dir_hash(const char *name, size_t len)
+{
+    return full_name_hash(NULL, name, len);
+}
+
+static inline struct hlist_head *osfs_dir_bucket(struct osfs_dir_index *idx, uint32_t hash)
+{
+    return &idx->buckets[hash_32(hash, idx->bits)];
+}
+
+/**
+ * Function: osfs_dir_block
+ * Description: Returns the address of a directory block.
+ * Inputs:
+ *   - dir: The directory inode.
+ *   - block: Logical block number inside the directory.
+ * Returns:
+ *   - A pointer to the block, or NULL if it is not mapped.
+ */
+void *osfs_dir_block(struct inode *dir, uint32_t block)
+{
+    void *addr;
+    size_t len;
+
+    if (osfs_map_file_offset(dir, (loff_t)block * BLOCK_SIZE, &addr, &len, NULL) ||
+        len < BLOCK_SIZE)
+        return NULL;
+    return addr;
+}
+
+/**
+ * Function: osfs_dir_block_dirty
+ * Description: Records that a directory block returned by osfs_dir_block was
+ *              modified.
+ * Inputs:
+ *   - dir: The directory inode.
+ *   - block: Logical block number inside the directory.
+ * Returns:
+ *   - None.
+ */
+void osfs_dir_block_dirty(struct inode *dir, uint32_t block)
+{
+    uint32_t pblk;
+    void *addr;
+    size_t len;
+
+    if (!osfs_map_file_offset(dir, (loff_t)block * BLOCK_SIZE, &addr, &len, &pblk))
+        osfs_meta_block_dirty(dir->i_sb->s_fs_info, pblk);
+}
+
+/**
+ * Function: osfs_dir_entry_at
+ * Description: Returns the directory record stored at byte offset @pos.
+ * Inputs:
+ *   - dir: The directory inode.
+ *   - pos: Byte offset of a record recorded in the index.
+ * Returns:
+ *   - A pointer to the record, or NULL if @pos is no longer mapped.
+ */
+static struct osfs_dir_entry *osfs_dir_entry_at(struct inode *dir, loff_t pos)
+{
+    char *block = osfs_dir_block(dir, pos / BLOCK_SIZE);
+
+    return block ? (struct osfs_dir_entry *)(block + pos % BLOCK_SIZE) : NULL;
+}
+
+/**
+ * Function: osfs_dir_rec_room
+ * Description: Returns how many bytes a new record could take from @de.
+ */
+static inline unsigned int osfs_dir_rec_room(const struct osfs_dir_entry *de)
+{
+    return de->inode_no ? de->rec_len - OSFS_DIR_REC_LEN(de->name_len) : de->rec_len;
+}
+
+/**
+ * Function: osfs_dir_index_add_gap
+ * Description: Records @de as a place for new entries if it has room for the
+ *              smallest possible record.
+ * Returns:
+ *   - 0 on success, -ENOMEM if the gap cannot be allocated.
+ */
+static int osfs_dir_index_add_gap(struct osfs_dir_index *idx, const struct osfs_dir_entry *de,
+                                  loff_t pos)
+{
+    struct rb_node **link, *parent = NULL;
+    struct osfs_dir_gap *gap, *cur;
+    unsigned int room = osfs_dir_rec_room(de);
+
+    if (room < OSFS_DIR_REC_LEN(1))
+        return 0;
+
+    gap = kmalloc(sizeof(*gap), GFP_NOFS);
+    if (!gap)
+        return -ENOMEM;
+    gap->pos = pos;
+    gap->room = room;
+
+    link = &idx->gaps.rb_node;
+    while (*link) {
+        parent = *link;
+        cur = to_dir_gap(parent);
+        // Update the cached maximum on the way down, as rb_insert_augmented expects
+        if (cur->subtree_max < gap->room)
+            cur->subtree_max = gap->room;
+        if (pos < cur->pos)
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+
+    gap->subtree_max = gap->room;
+    rb_link_node(&gap->node, parent, link);
+    rb_insert_augmented(&gap->node, &idx->gaps, &osfs_dir_gap_cb);
+    return 0;
+}
+
+static void osfs_dir_index_del_gap(struct osfs_dir_index *idx, struct osfs_dir_gap *gap)
+{
+    rb_erase_augmented(&gap->node, &idx->gaps, &osfs_dir_gap_cb);
+    kfree(gap);
+}
+
+/**
+ * Function: osfs_dir_index_set_room
+ * Description: Changes the room of a gap, dropping it once it cannot hold the
+ *              smallest possible record.
+ */
+static void osfs_dir_index_set_room(struct osfs_dir_index *idx, struct osfs_dir_gap *gap,
+                                    unsigned int room)
+{
+    if (room < OSFS_DIR_REC_LEN(1)) {
+        osfs_dir_index_del_gap(idx, gap);
+        return;
+    }
+    gap->room = room;
+    osfs_dir_gap_cb_propagate(&gap->node, NULL);
+}
+
+/**
+ * Function: osfs_dir_index_find_gap
+ * Description: Returns the gap recorded for the record at @pos.
+ * Returns:
+ *   - The gap, or NULL if that record has none.
+ */
+static struct osfs_dir_gap *osfs_dir_index_find_gap(struct osfs_dir_index *idx, loff_t pos)
+{
+    struct rb_node *node = idx->gaps.rb_node;
+    struct osfs_dir_gap *gap;
+
+    while (node) {
+        gap = to_dir_gap(node);
+        if (pos < gap->pos)
+            node = node->rb_left;
+        else if (pos > gap->pos)
+            node = node->rb_right;
+        else
+            return gap;
+    }
+    return NULL;
+}
+
+/**
+ * Function: osfs_dir_index_first_fit
+ * Description: Finds the lowest-placed gap with room for @need bytes.
+ * Returns:
+ *   - The gap, or NULL if no gap is large enough.
+ */
+static struct osfs_dir_gap *osfs_dir_index_first_fit(struct osfs_dir_index *idx,
+                                                     unsigned int need)
+{
+    struct rb_node *node = idx->gaps.rb_node;
+    struct osfs_dir_gap *gap, *left;
+
+    if (!node || to_dir_gap(node)->subtree_max < need)
+        return NULL;
+
+    while (node) {
+        gap = to_dir_gap(node);
+        left = to_dir_gap(node->rb_left);
+        if (left && left->subtree_max >= need) {
+            node = node->rb_left;
+            continue;
+        }
+        if (gap->room >= need)
+            return gap;
+        node = node->rb_right;
+    }
+
+    return NULL;
+}
+
+/**
+ * Function: osfs_dir_index_resize
+ * Description: Doubles the bucket array once the average chain length exceeds
+ *              two, rehashing every entry from its cached hash.
+ * Inputs:
+ *   - idx: The directory index.
+ * Returns:
+ *   - None. On allocation failure the index keeps its current size.
+ */
+static void osfs_dir_index_resize(struct osfs_dir_index *idx)
+{
+    unsigned int bits = idx->bits + 1, i;
+    struct hlist_head *buckets;
+    struct osfs_dir_slot *slot;
+    struct hlist_node *tmp;
+
+    if (idx->nr_used <= (2U << idx->bits))
+        return;
+
+    buckets = kvcalloc(1U << bits, sizeof(*buckets), GFP_NOFS);
+    if (!buckets)
+        return;
+
+    for (i = 0; i < (1U << idx->bits); i++) {
+        hlist_for_each_entry_safe(slot, tmp, &idx->buckets[i], node) {
+            hlist_del(&slot->node);
+            hlist_add_head(&slot->node, &buckets[hash_32(slot->hash, bits)]);
+        }
+    }
+
+    kvfree(idx->buckets);
+    idx->buckets = buckets;
+    idx->bits = bits;
+}
+
+/**
+ * Function: osfs_dir_index_scan
+ * Description: Adds the records of every directory block that has not been
+ *              scanned yet to the index: live records are hashed, and records
+ *              with room for another entry are remembered as gaps.
+ * Inputs:
+ *   - dir: The directory inode.
+ *   - idx: The directory index.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the index cannot grow.
+ *   - -EIO if a directory block is corrupted.
+ */
+static int osfs_dir_index_scan(struct inode *dir, struct osfs_dir_index *idx)
+{
+    uint32_t nr_blocks = osfs_ext_end(dir->i_sb->s_fs_info, OSFS_I(dir)->raw);
+    struct osfs_dir_entry *de;
+    struct osfs_dir_slot *slot;
+    unsigned int offset;
+    char *block;
+    loff_t pos;
+    int ret;
+
+    for (; idx->nr_blocks < nr_blocks; idx->nr_blocks++) {
+        block = osfs_dir_block(dir, idx->nr_blocks);
+        if (!block)
+            return -EIO;
+
+        for (offset = 0; offset < BLOCK_SIZE; offset += de->rec_len) {
+            de = (struct osfs_dir_entry *)(block + offset);
+            pos = (loff_t)idx->nr_blocks * BLOCK_SIZE + offset;
+            if (!osfs_dir_rec_ok(de, offset)) {
+                pr_err("osfs_dir_index_scan: Bad record at %lld in directory %lu\n",
+                       pos, dir->i_ino);
+                return -EIO;
+            }
+
+            ret = osfs_dir_index_add_gap(idx, de, pos);
+            if (ret)
+                return ret;
+            if (!de->inode_no)
+                continue;
+
+            slot = kmalloc(sizeof(*slot), GFP_NOFS);
+            if (!slot)
+                return -ENOMEM;
+            slot->pos = pos;
+            slot->hash = osfs_dir_hash(de->name, de->name_len);
+            hlist_add_head(&slot->node, osfs_dir_bucket(idx, slot->hash));
+            idx->nr_used++;
+        }
+    }
+
+    osfs_dir_index_resize(idx);
+    return 0;
+}
+
+static void osfs_dir_index_free(struct osfs_dir_index *idx)
+{
+    struct osfs_dir_slot *slot;
+    struct osfs_dir_gap *gap, *next;
+    struct hlist_node *tmp;
+    unsigned int i;
+
+    for (i = 0; i < (1U << idx->bits); i++)
+        hlist_for_each_entry_safe(slot, tmp, &idx->buckets[i], node)
+            kfree(slot);
+    rbtree_postorder_for_each_entry_safe(gap, next, &idx->gaps, node)
+        kfree(gap);
+    kfree(idx->spare);
+    kvfree(idx->buckets);
+    kfree(idx);
+}
+
+/**
+ * Function: osfs_dir_index_get
+ * Description: Returns the hash index of a directory, building it from the
+ *              directory entries on first access.
+ * Inputs:
+ *   - dir: The directory inode.
+ * Returns:
+ *   - The index on success.
+ *   - ERR_PTR(-ENOMEM) if it cannot be built.
+ *   - ERR_PTR(-EIO) if a directory block is corrupted.
+ */
+static struct osfs_dir_index *osfs_dir_index_get(struct inode *dir)
+{
+    struct osfs_inode_info *oi = OSFS_I(dir);
+    struct osfs_dir_index *idx, *old;
+    int ret;
+
+    idx = READ_ONCE(oi->i_dir_index);
+    if (idx)
+        return idx;
+
+    idx = kzalloc(sizeof(*idx), GFP_NOFS);
+    if (!idx)
+        return ERR_PTR(-ENOMEM);
+    idx->bits = OSFS_DIR_INDEX_MIN_BITS;
+    idx->gaps = RB_ROOT;
+    idx->buckets = kvcalloc(1U << idx->bits, sizeof(*idx->buckets), GFP_NOFS);
+    if (!idx->buckets) {
+        kfree(idx);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    ret = osfs_dir_index_scan(dir, idx);
+    if (ret)
+        goto fail;
+
+    // Parallel lookups may race to build the same index; the first one wins
+    old = cmpxchg(&oi->i_dir_index, NULL, idx);
+    if (old) {
+        osfs_dir_index_free(idx);
+        return old;
+    }
+    return idx;
+
+fail:
+    osfs_dir_index_free(idx);
+    return ERR_PTR(ret);
+}
+
+/**
+ * Function: osfs_dir_index_find
+ * Description: Looks a name up by hashing it and probing a single bucket.
+ * Inputs:
+ *   - dir: The directory inode.
+ *   - name: The name to look up.
+ *   - len: Length of the name.
+ *   - ino: Pointer to store the inode number of the entry.
+ * Returns:
+ *   - 0 if the name exists.
+ *   - -ENOENT if it does not.
+ *   - -ENOMEM or -EIO if the index cannot be built.
+ */
+int osfs_dir_index_find(struct inode *dir, const char *name, size_t len, uint32_t *ino)
+{
+    struct osfs_dir_index *idx;
+    struct osfs_dir_entry *entry;
+    struct osfs_dir_slot *slot;
+    uint32_t hash = osfs_dir_hash(name, len);
+
+    idx = osfs_dir_index_get(dir);
+    if (IS_ERR(idx))
+        return PTR_ERR(idx);
+
+    hlist_for_each_entry(slot, osfs_dir_bucket(idx, hash), node) {
+        if (slot->hash != hash)
+            continue;
+        entry = osfs_dir_entry_at(dir, slot->pos);
+        if (entry && entry->inode_no && entry->name_len == len &&
+            !memcmp(entry->name, name, len)) {
+            *ino = entry->inode_no;
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+/**
+ * Function: osfs_dir_index_grow
+ * Description: Appends blocks to the directory, formats each as a single
+ *              unused record and scans them into the index. A directory
+ *              grows by a quarter of its size, up to OSFS_DIR_GROW_MAX
+ *              blocks, so a burst of creates allocates directory space a few
+ *              blocks at a time while small directories stay one block.
+ * Inputs:
+ *   - dir: The directory inode.
+ *   - idx: The directory index.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code on failure.
+ */
+static int osfs_dir_index_grow(struct inode *dir, struct osfs_dir_index *idx)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = OSFS_I(dir)->raw;
+    struct osfs_dir_entry *de;
+    uint32_t block, count, i;
+    int ret;
+
+    down_write(osfs_ext_sem(dir));
+    block = osfs_ext_end(sb_info, osfs_inode);
+    count = clamp_t(uint32_t, block / 4, 1, OSFS_DIR_GROW_MAX);
+    ret = osfs_alloc_extent(sb_info, count, osfs_inode, block, false);
+    // When space runs short, whatever was allocated before that is still used
+    if (ret == -ENOSPC) {
+        count = osfs_ext_end(sb_info, osfs_inode) - block;
+        if (count)
+            ret = 0;
+    }
+    up_write(osfs_ext_sem(dir));
+    if (ret)
+        return ret;
+
+    for (i = 0; i < count; i++) {
+        de = osfs_dir_block(dir, block + i);
+        if (!de)
+            return -EIO;
+        memset(de, 0, BLOCK_SIZE);
+        de->rec_len = BLOCK_SIZE;
+        osfs_dir_block_dirty(dir, block + i);
+    }
+
+    osfs_inode->i_size = (uint64_t)(block + count) * BLOCK_SIZE;
+    i_size_write(dir, osfs_inode->i_size);
+
+    return osfs_dir_index_scan(dir, idx);
+}
+
+/**
+ * Function: osfs_dir_index_reserve
+ * Description: Makes sure a name of @len bytes can be added to the directory
+ *              without failing: a gap large enough for it exists, growing the
+ *              directory if needed, and its hash slot is allocated. Creates
+ *              call it before allocating the inode, so no inode has to be
+ *              undone for want of a directory entry. The reservation holds
+ *              until the directory's i_rwsem is dropped.
+ * Inputs:
+ *   - dir: The directory inode.
+ *   - len: Length of the name (at most MAX_FILENAME_LEN).
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if the directory cannot grow.
+ *   - -ENOMEM or -EIO on failure.
+ */
+int osfs_dir_index_reserve(struct inode *dir, size_t len)
+{
+    unsigned int need = OSFS_DIR_REC_LEN(len);
+    struct osfs_dir_index *idx;
+    int ret;
+
+    lockdep_assert_held_write(&dir->i_rwsem);
+
+    idx = osfs_dir_index_get(dir);
+    if (IS_ERR(idx))
+        return PTR_ERR(idx);
+
+    if (!idx->spare) {
+        idx->spare = kmalloc(sizeof(*idx->spare), GFP_NOFS);
+        if (!idx->spare)
+            return -ENOMEM;
+    }
+
+    while (!osfs_dir_index_first_fit(idx, need)) {
+        ret = osfs_dir_index_grow(dir, idx);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_dir_index_add
+ * Description: Stores a new record in the first gap large enough for it,
+ *              growing the directory when there is none, and hashes it. A
+ *              live record with slack is split as in ext2. After a successful
+ *              osfs_dir_index_reserve for the name this does not fail.
+ * Inputs:
+ *   - dir: The directory inode.
+ *   - name: The name of the entry.
+ *   - len: Length of the name (at most MAX_FILENAME_LEN).
+ *   - ino: Inode number the entry points to.
+ *   - file_type: FT_* type of the inode.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if the directory cannot grow.
+ *   - -ENOMEM or -EIO on failure.
+ */
+int osfs_dir_index_add(struct inode *dir, const char *name, size_t len, uint32_t ino,
+                       uint8_t file_type)
+{
+    unsigned int need = OSFS_DIR_REC_LEN(len), used;
+    struct osfs_dir_index *idx;
+    struct osfs_dir_entry *de;
+    struct osfs_dir_slot *slot;
+    struct osfs_dir_gap *gap;
+    int ret;
+
+    // Insertions are serialised by the directory's i_rwsem, which also keeps lookups out
+    lockdep_assert_held_write(&dir->i_rwsem);
+
+    idx = osfs_dir_index_get(dir);
+    if (IS_ERR(idx))
+        return PTR_ERR(idx);
+
+    slot = idx->spare;
+    idx->spare = NULL;
+    if (!slot)
+        slot = kmalloc(sizeof(*slot), GFP_NOFS);
+    if (!slot)
+        return -ENOMEM;
+
+    while (!(gap = osfs_dir_index_first_fit(idx, need))) {
+        ret = osfs_dir_index_grow(dir, idx);
+        if (ret)
+            goto fail;
+    }
+
+    de = osfs_dir_entry_at(dir, gap->pos);
+    if (!de) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    if (de->inode_no) {
+        /*
+         * Split the new record off the slack of a live one. The gap moves
+         * inside the record, before the next one, so it keeps its place in
+         * the tree
+         */
+        used = OSFS_DIR_REC_LEN(de->name_len);
+        gap->pos += used;
+        ((struct osfs_dir_entry *)((char *)de + used))->rec_len = de->rec_len - used;
+        de->rec_len = used;
+        de = (struct osfs_dir_entry *)((char *)de + used);
+    }
+
+    // Every directory change bumps i_version so osfs_iterate re-checks open cookies
+    inode_inc_iversion(dir);
+
+    de->inode_no = ino;
+    de->name_len = len;
+    de->file_type = file_type;
+    memcpy(de->name, name, len);
+    osfs_dir_block_dirty(dir, gap->pos / BLOCK_SIZE);
+
+    slot->pos = gap->pos;
+    slot->hash = osfs_dir_hash(name, len);
+    hlist_add_head(&slot->node, osfs_dir_bucket(idx, slot->hash));
+    idx->nr_used++;
+    osfs_dir_index_resize(idx);
+
+    // The new record keeps whatever room it has left for the next entry
+    osfs_dir_index_set_room(idx, gap, de->rec_len - need);
+
+    return 0;
+
+fail:
+    kfree(slot);
+    return ret;
+}
+
+/**
+ * Function: osfs_dir_index_remove
+ * Description: Removes a name from a directory. As in ext2, the record is
+ *              merged into the one before it in its block, or marked unused
+ *              when it is the first; either way the room it leaves is
+ *              recorded as a gap for new entries.
+ * Inputs:
+ *   - dir: The directory inode.
+ *   - name: The name of the entry.
+ *   - len: Length of the name.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOENT if the name does not exist.
+ *   - -ENOMEM or -EIO on failure.
+ */
+int osfs_dir_index_remove(struct inode *dir, const char *name, size_t len)
+{
+    uint32_t hash = osfs_dir_hash(name, len);
+    struct osfs_dir_entry *de, *prev = NULL, *rec;
+    struct osfs_dir_gap *gap;
+    struct osfs_dir_index *idx;
+    struct osfs_dir_slot *slot;
+    unsigned int offset, o;
+    loff_t rec_pos;
+    char *block;
+
+    lockdep_assert_held_write(&dir->i_rwsem);
+
+    idx = osfs_dir_index_get(dir);
+    if (IS_ERR(idx))
+        return PTR_ERR(idx);
+
+    hlist_for_each_entry(slot, osfs_dir_bucket(idx, hash), node) {
+        if (slot->hash != hash)
+            continue;
+        de = osfs_dir_entry_at(dir, slot->pos);
+        if (de && de->inode_no && de->name_len == len && !memcmp(de->name, name, len))
+            goto found;
+    }
+    return -ENOENT;
+
+found:
+    // Find the record before this one; records of a block chain from its start
+    block = (char *)de - slot->pos % BLOCK_SIZE;
+    offset = slot->pos % BLOCK_SIZE;
+    for (o = 0; o < offset; o += rec->rec_len) {
+        rec = (struct osfs_dir_entry *)(block + o);
+        if (!osfs_dir_rec_ok(rec, o)) {
+            pr_err("osfs_dir_index_remove: Bad record at %lld in directory %lu\n",
+                   slot->pos - offset + o, dir->i_ino);
+            return -EIO;
+        }
+        prev = rec;
+    }
+    if (o != offset)
+        return -EIO;
+
+    inode_inc_iversion(dir);
+
+    if (prev) {
+        prev->rec_len += de->rec_len;
+        rec = prev;
+        rec_pos = slot->pos - ((char *)de - (char *)prev);
+    } else {
+        de->inode_no = 0;
+        rec = de;
+        rec_pos = slot->pos;
+    }
+    osfs_dir_block_dirty(dir, slot->pos / BLOCK_SIZE);
+
+    // A merged record takes its gap with it; the surviving record's gap grows
+    if (prev) {
+        gap = osfs_dir_index_find_gap(idx, slot->pos);
+        if (gap)
+            osfs_dir_index_del_gap(idx, gap);
+    }
+    gap = osfs_dir_index_find_gap(idx, rec_pos);
+    if (gap)
+        osfs_dir_index_set_room(idx, gap, osfs_dir_rec_room(rec));
+    else if (osfs_dir_index_add_gap(idx, rec, rec_pos))
+        pr_warn("osfs_dir_index_remove: Room at %lld in directory %lu stays unused\n",
+                rec_pos, dir->i_ino);
+
+    hlist_del(&slot->node);
+    kfree(slot);
+    idx->nr_used--;
+    return 0;
+}
+
+/**
+ * Function: osfs_dir_index_release
+ * Description: Frees the hash index of a directory when its in-memory inode
+ *              goes away; it is rebuilt on the next access.
+ * Inputs:
+ *   - dir: The directory inode.
+ * Returns:
+ *   - None.
+ */
+void osfs_dir_index_release(struct inode *dir)
+{
+    struct osfs_inode_info *oi = OSFS_I(dir);
+
+    if (oi->i_dir_index) {
+        osfs_dir_index_free(oi->i_dir_index);
+        oi->i_dir_index = NULL;
+    }
+}
@@ -0,0 +1,1089 @@
+#include <linux/fs.h>
+#include <linux/string.h>
+#include "osfs.h"
+
+/**
+ * Struct: osfs_ext_path
+ * Description: One level of a root-to-leaf walk through the extent tree.
+ */
+struct osfs_ext_path {
+    struct osfs_extent_header *hdr; // Node at this level
+    uint32_t block;                 // Data block of the node (unused for the root)
+    int pos;                        // Entry followed (index) or found (leaf), -1 if none
+};
+
+static inline struct osfs_extent_header *osfs_ext_root(struct osfs_inode *inode)
+{
+    return (struct osfs_extent_header *)inode->i_extent_root;
+}
+
+static inline void *osfs_ext_entry(struct osfs_extent_header *hdr, int i)
+{
+    return (char *)(hdr + 1) + (size_t)i * OSFS_EXT_ENTRY_SIZE;
+}
+
+static inline struct osfs_extent *osfs_ext_leaf(struct osfs_extent_header *hdr, int i)
+{
+    return osfs_ext_entry(hdr, i);
+}
+
+static inline struct osfs_extent_idx *osfs_ext_index(struct osfs_extent_header *hdr, int i)
+{
+    return osfs_ext_entry(hdr, i);
+}
+
+// Both entry types start with the logical block they are keyed by
+static inline uint32_t osfs_ext_key(struct osfs_extent_header *hdr, int i)
+{
+    return *(uint32_t *)osfs_ext_entry(hdr, i);
+}
+
+static struct osfs_extent_header *osfs_ext_node(struct osfs_sb_info *sb_info, uint32_t block)
+{
+    return osfs_data_block(sb_info, block);
+}
+
+// Marks every node below the root on @path as modified; the root itself is
+// part of the inode and written back through mark_inode_dirty
+static void osfs_ext_dirty_path(struct osfs_sb_info *sb_info, struct osfs_ext_path *path,
+                                int depth)
+{
+    int level;
+
+    for (level = 1; level <= depth; level++)
+        osfs_meta_block_dirty(sb_info, path[level].block);
+}
+
+static bool osfs_ext_valid(struct osfs_extent_header *hdr, int depth)
+{
+    return hdr && hdr->eh_magic == OSFS_EXT_MAGIC &&
+           hdr->eh_entries <= hdr->eh_max &&
+           (depth < 0 || hdr->eh_depth == depth);
+}
+
+/**
+ * Function: osfs_ext_search
+ * Description: Binary-searches a node for the last entry whose key is <= @lblk.
+ *              Entries of every node are kept sorted by logical block.
+ * Inputs:
+ *   - hdr: The node to search.
+ *   - lblk: The logical block being looked up.
+ * Returns:
+ *   - The entry position, or -1 if every key is above @lblk.
+ */
+static int osfs_ext_search(struct osfs_extent_header *hdr, uint32_t lblk)
+{
+    int lo = 0, hi = hdr->eh_entries, mid;
+
+    // Invariant: keys before lo are <= lblk, keys from hi on are > lblk
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (osfs_ext_key(hdr, mid) <= lblk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+/**
+ * Function: osfs_ext_find_path
+ * Description: Walks from the root to the leaf that covers @lblk.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inode: The osfs_inode owning the tree.
+ *   - lblk: The logical block being looked up.
+ *   - path: Array of OSFS_EXT_MAX_DEPTH + 1 levels to fill.
+ *   - next: If non-NULL, set to the first mapped logical block after the
+ *           leaf position found, or U32_MAX if there is none.
+ * Returns:
+ *   - The level of the leaf in @path.
+ *   - -EIO if a node is corrupted.
+ */
+static int osfs_ext_find_path(struct osfs_sb_info *sb_info, struct osfs_inode *inode,
+                              uint32_t lblk, struct osfs_ext_path *path, uint32_t *next)
+{
+    struct osfs_extent_header *hdr = osfs_ext_root(inode);
+    int level = 0, depth, pos;
+
+    if (next)
+        *next = U32_MAX;
+
+    if (!osfs_ext_valid(hdr, -1) || hdr->eh_depth > OSFS_EXT_MAX_DEPTH) {
+        pr_err("osfs_ext_find_path: Corrupted extent root in inode %u\n", inode->i_ino);
+        return -EIO;
+    }
+    depth = hdr->eh_depth;
+
+    path[0].hdr = hdr;
+    path[0].block = 0;
+
+    while (level < depth) {
+        pos = osfs_ext_search(hdr, lblk);
+        if (pos < 0)
+            pos = 0;
+        if (next && pos + 1 < hdr->eh_entries)
+            *next = osfs_ext_key(hdr, pos + 1);
+        path[level].pos = pos;
+
+        path[level + 1].block = osfs_ext_index(hdr, pos)->node_block;
+        hdr = osfs_ext_node(sb_info, path[level + 1].block);
+        if (!osfs_ext_valid(hdr, depth - level - 1)) {
+            pr_err("osfs_ext_find_path: Corrupted extent node %u in inode %u\n",
+                   path[level + 1].block, inode->i_ino);
+            return -EIO;
+        }
+        level++;
+        path[level].hdr = hdr;
+    }
+
+    pos = osfs_ext_search(hdr, lblk);
+    path[level].pos = pos;
+    if (next && pos + 1 < hdr->eh_entries)
+        *next = osfs_ext_key(hdr, pos + 1);
+
+    return level;
+}
+
+/**
+ * Function: osfs_ext_init
+ * Description: Initializes an empty extent tree in an inode.
+ * Inputs:
+ *   - inode: The osfs_inode to initialize.
+ * Returns:
+ *   - None.
+ */
+void osfs_ext_init(struct osfs_inode *inode)
+{
+    struct osfs_extent_header *root = osfs_ext_root(inode);
+
+    memset(inode->i_extent_root, 0, sizeof(inode->i_extent_root));
+    root->eh_magic = OSFS_EXT_MAGIC;
+    root->eh_entries = 0;
+    root->eh_max = OSFS_EXT_ROOT_ENTRIES;
+    root->eh_depth = 0;
+}
+
+/**
+ * Function: osfs_ext_lookup
+ * Description: Maps a logical file block onto the extent that contains it.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inode: The osfs_inode to search.
+ *   - lblk: The logical block to map.
+ *   - ext: Filled with the extent covering @lblk on success. When @lblk is
+ *          not mapped, ext->logical_block is set to the next mapped block
+ *          (U32_MAX if none) and ext->block_count to 0.
+ * Returns:
+ *   - 0 if @lblk is mapped.
+ *   - -ENOENT if it is not.
+ *   - -EIO if the tree is corrupted.
+ */
+int osfs_ext_lookup(struct osfs_sb_info *sb_info, struct osfs_inode *inode,
+                    uint32_t lblk, struct osfs_extent *ext)
+{
+    struct osfs_ext_path path[OSFS_EXT_MAX_DEPTH + 1];
+    struct osfs_extent *found;
+    uint32_t next;
+    int level;
+
+    level = osfs_ext_find_path(sb_info, inode, lblk, path, &next);
+    if (level < 0)
+        return level;
+
+    if (path[level].pos >= 0) {
+        found = osfs_ext_leaf(path[level].hdr, path[level].pos);
+        if (lblk - found->logical_block < found->block_count) {
+            *ext = *found;
+            return 0;
+        }
+    }
+
+    ext->logical_block = next;
+    ext->start_block = 0;
+    ext->block_count = 0;
+    return -ENOENT;
+}
+
+/**
+ * Function: osfs_ext_next
+ * Description: Returns the first extent that maps @lblk or any block after
+ *              it, for walks over every extent of a file.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inode: The osfs_inode to search.
+ *   - lblk: The logical block to start from.
+ *   - ext: Filled with the extent found.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOENT if nothing is mapped at or past @lblk.
+ *   - -EIO if the tree is corrupted.
+ */
+int osfs_ext_next(struct osfs_sb_info *sb_info, struct osfs_inode *inode, uint32_t lblk,
+                  struct osfs_extent *ext)
+{
+    int ret;
+
+    ret = osfs_ext_lookup(sb_info, inode, lblk, ext);
+    if (ret != -ENOENT || ext->logical_block == U32_MAX)
+        return ret;
+    return osfs_ext_lookup(sb_info, inode, ext->logical_block, ext);
+}
+
+/**
+ * Function: osfs_ext_last
+ * Description: Returns the extent mapping the highest logical blocks.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inode: The osfs_inode to search.
+ *   - ext: Filled with the last extent.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOENT if the file maps no blocks.
+ *   - -EIO if the tree is corrupted.
+ */
+int osfs_ext_last(struct osfs_sb_info *sb_info, struct osfs_inode *inode,
+                  struct osfs_extent *ext)
+{
+    struct osfs_ext_path path[OSFS_EXT_MAX_DEPTH + 1];
+    int level;
+
+    level = osfs_ext_find_path(sb_info, inode, U32_MAX, path, NULL);
+    if (level < 0)
+        return level;
+    if (path[level].pos < 0)
+        return -ENOENT;
+
+    *ext = *osfs_ext_leaf(path[level].hdr, path[level].pos);
+    return 0;
+}
+
+/**
+ * Function: osfs_ext_end
+ * Description: Returns the logical block just past the file's last extent.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inode: The osfs_inode to inspect.
+ * Returns:
+ *   - The first unmapped logical block after all extents (0 if none).
+ */
+uint32_t osfs_ext_end(struct osfs_sb_info *sb_info, struct osfs_inode *inode)
+{
+    struct osfs_extent last;
+
+    if (osfs_ext_last(sb_info, inode, &last))
+        return 0;
+    return last.logical_block + last.block_count;
+}
+
+/**
+ * Function: osfs_ext_fix_keys
+ * Description: Propagates a new first key of the node at @level to its parents.
+ * Inputs:
+ *   - path: The path to the modified node.
+ *   - level: The level whose entry 0 changed.
+ * Returns:
+ *   - None.
+ */
+static void osfs_ext_fix_keys(struct osfs_ext_path *path, int level)
+{
+    uint32_t key = osfs_ext_key(path[level].hdr, 0);
+
+    while (level > 0) {
+        level--;
+        osfs_ext_index(path[level].hdr, path[level].pos)->logical_block = key;
+        if (path[level].pos != 0)
+            break;
+    }
+}
+
+/**
+ * Function: osfs_ext_new_node
+ * Description: Takes one preallocated block and formats it as an empty node.
+ */
+static struct osfs_extent_header *osfs_ext_new_node(struct osfs_sb_info *sb_info,
+                                                    uint32_t block, uint16_t depth)
+{
+    struct osfs_extent_header *hdr = osfs_ext_node(sb_info, block);
+
+    memset(hdr, 0, BLOCK_SIZE);
+    hdr->eh_magic = OSFS_EXT_MAGIC;
+    hdr->eh_max = OSFS_EXT_BLOCK_ENTRIES;
+    hdr->eh_depth = depth;
+    return hdr;
+}
+
+static void osfs_ext_put_entry(struct osfs_extent_header *hdr, int pos, const void *entry)
+{
+    memmove(osfs_ext_entry(hdr, pos + 1), osfs_ext_entry(hdr, pos),
+            (size_t)(hdr->eh_entries - pos) * OSFS_EXT_ENTRY_SIZE);
+    memcpy(osfs_ext_entry(hdr, pos), entry, OSFS_EXT_ENTRY_SIZE);
+    hdr->eh_entries++;
+}
+
+/**
+ * Function: osfs_ext_insert_entry
+ * Description: Inserts an entry at position @pos of the node at @level,
+ *              splitting full nodes and growing the root as needed. Nodes are
+ *              taken from @blocks, which the caller has sized for the worst case.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - path: The path to the node; it is shifted down when the root grows.
+ *   - depth: Pointer to the number of levels below the root; updated on growth.
+ *   - level: The level to insert at.
+ *   - pos: The position in that node.
+ *   - entry: The OSFS_EXT_ENTRY_SIZE byte entry to insert.
+ *   - blocks: Preallocated node blocks.
+ *   - used: Pointer to the number of @blocks consumed so far.
+ * Returns:
+ *   - None.
+ */
+static void osfs_ext_insert_entry(struct osfs_sb_info *sb_info, struct osfs_ext_path *path,
+                                  int *depth, int level, int pos, const void *entry,
+                                  const uint32_t *blocks, int *used)
+{
+    struct osfs_extent_header *hdr = path[level].hdr, *child, *sibling;
+    struct osfs_extent_idx idx;
+    uint32_t block;
+    int i, half;
+
+    if (hdr->eh_entries < hdr->eh_max) {
+        osfs_ext_put_entry(hdr, pos, entry);
+        if (pos == 0 && level > 0)
+            osfs_ext_fix_keys(path, level);
+        return;
+    }
+
+    if (level == 0) {
+        // The inline root is full: move its entries into a new node one level down
+        block = blocks[(*used)++];
+        child = osfs_ext_new_node(sb_info, block, hdr->eh_depth);
+        memcpy(osfs_ext_entry(child, 0), osfs_ext_entry(hdr, 0),
+               (size_t)hdr->eh_entries * OSFS_EXT_ENTRY_SIZE);
+        child->eh_entries = hdr->eh_entries;
+
+        idx.logical_block = child->eh_entries ? osfs_ext_key(child, 0) : 0;
+        idx.node_block = block;
+        idx.reserved = 0;
+        hdr->eh_depth++;
+        hdr->eh_entries = 0;
+        osfs_ext_put_entry(hdr, 0, &idx);
+
+        for (i = *depth; i >= 0; i--)
+            path[i + 1] = path[i];
+        (*depth)++;
+        path[0].hdr = hdr;
+        path[0].block = 0;
+        path[0].pos = 0;
+        path[1].hdr = child;
+        path[1].block = block;
+
+        osfs_ext_insert_entry(sb_info, path, depth, 1, pos, entry, blocks, used);
+        return;
+    }
+
+    // Split: appends start a fresh node, other inserts move the upper half
+    block = blocks[(*used)++];
+    sibling = osfs_ext_new_node(sb_info, block, hdr->eh_depth);
+    if (pos == hdr->eh_entries) {
+        osfs_ext_put_entry(sibling, 0, entry);
+    } else {
+        half = hdr->eh_entries / 2;
+        memcpy(osfs_ext_entry(sibling, 0), osfs_ext_entry(hdr, half),
+               (size_t)(hdr->eh_entries - half) * OSFS_EXT_ENTRY_SIZE);
+        sibling->eh_entries = hdr->eh_entries - half;
+        hdr->eh_entries = half;
+        if (pos <= half) {
+            osfs_ext_put_entry(hdr, pos, entry);
+            if (pos == 0)
+                osfs_ext_fix_keys(path, level);
+        } else {
+            osfs_ext_put_entry(sibling, pos - half, entry);
+        }
+    }
+
+    idx.logical_block = osfs_ext_key(sibling, 0);
+    idx.node_block = block;
+    idx.reserved = 0;
+    osfs_ext_insert_entry(sb_info, path, depth, level - 1, path[level - 1].pos + 1,
+                          &idx, blocks, used);
+}
+
+/**
+ * Function: osfs_ext_insert
+ * Description: Adds a mapping to the extent tree. The new range is merged into
+ *              a neighbouring extent when it continues it both logically and
+ *              physically, which is how in-place growth of the last extent
+ *              is recorded. Compressed extents never merge.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inode: The osfs_inode owning the tree.
+ *   - ext: The mapping to add; it must not overlap an existing one.
+ * Returns:
+ *   - 0 on success.
+ *   - -EEXIST if the range is already mapped.
+ *   - -ENOSPC if blocks for new tree nodes cannot be allocated.
+ *   - -EIO if the tree is corrupted.
+ */
+int osfs_ext_insert(struct osfs_sb_info *sb_info, struct osfs_inode *inode,
+                    const struct osfs_extent *ext)
+{
+    struct osfs_ext_path path[OSFS_EXT_MAX_DEPTH + 2];
+    struct osfs_extent_header *leaf;
+    struct osfs_extent *prev = NULL, *next = NULL;
+    uint32_t blocks[OSFS_EXT_MAX_DEPTH + 1];
+    uint32_t next_key;
+    int depth, level, pos, needed, used = 0, i, ret;
+
+    if (!ext->block_count)
+        return 0;
+
+    depth = osfs_ext_find_path(sb_info, inode, ext->logical_block, path, &next_key);
+    if (depth < 0)
+        return depth;
+
+    leaf = path[depth].hdr;
+    pos = path[depth].pos;
+    if (pos >= 0)
+        prev = osfs_ext_leaf(leaf, pos);
+    if (pos + 1 < leaf->eh_entries)
+        next = osfs_ext_leaf(leaf, pos + 1);
+
+    if ((prev && ext->logical_block - prev->logical_block < prev->block_count) ||
+        (next_key != U32_MAX && ext->logical_block + ext->block_count > next_key)) {
+        pr_err("osfs_ext_insert: Blocks %u-%u of inode %u are already mapped\n",
+               ext->logical_block, ext->logical_block + ext->block_count - 1, inode->i_ino);
+        return -EEXIST;
+    }
+
+    // Continue the previous extent in place
+    if (prev && !osfs_ext_is_compressed(ext) && !osfs_ext_is_compressed(prev) &&
+        prev->logical_block + prev->block_count == ext->logical_block &&
+        prev->start_block + prev->block_count == ext->start_block) {
+        prev->block_count += ext->block_count;
+        osfs_ext_dirty_path(sb_info, path, depth);
+        return 0;
+    }
+
+    // Extend the next extent backwards
+    if (next && !osfs_ext_is_compressed(ext) && !osfs_ext_is_compressed(next) &&
+        ext->logical_block + ext->block_count == next->logical_block &&
+        ext->start_block + ext->block_count == next->start_block) {
+        next->logical_block = ext->logical_block;
+        next->start_block = ext->start_block;
+        next->block_count += ext->block_count;
+        if (pos + 1 == 0) {
+            path[depth].pos = 0;
+            osfs_ext_fix_keys(path, depth);
+        }
+        osfs_ext_dirty_path(sb_info, path, depth);
+        return 0;
+    }
+
+    // Reserve a block for every full node that could split, plus one for root growth
+    needed = 0;
+    for (level = depth; level >= 0; level--) {
+        if (path[level].hdr->eh_entries < path[level].hdr->eh_max)
+            break;
+        needed++;
+    }
+    if (needed > depth && depth >= OSFS_EXT_MAX_DEPTH) {
+        pr_err("osfs_ext_insert: Extent tree of inode %u is at maximum depth\n", inode->i_ino);
+        return -ENOSPC;
+    }
+    for (i = 0; i < needed; i++) {
+        ret = osfs_alloc_data_block(sb_info, &blocks[i]);
+        if (ret) {
+            while (i--)
+                osfs_free_data_block(sb_info, blocks[i]);
+            return ret;
+        }
+    }
+
+    osfs_ext_insert_entry(sb_info, path, &depth, depth, pos + 1, ext, blocks, &used);
+    osfs_stat_inc(sb_info, OSFS_STAT_EXTENTS_CREATED);
+    inode->i_blocks += used;
+    osfs_ext_dirty_path(sb_info, path, depth);
+    for (i = 0; i < used; i++)
+        osfs_meta_block_dirty(sb_info, blocks[i]);
+
+    // Give back any reserved block the insert did not use
+    while (used < needed)
+        osfs_free_data_block(sb_info, blocks[--needed]);
+
+    return 0;
+}
+
+/**
+ * Function: osfs_ext_truncate_node
+ * Description: Removes every mapping at or past @lblk from the subtree under
+ *              @hdr. Entries are kept sorted, so the walk goes from the last
+ *              entry backwards and stops at the first one that starts below
+ *              @lblk. Each extent is released with one osfs_share_put, which
+ *              frees the blocks no other file shares, and nodes left empty
+ *              are freed as well. A compressed extent is only trimmed while
+ *              any of it is left, and then freed whole.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inode: The osfs_inode owning the tree.
+ *   - hdr: The node to trim.
+ *   - lblk: The first logical block to unmap.
+ * Returns:
+ *   - The number of blocks freed, data and nodes.
+ *   - -EIO if a node is corrupted.
+ */
+static long osfs_ext_truncate_node(struct osfs_sb_info *sb_info, struct osfs_inode *inode,
+                                   struct osfs_extent_header *hdr, uint32_t lblk)
+{
+    struct osfs_extent_header *child;
+    struct osfs_extent_idx *idx;
+    struct osfs_extent *ext;
+    uint32_t keep;
+    long freed = 0, ret;
+    int i;
+
+    for (i = hdr->eh_entries - 1; i >= 0; i--) {
+        if (hdr->eh_depth == 0) {
+            ext = osfs_ext_leaf(hdr, i);
+            if ((uint64_t)ext->logical_block + ext->block_count <= lblk)
+                break;
+
+            keep = ext->logical_block < lblk ? lblk - ext->logical_block : 0;
+            if (osfs_ext_is_compressed(ext)) {
+                if (keep) {
+                    ext->block_count = keep;
+                    break;
+                }
+                freed += osfs_compress_free(sb_info, ext);
+                hdr->eh_entries--;
+                osfs_stat_inc(sb_info, OSFS_STAT_EXTENTS_FREED);
+                continue;
+            }
+            osfs_share_put(sb_info, osfs_ext_pblk(ext) + keep, ext->block_count - keep);
+            freed += ext->block_count - keep;
+            if (keep) {
+                ext->block_count = keep;
+                break;
+            }
+            hdr->eh_entries--;
+            osfs_stat_inc(sb_info, OSFS_STAT_EXTENTS_FREED);
+            continue;
+        }
+
+        idx = osfs_ext_index(hdr, i);
+        child = osfs_ext_node(sb_info, idx->node_block);
+        if (!osfs_ext_valid(child, hdr->eh_depth - 1)) {
+            pr_err("osfs_ext_truncate_node: Corrupted extent node %u in inode %u\n",
+                   idx->node_block, inode->i_ino);
+            return -EIO;
+        }
+
+        ret = osfs_ext_truncate_node(sb_info, inode, child, lblk);
+        if (ret < 0)
+            return ret;
+        freed += ret;
+
+        if (child->eh_entries) {
+            osfs_meta_block_dirty(sb_info, idx->node_block);
+        } else {
+            osfs_free_data_block(sb_info, idx->node_block);
+            freed++;
+            hdr->eh_entries--;
+        }
+
+        // Subtrees before this one only map blocks below its first key
+        if (idx->logical_block < lblk)
+            break;
+    }
+
+    return freed;
+}
+
+/**
+ * Function: osfs_ext_truncate
+ * Description: Unmaps every block of a file from @lblk on and gives the
+ *              blocks back to the allocator, in O(extents) rather than
+ *              O(blocks). A tree left empty shrinks back to an inline leaf.
+ *              The caller holds the inode's extent lock exclusively and
+ *              invalidates the extent cached by osfs_map_file_offset.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inode: The osfs_inode owning the tree.
+ *   - lblk: The first logical block to unmap; 0 frees everything.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if the tree is corrupted.
+ */
+int osfs_ext_truncate(struct osfs_sb_info *sb_info, struct osfs_inode *inode, uint32_t lblk)
+{
+    struct osfs_extent_header *root = osfs_ext_root(inode);
+    long freed;
+
+    if (!osfs_ext_valid(root, -1) || root->eh_depth > OSFS_EXT_MAX_DEPTH) {
+        pr_err("osfs_ext_truncate: Corrupted extent root in inode %u\n", inode->i_ino);
+        return -EIO;
+    }
+
+    freed = osfs_ext_truncate_node(sb_info, inode, root, lblk);
+    if (freed < 0)
+        return freed;
+
+    inode->i_blocks -= min_t(long, inode->i_blocks, freed);
+    if (!root->eh_entries)
+        osfs_ext_init(inode);
+    return 0;
+}
+
+/**
+ * Function: osfs_ext_remove_entry
+ * Description: Deletes the leaf entry at the end of @path. A node below the
+ *              root left empty is freed and its entry removed one level up in
+ *              turn; an empty root goes back to an inline leaf. The blocks the
+ *              entry mapped are the caller's to release.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inode: The osfs_inode owning the tree.
+ *   - path: The path to the entry.
+ *   - depth: The level of the leaf in @path.
+ * Returns:
+ *   - None.
+ */
+static void osfs_ext_remove_entry(struct osfs_sb_info *sb_info, struct osfs_inode *inode,
+                                  struct osfs_ext_path *path, int depth)
+{
+    struct osfs_extent_header *hdr;
+    int level = depth, pos;
+
+    osfs_stat_inc(sb_info, OSFS_STAT_EXTENTS_FREED);
+    for (;;) {
+        hdr = path[level].hdr;
+        pos = path[level].pos;
+        memmove(osfs_ext_entry(hdr, pos), osfs_ext_entry(hdr, pos + 1),
+                (size_t)(hdr->eh_entries - pos - 1) * OSFS_EXT_ENTRY_SIZE);
+        hdr->eh_entries--;
+        if (hdr->eh_entries || level == 0)
+            break;
+
+        osfs_free_data_block(sb_info, path[level].block);
+        inode->i_blocks--;
+        level--;
+    }
+
+    if (!hdr->eh_entries) {
+        osfs_ext_init(inode);
+        return;
+    }
+    if (pos == 0 && level > 0)
+        osfs_ext_fix_keys(path, level);
+    osfs_ext_dirty_path(sb_info, path, level);
+}
+
+// Passed to osfs_ext_split for a range to unmap rather than remap
+#define OSFS_EXT_NO_BLOCK U32_MAX
+
+/**
+ * Function: osfs_ext_split
+ * Description: Replaces the mapping of [@lblk, @end) inside the extent at the
+ *              end of @path, which contains @lblk, by @mid_start, or unmaps
+ *              it if @mid_start is OSFS_EXT_NO_BLOCK. The entry keeps the
+ *              part before @lblk, or else the part after the range, and the
+ *              other parts are inserted. If an insert fails, the tree is put
+ *              back as it was. The blocks no longer mapped are the caller's.
+ * Returns:
+ *   - The logical block where the replacement stopped: @end, or the end of
+ *     the extent if that comes first.
+ *   - -ENOSPC or -ENOMEM if a tree node cannot be allocated.
+ *   - -EIO if the tree is corrupted.
+ */
+static long osfs_ext_split(struct osfs_sb_info *sb_info, struct osfs_inode *inode,
+                           struct osfs_ext_path *path, int depth, uint32_t lblk, uint32_t end,
+                           uint32_t mid_start)
+{
+    struct osfs_extent *ext = osfs_ext_leaf(path[depth].hdr, path[depth].pos);
+    struct osfs_extent orig = *ext, piece;
+    uint32_t orig_end = orig.logical_block + orig.block_count;
+    uint32_t stop = min(end, orig_end);
+    uint32_t head = lblk - orig.logical_block, mid = stop - lblk, tail = orig_end - stop;
+    int ret;
+
+    if (!head && !tail) {
+        if (mid_start == OSFS_EXT_NO_BLOCK) {
+            osfs_ext_remove_entry(sb_info, inode, path, depth);
+        } else {
+            ext->start_block = mid_start;
+            osfs_ext_dirty_path(sb_info, path, depth);
+        }
+        return stop;
+    }
+
+    if (head) {
+        ext->block_count = head;
+    } else {
+        ext->logical_block = stop;
+        ext->start_block = orig.start_block + mid;
+        ext->block_count = tail;
+        if (path[depth].pos == 0)
+            osfs_ext_fix_keys(path, depth);
+    }
+    osfs_ext_dirty_path(sb_info, path, depth);
+
+    if (head && tail) {
+        piece.logical_block = stop;
+        piece.start_block = orig.start_block + head + mid;
+        piece.block_count = tail;
+        ret = osfs_ext_insert(sb_info, inode, &piece);
+        if (ret)
+            goto restore;
+    }
+    if (mid_start == OSFS_EXT_NO_BLOCK)
+        return stop;
+
+    piece.logical_block = lblk;
+    piece.start_block = mid_start;
+    piece.block_count = mid;
+    ret = osfs_ext_insert(sb_info, inode, &piece);
+    if (!ret)
+        return stop;
+
+    if (head && tail) {
+        // Take the separate tail out again; it may have merged into the next extent
+        depth = osfs_ext_find_path(sb_info, inode, stop, path, NULL);
+        if (depth < 0)
+            return depth;
+        ext = osfs_ext_leaf(path[depth].hdr, path[depth].pos);
+        if (ext->block_count == tail) {
+            osfs_ext_remove_entry(sb_info, inode, path, depth);
+        } else {
+            ext->logical_block += tail;
+            ext->start_block += tail;
+            ext->block_count -= tail;
+            if (path[depth].pos == 0)
+                osfs_ext_fix_keys(path, depth);
+            osfs_ext_dirty_path(sb_info, path, depth);
+        }
+
+        depth = osfs_ext_find_path(sb_info, inode, orig.logical_block, path, NULL);
+        if (depth < 0)
+            return depth;
+        ext = osfs_ext_leaf(path[depth].hdr, path[depth].pos);
+    }
+
+restore:
+    // A failed insert leaves the tree untouched, so @path still holds
+    *ext = orig;
+    if (path[depth].pos == 0)
+        osfs_ext_fix_keys(path, depth);
+    osfs_ext_dirty_path(sb_info, path, depth);
+    return ret;
+}
+
+/**
+ * Function: osfs_ext_written_whole
+ * Description: Converts the whole unwritten extent found at the end of @path
+ *              to written, clearing its blocks. The fallback for a partial
+ *              conversion that cannot split the extent.
+ * Returns:
+ *   - The logical block past the extent.
+ *   - -ENOMEM if the blocks cannot be backed (mem=sparse).
+ */
+static long osfs_ext_written_whole(struct osfs_sb_info *sb_info, struct osfs_ext_path *path,
+                                   int depth)
+{
+    struct osfs_extent *ext = osfs_ext_leaf(path[depth].hdr, path[depth].pos);
+    int ret;
+
+    ret = osfs_data_blocks_prepare(sb_info, osfs_ext_pblk(ext), ext->block_count);
+    if (ret)
+        return ret;
+    ext->start_block = osfs_ext_pblk(ext);
+    osfs_ext_dirty_path(sb_info, path, depth);
+    return ext->logical_block + ext->block_count;
+}
+
+/**
+ * Function: osfs_ext_mark_written
+ * Description: Converts the unwritten extents under [@lblk, @lblk + @count)
+ *              to written before data is stored in them; their blocks are
+ *              backed and cleared here, as osfs_alloc_extent does for others.
+ *              Written extents and holes in the range are left alone.
+ *              The caller holds the inode's extent lock exclusively and,
+ *              when blocks were converted, resets the extent cached by
+ *              osfs_map_file_offset.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inode: The osfs_inode owning the tree.
+ *   - lblk: The first logical block to convert.
+ *   - count: Number of blocks to convert.
+ * Returns:
+ *   - The number of blocks converted.
+ *   - -ENOMEM if blocks cannot be backed (mem=sparse).
+ *   - -EIO if the tree is corrupted.
+ */
+long osfs_ext_mark_written(struct osfs_sb_info *sb_info, struct osfs_inode *inode, uint32_t lblk,
+                           uint32_t count)
+{
+    struct osfs_ext_path path[OSFS_EXT_MAX_DEPTH + 1];
+    uint32_t end = lblk + count, next, pblk;
+    struct osfs_extent *ext;
+    long done, converted = 0;
+    int depth, ret;
+
+    while (lblk < end) {
+        depth = osfs_ext_find_path(sb_info, inode, lblk, path, &next);
+        if (depth < 0)
+            return depth;
+
+        ext = path[depth].pos >= 0 ? osfs_ext_leaf(path[depth].hdr, path[depth].pos) : NULL;
+        if (!ext || lblk - ext->logical_block >= ext->block_count) {
+            lblk = next;
+            continue;
+        }
+        if (!osfs_ext_is_unwritten(ext)) {
+            lblk = ext->logical_block + ext->block_count;
+            continue;
+        }
+
+        // Clear only the blocks written and split them off the extent
+        pblk = osfs_ext_pblk(ext) + (lblk - ext->logical_block);
+        ret = osfs_data_blocks_prepare(sb_info, pblk,
+                                       min(end, ext->logical_block + ext->block_count) - lblk);
+        if (ret)
+            return ret;
+        done = osfs_ext_split(sb_info, inode, path, depth, lblk, end, pblk);
+        if (done == -ENOSPC || done == -ENOMEM) {
+            // No room to split: convert the whole extent instead
+            depth = osfs_ext_find_path(sb_info, inode, lblk, path, NULL);
+            if (depth < 0)
+                return depth;
+            done = osfs_ext_written_whole(sb_info, path, depth);
+        }
+        if (done < 0)
+            return done;
+        converted += done - lblk;
+        lblk = done;
+    }
+    return converted;
+}
+
+/**
+ * Function: osfs_ext_punch
+ * Description: Unmaps [@lblk, @lblk + @count) of a file, splitting the
+ *              extents cut at its edges, and puts the blocks with
+ *              osfs_share_put. A compressed extent cut at an edge must have
+ *              been inflated first. The caller holds the inode's extent lock
+ *              exclusively and resets the extent cached by
+ *              osfs_map_file_offset.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inode: The osfs_inode owning the tree.
+ *   - lblk: The first logical block to unmap.
+ *   - count: Number of blocks to unmap.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC or -ENOMEM if an extent cut in the middle cannot be split; the
+ *     range may then be partly unmapped.
+ *   - -EIO if the tree is corrupted or a compressed extent is cut.
+ */
+int osfs_ext_punch(struct osfs_sb_info *sb_info, struct osfs_inode *inode, uint32_t lblk,
+                   uint32_t count)
+{
+    struct osfs_ext_path path[OSFS_EXT_MAX_DEPTH + 1];
+    uint32_t end = lblk + count, next, pblk, freed;
+    struct osfs_extent *ext, cext;
+    long done;
+    int depth;
+
+    while (lblk < end) {
+        depth = osfs_ext_find_path(sb_info, inode, lblk, path, &next);
+        if (depth < 0)
+            return depth;
+
+        ext = path[depth].pos >= 0 ? osfs_ext_leaf(path[depth].hdr, path[depth].pos) : NULL;
+        if (!ext || lblk - ext->logical_block >= ext->block_count) {
+            lblk = next;
+            continue;
+        }
+
+        cext = *ext;
+        if (osfs_ext_is_compressed(&cext) &&
+            (cext.logical_block < lblk || cext.logical_block + cext.block_count > end)) {
+            pr_err("osfs_ext_punch: Compressed extent at block %u of inode %u is cut\n",
+                   cext.logical_block, inode->i_ino);
+            return -EIO;
+        }
+
+        pblk = osfs_ext_pblk(ext) + (lblk - ext->logical_block);
+        done = osfs_ext_split(sb_info, inode, path, depth, lblk, end, OSFS_EXT_NO_BLOCK);
+        if (done < 0)
+            return done;
+        if (osfs_ext_is_compressed(&cext)) {
+            freed = osfs_compress_free(sb_info, &cext);
+        } else {
+            osfs_share_put(sb_info, pblk, done - lblk);
+            freed = done - lblk;
+        }
+        inode->i_blocks -= min_t(uint32_t, inode->i_blocks, freed);
+        lblk = done;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_ext_remap
+ * Description: Points [@lblk, @lblk + @count), which a single extent maps,
+ *              at the blocks from @start_block on, as copy-on-write moves
+ *              them to a private copy. The blocks mapped before are the
+ *              caller's to put. The caller holds the inode's extent lock
+ *              exclusively and resets the extent cached by
+ *              osfs_map_file_offset.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inode: The osfs_inode owning the tree.
+ *   - lblk: The first logical block to remap.
+ *   - count: Number of blocks to remap.
+ *   - start_block: The new first block, with OSFS_EXT_FLAGS if they apply.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC or -ENOMEM if the extent cannot be split; nothing changed.
+ *   - -EIO if the range is not inside one extent or the tree is corrupted.
+ */
+int osfs_ext_remap(struct osfs_sb_info *sb_info, struct osfs_inode *inode, uint32_t lblk,
+                   uint32_t count, uint32_t start_block)
+{
+    struct osfs_ext_path path[OSFS_EXT_MAX_DEPTH + 1];
+    struct osfs_extent *ext;
+    long done;
+    int depth;
+
+    depth = osfs_ext_find_path(sb_info, inode, lblk, path, NULL);
+    if (depth < 0)
+        return depth;
+
+    ext = path[depth].pos >= 0 ? osfs_ext_leaf(path[depth].hdr, path[depth].pos) : NULL;
+    if (!ext || lblk - ext->logical_block >= ext->block_count ||
+        lblk + count > ext->logical_block + ext->block_count) {
+        pr_err("osfs_ext_remap: Blocks %u-%u of inode %u are not one extent\n",
+               lblk, lblk + count - 1, inode->i_ino);
+        return -EIO;
+    }
+
+    done = osfs_ext_split(sb_info, inode, path, depth, lblk, lblk + count, start_block);
+    return done < 0 ? done : 0;
+}
+
+/**
+ * Function: osfs_map_file_offset
+ * Description: Translates a byte offset in a file into an address in the data
+ *              area. The extent found last is cached in the in-memory inode,
+ *              so sequential I/O resolves each extent with one tree walk and
+ *              every later offset inside it without touching the tree. Inserts
+ *              only add or extend extents, so a cached extent stays valid;
+ *              truncation, punching, remapping and unwritten conversion
+ *              reset the cache.
+ *              The span returned runs to the end of the extent, or of the
+ *              memory chunk or device block holding @pos when that comes
+ *              first, so callers copy it all at once. Inline data maps to
+ *              the inode itself, with OSFS_INLINE_BLOCK as its block. An
+ *              unwritten extent is reported like a hole, as it reads zeroes;
+ *              writers convert it with osfs_ext_mark_written first. Data in
+ *              a compressed extent has no address: readers copy it with
+ *              osfs_compress_read, writers inflate it first.
+ * Inputs:
+ *   - inode: The VFS inode to map; its extent lock is held by the caller.
+ *   - pos: Byte offset in the file.
+ *   - addr: Pointer to store the address backing @pos.
+ *   - len: Pointer to store the contiguous bytes available at *addr. When
+ *          @pos is not mapped it is set to the distance to the next mapped
+ *          byte instead, or 0 if nothing is mapped past @pos; in an
+ *          unwritten or compressed extent, to the end of that extent.
+ *   - block: If non-NULL, set to the data block backing @pos, for callers
+ *            that modify it and pass it to osfs_data_block_dirty (or mark
+ *            the inode dirty for OSFS_INLINE_BLOCK).
+ * Returns:
+ *   - 0 if @pos is mapped.
+ *   - -ENOENT if it is not.
+ *   - -ENODATA if it lies in a compressed extent.
+ *   - -EIO if the extent tree is corrupted or the block cannot be read.
+ */
+int osfs_map_file_offset(struct inode *inode, loff_t pos, void **addr, size_t *len,
+                         uint32_t *block)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode_info *oi = OSFS_I(inode);
+    uint32_t lblk = pos / BLOCK_SIZE, pblk;
+    struct osfs_extent ext;
+    unsigned int seq;
+    loff_t offset;
+    int ret;
+
+    if (osfs_inode_is_inline(oi->raw)) {
+        if (pos >= OSFS_INLINE_DATA_SIZE) {
+            *addr = NULL;
+            *len = 0;
+            return -ENOENT;
+        }
+        if (block)
+            *block = OSFS_INLINE_BLOCK;
+        *addr = oi->raw->i_inline_data + pos;
+        *len = OSFS_INLINE_DATA_SIZE - pos;
+        return 0;
+    }
+
+    do {
+        seq = read_seqbegin(&oi->i_ext_cache_lock);
+        ext = oi->i_ext_cache;
+    } while (read_seqretry(&oi->i_ext_cache_lock, seq));
+
+    if (lblk - ext.logical_block >= ext.block_count) {
+        ret = osfs_ext_lookup(sb_info, oi->raw, lblk, &ext);
+        if (ret) {
+            *addr = NULL;
+            if (ret == -ENOENT)
+                *len = ext.logical_block == U32_MAX ? 0 :
+                       (size_t)((loff_t)ext.logical_block * BLOCK_SIZE - pos);
+            return ret;
+        }
+
+        write_seqlock(&oi->i_ext_cache_lock);
+        oi->i_ext_cache = ext;
+        write_sequnlock(&oi->i_ext_cache_lock);
+    }
+
+    if (ext.start_block & OSFS_EXT_FLAGS) {
+        *addr = NULL;
+        *len = (size_t)((loff_t)(ext.logical_block + ext.block_count) * BLOCK_SIZE - pos);
+        return osfs_ext_is_unwritten(&ext) ? -ENOENT : -ENODATA;
+    }
+
+    offset = pos - (loff_t)ext.logical_block * BLOCK_SIZE;
+    pblk = ext.start_block + offset / BLOCK_SIZE;
+    if (block)
+        *block = pblk;
+
+    *addr = osfs_data_block(sb_info, pblk);
+    if (!*addr)
+        return -EIO;
+    *addr += offset % BLOCK_SIZE;
+    *len = (size_t)min(osfs_data_contig(sb_info, pblk), ext.start_block + ext.block_count - pblk) *
+           BLOCK_SIZE - offset % BLOCK_SIZE;
+    return 0;
+}
+
+/**
+ * Function: osfs_ext_cache_reset
+ * Description: Forgets the extent cached by osfs_map_file_offset, after
+ *              blocks were removed from the file. The caller holds the extent
+ *              lock exclusively, so nobody is mapping meanwhile.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ * Returns:
+ *   - None.
+ */
+void osfs_ext_cache_reset(struct inode *inode)
+{
+    struct osfs_inode_info *oi = OSFS_I(inode);
+
+    write_seqlock(&oi->i_ext_cache_lock);
+    memset(&oi->i_ext_cache, 0, sizeof(oi->i_ext_cache));
+    write_sequnlock(&oi->i_ext_cache_lock);
+}
@@ -1,158 +1,1672 @@
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/writeback.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/fiemap.h>
+#include <linux/mount.h>
+#include <linux/falloc.h>
+#include <linux/blkdev.h>
 #include "osfs.h"
+#include "osfs_trace.h"
 
 /**
- * Function: osfs_read
- * Description: Reads data from a file.
+ * Function: osfs_mapped_dirty
+ * Description: Records that the block osfs_map_file_offset returned was
+ *              modified; inline data is part of the inode.
+ */
+static void osfs_mapped_dirty(struct inode *inode, uint32_t block)
+{
+    if (block == OSFS_INLINE_BLOCK)
+        mark_inode_dirty(inode);
+    else
+        osfs_data_block_dirty(inode->i_sb->s_fs_info, block);
+}
+
+/**
+ * Function: osfs_inline_spill
+ * Description: Moves the data of an inline file into its first data block
+ *              and turns the inline area back into an empty extent root. An
+ *              empty file needs no block. On failure the file stays inline.
+ *              The caller holds the extent lock exclusively.
  * Inputs:
- *   - filp: The file pointer representing the file to read from.
- *   - buf: The user-space buffer to copy the data into.
- *   - len: The number of bytes to read.
- *   - ppos: The file position pointer.
+ *   - inode: The VFS inode of the file.
  * Returns:
- *   - The number of bytes read on success.
- *   - 0 if the end of the file is reached.
- *   - -EFAULT if copying data to user space fails.
+ *   - 0 on success.
+ *   - -ENOSPC if no block is free.
+ *   - -ENOMEM or -EIO on failure.
  */
-static ssize_t osfs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
+static int osfs_inline_spill(struct inode *inode)
 {
-    struct inode *inode = file_inode(filp);
-    struct osfs_inode *osfs_inode = inode->i_private;
     struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
-    void *data_block;
-    ssize_t bytes_read = 0;
-    size_t to_read;
-    int i;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    uint8_t data[OSFS_INLINE_DATA_SIZE];
+    size_t mapped;
+    uint32_t block;
+    void *addr;
+    int ret;
 
-    if (osfs_inode->extent_count == 0 || *ppos >= osfs_inode->i_size) {
+    memcpy(data, osfs_inode->i_inline_data, sizeof(data));
+    memset(osfs_inode->i_inline_data, 0, sizeof(osfs_inode->i_inline_data));
+    osfs_inode->i_flags &= ~OSFS_INLINE_DATA_FL;
+    osfs_ext_init(osfs_inode);
+    if (!i_size_read(inode))
         return 0;
+
+    ret = osfs_alloc_file_blocks(sb_info, osfs_inode, 0, 1, false);
+    if (!ret)
+        ret = osfs_map_file_offset(inode, 0, &addr, &mapped, &block);
+    if (ret) {
+        osfs_ext_truncate(sb_info, osfs_inode, 0);
+        osfs_ext_cache_reset(inode);
+        memcpy(osfs_inode->i_inline_data, data, sizeof(data));
+        osfs_inode->i_flags |= OSFS_INLINE_DATA_FL;
+        return ret;
     }
 
-    if (*ppos + len > osfs_inode->i_size) {
-        len = osfs_inode->i_size - *ppos;
+    // Bytes past i_size are kept zero, so the whole area can be copied
+    memcpy(addr, data, sizeof(data));
+    osfs_data_block_dirty(sb_info, block);
+    return 0;
+}
+
+/**
+ * Function: osfs_map_blocks
+ * Description: Makes sure the data blocks under [pos, pos + len) are
+ *              allocated, and only those: a write past a hole leaves the
+ *              hole unmapped. Missing blocks are requested in a single call
+ *              per hole, so a large write becomes one contiguous extent. An
+ *              inline file needs nothing as long as the range fits inline,
+ *              and spills to a block when it does not. Compressed extents in
+ *              the folios of the range are inflated, blocks shared with
+ *              another file are copied (copy-on-write), and unwritten blocks
+ *              become written. Takes the extent lock exclusively, so it may
+ *              be called from paths that do not hold i_rwsem, such as
+ *              page_mkwrite. Runs in the journal handle opened by its caller,
+ *              osfs_prepare_blocks.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - pos: Byte offset of the range.
+ *   - len: Length of the range in bytes.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if the blocks, the copies or the inflated extents cannot be
+ *     allocated.
+ *   - -ENOMEM or -EIO if unwritten blocks cannot be converted.
+ */
+static int osfs_map_blocks(struct inode *inode, loff_t pos, size_t len)
+{
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t first, needed, blocks;
+    long inflated, copied, converted;
+    int ret;
+
+    if (len == 0)
+        return 0;
+
+    first = pos / BLOCK_SIZE;
+    needed = DIV_ROUND_UP(pos + len, BLOCK_SIZE);
+    down_write(osfs_ext_sem(inode));
+    if (osfs_inode_is_inline(osfs_inode)) {
+        if (pos + len <= OSFS_INLINE_DATA_SIZE) {
+            up_write(osfs_ext_sem(inode));
+            return 0;
+        }
+        ret = osfs_inline_spill(inode);
+        if (ret) {
+            up_write(osfs_ext_sem(inode));
+            return ret;
+        }
     }
 
-    for (i = 0; i < osfs_inode->extent_count && len > 0; i++) {
-        struct osfs_extent *extent = &osfs_inode->extents[i];
-        uint32_t start_block = extent->start_block * BLOCK_SIZE;
-        uint32_t end_block = start_block + (extent->block_count * BLOCK_SIZE);
+    /*
+     * Compressed and shared blocks are copied, preallocated ones converted,
+     * before data lands there. Writeback copies whole folios, so a chunk
+     * under any part of the folio is inflated, not only under the range.
+     */
+    blocks = osfs_inode->i_blocks;
+    inflated = osfs_inflate_blocks(inode, round_down(pos, PAGE_SIZE) / BLOCK_SIZE,
+                                   round_up(pos + len, PAGE_SIZE) / BLOCK_SIZE -
+                                   round_down(pos, PAGE_SIZE) / BLOCK_SIZE);
+    copied = inflated < 0 ? inflated : osfs_unshare_blocks(inode, first, needed - first);
+    converted = copied < 0 ? copied :
+                osfs_ext_mark_written(sb_info, osfs_inode, first, needed - first);
+    if (inflated || copied || converted)
+        osfs_ext_cache_reset(inode);
+    ret = converted < 0 ? converted :
+          osfs_alloc_file_blocks(sb_info, osfs_inode, first, needed - first, false);
+    up_write(osfs_ext_sem(inode));
 
-        if (*ppos >= start_block && *ppos < end_block) {
-            to_read = min(len, (size_t)(end_block - *ppos));
-            data_block = sb_info->data_blocks + (*ppos);
+    // The extent root lives in the inode
+    if (inflated || copied || converted || osfs_inode->i_blocks != blocks)
+        mark_inode_dirty(inode);
+    // Running out of space is reported to the writer, and best-effort callers expect it
+    if (ret && ret != -ENOSPC)
+        pr_err("osfs_map_blocks: Failed to map blocks %u-%u of inode %lu\n",
+               first, needed - 1, inode->i_ino);
+    return ret;
+}
 
-            if (copy_to_user(buf + bytes_read, data_block, to_read)) {
-                return -EFAULT;
-            }
+/**
+ * Function: osfs_prepare_blocks
+ * Description: Maps the blocks under [pos, pos + len) with osfs_map_blocks,
+ *              as one journal transaction. When that runs out of space while
+ *              blocks freed earlier are still waiting for their transaction,
+ *              it commits them and tries once more.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - pos: Byte offset of the range.
+ *   - len: Length of the range in bytes.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from osfs_map_blocks on failure.
+ */
+static int osfs_prepare_blocks(struct inode *inode, loff_t pos, size_t len)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_handle handle;
+    bool retried = false;
+    int ret;
+
+    for (;;) {
+        osfs_journal_start(sb_info, &handle);
+        ret = osfs_map_blocks(inode, pos, len);
+        osfs_journal_stop(&handle);
+        if (ret != -ENOSPC || retried || !osfs_journal_retry(sb_info))
+            return ret;
+        retried = true;
+    }
+}
+
+/**
+ * Function: osfs_fill_folio
+ * Description: Copies the file data backing a folio out of the data area,
+ *              decompressing what compressed extents hold. Parts of the folio
+ *              past EOF or not mapped by any extent are zeroed. The extent
+ *              map is read under the shared extent lock.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - folio: The locked folio to fill.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if the extent tree or a compressed extent is corrupted.
+ */
+static int osfs_fill_folio(struct inode *inode, struct folio *folio)
+{
+    loff_t pos = folio_pos(folio);
+    loff_t isize = i_size_read(inode);
+    size_t size = folio_size(folio), offset = 0, chunk, mapped;
+    void *src, *dst;
+    int ret = 0;
 
-            *ppos += to_read;
-            bytes_read += to_read;
-            len -= to_read;
+    down_read(osfs_ext_sem(inode));
+    while (offset < size) {
+        if (pos + offset >= isize) {
+            folio_zero_range(folio, offset, size - offset);
+            break;
         }
+
+        ret = osfs_map_file_offset(inode, pos + offset, &src, &mapped, NULL);
+        if (ret == -ENOENT) {
+            chunk = mapped ? min(mapped, size - offset) : size - offset;
+            folio_zero_range(folio, offset, chunk);
+            offset += chunk;
+            ret = 0;
+            continue;
+        }
+        if (ret && ret != -ENODATA)
+            break;
+
+        chunk = min3(mapped, size - offset, (size_t)(isize - pos - offset));
+        dst = kmap_local_folio(folio, offset);
+        if (ret)
+            ret = osfs_compress_read(inode, pos + offset, dst, chunk);
+        else
+            memcpy(dst, src, chunk);
+        kunmap_local(dst);
+        if (ret)
+            break;
+        offset += chunk;
     }
+    up_read(osfs_ext_sem(inode));
 
-    return bytes_read;
+    return ret;
 }
 
+/**
+ * Function: osfs_read_folio
+ * Description: Fills a page cache folio from the extents of the file.
+ * Inputs:
+ *   - file: The file being read (may be NULL).
+ *   - folio: The locked folio to fill.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code on failure.
+ */
+static int osfs_read_folio(struct file *file, struct folio *folio)
+{
+    int ret;
 
+    ret = osfs_fill_folio(folio->mapping->host, folio);
+    if (!ret)
+        folio_mark_uptodate(folio);
+    folio_unlock(folio);
+    return ret;
+}
 
 /**
- * Function: osfs_write
- * Description: Writes data to a file.
+ * Function: osfs_write_folio
+ * Description: Writes one dirty folio back into the data blocks backing it.
+ *              The data area lives in memory, or in cached buffers of the
+ *              block device that are marked dirty for its own writeback, so
+ *              the copy completes before the function returns and writeback
+ *              ends immediately.
  * Inputs:
- *   - filp: The file pointer representing the file to write to.
- *   - buf: The user-space buffer containing the data to write.
- *   - len: The number of bytes to write.
- *   - ppos: The file position pointer.
+ *   - folio: The locked folio to write back.
+ *   - wbc: The writeback control of this pass.
+ *   - data: Unused.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if the extent tree is corrupted or a block cannot be read.
+ */
+static int osfs_write_folio(struct folio *folio, struct writeback_control *wbc, void *data)
+{
+    struct inode *inode = folio->mapping->host;
+    loff_t pos = folio_pos(folio);
+    loff_t isize = i_size_read(inode);
+    size_t size, offset = 0, chunk, mapped;
+    uint32_t block;
+    void *src, *dst;
+    int ret = 0;
+
+    // Folios entirely past EOF were truncated away while dirty
+    if (pos >= isize) {
+        folio_unlock(folio);
+        return 0;
+    }
+    size = min_t(loff_t, folio_size(folio), isize - pos);
+
+    // An mmap store past EOF must not reach the file once it grows over it
+    if (size < folio_size(folio))
+        folio_zero_segment(folio, offset_in_folio(folio, isize), folio_size(folio));
+
+    folio_start_writeback(folio);
+    down_read(osfs_ext_sem(inode));
+    while (offset < size) {
+        ret = osfs_map_file_offset(inode, pos + offset, &dst, &mapped, &block);
+        if (ret == -ENOENT) {
+            /*
+             * A hole or unwritten range of a dirty folio holds the zeroes it
+             * was read as: data only enters the page cache through
+             * write_begin and page_mkwrite, which map its blocks first
+             */
+            offset += mapped ? min(mapped, size - offset) : size - offset;
+            ret = 0;
+            continue;
+        }
+        if (ret) {
+            pr_err("osfs_write_folio: Offset %lld of inode %lu cannot be mapped\n",
+                   pos + offset, inode->i_ino);
+            ret = -EIO;
+            mapping_set_error(folio->mapping, ret);
+            break;
+        }
+
+        chunk = min(mapped, size - offset);
+        src = kmap_local_folio(folio, offset);
+        memcpy(dst, src, chunk);
+        kunmap_local(src);
+        osfs_mapped_dirty(inode, block);
+        offset += chunk;
+    }
+    up_read(osfs_ext_sem(inode));
+    folio_unlock(folio);
+    folio_end_writeback(folio);
+
+    return ret;
+}
+
+/**
+ * Function: osfs_writepages
+ * Description: Writes the dirty folios of a file back into the data area.
+ *              With -o compress the file is then queued, to be compressed
+ *              once it has not been written back for a while.
+ */
+static int osfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    int ret;
+
+    ret = write_cache_pages(mapping, wbc, osfs_write_folio, NULL);
+    if (!ret)
+        osfs_compress_queue(mapping->host);
+    return ret;
+}
+
+/**
+ * Function: osfs_zero_eof_folio
+ * Description: Clears the part of the cached folio holding @isize that lies
+ *              past it. A store through a shared mapping can leave bytes
+ *              there that writeback never copies out, and growing the file
+ *              would otherwise expose them.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - isize: The current size of the file.
+ * Returns:
+ *   - None.
+ */
+static void osfs_zero_eof_folio(struct inode *inode, loff_t isize)
+{
+    struct folio *folio;
+    size_t offset;
+
+    folio = filemap_lock_folio(inode->i_mapping, isize >> PAGE_SHIFT);
+    if (IS_ERR(folio))
+        return;
+    offset = offset_in_folio(folio, isize);
+    if (offset)
+        folio_zero_segment(folio, offset, folio_size(folio));
+    folio_unlock(folio);
+    folio_put(folio);
+}
+
+/**
+ * Function: osfs_write_begin
+ * Description: Prepares a page cache folio for a buffered write: the blocks
+ *              under the range are allocated and the folio is read in when the
+ *              write does not cover all of it. A write starting past EOF
+ *              first clears the cached bytes between EOF and its start.
+ * Inputs:
+ *   - file: The file being written.
+ *   - mapping: The address space of the file.
+ *   - pos: Byte offset of the write.
+ *   - len: Length of the write within this folio.
+ *   - pagep: Pointer to store the locked page.
+ *   - fsdata: Unused.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code on failure.
+ */
+static int osfs_write_begin(struct file *file, struct address_space *mapping,
+                            loff_t pos, unsigned len, struct page **pagep, void **fsdata)
+{
+    struct inode *inode = mapping->host;
+    loff_t isize = i_size_read(inode);
+    struct folio *folio;
+    int ret;
+
+    // An EOF folio below this one is locked first, in index order
+    if (pos > isize && (isize >> PAGE_SHIFT) < (pos >> PAGE_SHIFT))
+        osfs_zero_eof_folio(inode, isize);
+
+    folio = __filemap_get_folio(mapping, pos >> PAGE_SHIFT, FGP_WRITEBEGIN,
+                                mapping_gfp_mask(mapping));
+    if (IS_ERR(folio))
+        return PTR_ERR(folio);
+
+    ret = osfs_prepare_blocks(inode, pos, len);
+    if (ret)
+        goto out_unlock;
+
+    if (!folio_test_uptodate(folio) && len != folio_size(folio)) {
+        ret = osfs_fill_folio(inode, folio);
+        if (ret)
+            goto out_unlock;
+        folio_mark_uptodate(folio);
+    }
+    if (pos > isize && (isize >> PAGE_SHIFT) == (pos >> PAGE_SHIFT))
+        folio_zero_segment(folio, offset_in_folio(folio, isize), offset_in_folio(folio, pos));
+
+    *pagep = &folio->page;
+    return 0;
+
+out_unlock:
+    folio_unlock(folio);
+    folio_put(folio);
+    return ret;
+}
+
+/**
+ * Function: osfs_write_end
+ * Description: Completes a buffered write: marks the folio dirty and extends
+ *              i_size when the write went past it.
+ * Inputs:
+ *   - file: The file being written.
+ *   - mapping: The address space of the file.
+ *   - pos: Byte offset of the write.
+ *   - len: Length that was requested in write_begin.
+ *   - copied: Number of bytes actually copied into the folio.
+ *   - page: The page returned by write_begin.
+ *   - fsdata: Unused.
+ * Returns:
+ *   - The number of bytes accepted.
+ */
+static int osfs_write_end(struct file *file, struct address_space *mapping,
+                          loff_t pos, unsigned len, unsigned copied,
+                          struct page *page, void *fsdata)
+{
+    struct folio *folio = page_folio(page);
+    struct inode *inode = mapping->host;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    loff_t last_pos = pos + copied;
+
+    if (!folio_test_uptodate(folio)) {
+        // A short copy into a folio that was never read leaves garbage behind
+        if (copied < len) {
+            copied = 0;
+            goto out;
+        }
+        folio_mark_uptodate(folio);
+    }
+
+    if (last_pos > inode->i_size) {
+        i_size_write(inode, last_pos);
+        osfs_inode->i_size = last_pos;
+        mark_inode_dirty(inode);
+    }
+    folio_mark_dirty(folio);
+
+out:
+    folio_unlock(folio);
+    folio_put(folio);
+    return copied;
+}
+
+/**
+ * Struct: osfs_aops
+ * Description: Maps page cache folios of regular files onto their extents.
+ */
+const struct address_space_operations osfs_aops = {
+    .read_folio = osfs_read_folio,
+    .writepages = osfs_writepages,
+    .write_begin = osfs_write_begin,
+    .write_end = osfs_write_end,
+    .dirty_folio = filemap_dirty_folio,
+};
+
+/**
+ * Function: osfs_direct_io
+ * Description: Copies an O_DIRECT request straight between the iterator and
+ *              the data blocks, bypassing the page cache. The extent map is
+ *              looked up once per extent and copy_to_iter/copy_from_iter
+ *              consume as many iovec segments as the extent covers, so a
+ *              vectored request is served in a single pass. Compressed
+ *              extents are read a block at a time through a bounce buffer;
+ *              writes find none, osfs_prepare_blocks inflated them. With
+ *              IOCB_NOWAIT the extent lock is only tried, and a compressed
+ *              extent, whose decompression may sleep, ends the request with
+ *              -EAGAIN.
+ * Inputs:
+ *   - iocb: The I/O control block of the request.
+ *   - iter: The user buffers; its count is already clamped by the caller.
+ *   - rw: READ or WRITE.
+ * Returns:
+ *   - The number of bytes transferred, or a negative error code if nothing
+ *     was transferred.
+ */
+static ssize_t osfs_direct_io(struct kiocb *iocb, struct iov_iter *iter, int rw)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    loff_t pos = iocb->ki_pos;
+    size_t done = 0, chunk, copied, mapped;
+    void *addr, *bounce = NULL;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    uint32_t block;
+    int ret = 0;
+
+    if (sb_info->compress && rw == READ && !nowait) {
+        bounce = kmalloc(BLOCK_SIZE, GFP_KERNEL);
+        if (!bounce)
+            return -ENOMEM;
+    }
+
+    while (iov_iter_count(iter)) {
+        /*
+         * The extent lock is not held across the copy: faulting in the user
+         * buffer may enter page_mkwrite or read_folio of this file. The blocks
+         * themselves cannot go away while the caller holds i_rwsem.
+         */
+        if (!nowait) {
+            down_read(osfs_ext_sem(inode));
+        } else if (!down_read_trylock(osfs_ext_sem(inode))) {
+            ret = -EAGAIN;
+            break;
+        }
+        ret = osfs_map_file_offset(inode, pos, &addr, &mapped, &block);
+        if (ret == -ENODATA && nowait) {
+            ret = -EAGAIN;
+        } else if (ret == -ENODATA && rw == READ) {
+            mapped = min3(mapped, iov_iter_count(iter), (size_t)(BLOCK_SIZE - pos % BLOCK_SIZE));
+            ret = osfs_compress_read(inode, pos, bounce, mapped);
+            addr = bounce;
+        }
+        up_read(osfs_ext_sem(inode));
+        if (ret == -ENOENT && rw == READ) {
+            // Unmapped ranges read back as zeroes
+            chunk = mapped ? min(mapped, iov_iter_count(iter)) : iov_iter_count(iter);
+            copied = iov_iter_zero(chunk, iter);
+            ret = 0;
+        } else if (ret) {
+            if (rw == WRITE && ret != -EAGAIN)
+                ret = -EIO;
+            break;
+        } else {
+            chunk = min(mapped, iov_iter_count(iter));
+            if (rw == READ)
+                copied = copy_to_iter(addr, chunk, iter);
+            else
+                copied = copy_from_iter(addr, chunk, iter);
+            if (rw == WRITE && copied)
+                osfs_mapped_dirty(inode, block);
+        }
+
+        done += copied;
+        pos += copied;
+        if (copied < chunk) {
+            ret = -EFAULT;
+            break;
+        }
+    }
+
+    kfree(bounce);
+    iocb->ki_pos = pos;
+    return done ? done : ret;
+}
+
+/**
+ * Function: osfs_file_do_read_iter
+ * Description: Reads from a regular file. Buffered reads go through the page
+ *              cache; O_DIRECT reads copy from the data blocks after any
+ *              dirty page cache pages in the range have been written back.
+ * Inputs:
+ *   - iocb: The I/O control block of the read.
+ *   - to: The destination of the data.
+ * Returns:
+ *   - The number of bytes read on success.
+ *   - A negative error code on failure.
+ */
+static ssize_t osfs_file_do_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    loff_t isize;
+    ssize_t ret;
+
+    if (!(iocb->ki_flags & IOCB_DIRECT))
+        return generic_file_read_iter(iocb, to);
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!inode_trylock_shared(inode))
+            return -EAGAIN;
+    } else {
+        inode_lock_shared(inode);
+    }
+
+    isize = i_size_read(inode);
+    if (iocb->ki_pos >= isize || !iov_iter_count(to)) {
+        ret = 0;
+        goto out;
+    }
+    iov_iter_truncate(to, isize - iocb->ki_pos);
+
+    ret = kiocb_write_and_wait(iocb, iov_iter_count(to));
+    if (ret)
+        goto out;
+
+    ret = osfs_direct_io(iocb, to, READ);
+out:
+    inode_unlock_shared(inode);
+    file_accessed(iocb->ki_filp);
+    return ret;
+}
+
+/**
+ * Function: osfs_direct_write_ready
+ * Description: Checks, for an IOCB_NOWAIT direct write, that every block
+ *              under [pos, pos + len) is mapped, written and not compressed,
+ *              so the write needs no allocation, conversion, inflation or
+ *              journal handle. Blocks shared by reflink are copied under the
+ *              share index mutex, so while the filesystem has any, the write
+ *              is not tried either. The blocks of the file cannot become
+ *              shared meanwhile: cloning them takes its i_rwsem.
+ * Inputs:
+ *   - inode: The VFS inode of the file; its i_rwsem is held.
+ *   - pos: Byte offset of the write.
+ *   - len: Length of the write in bytes.
+ * Returns:
+ *   - 0 if the write can go ahead without blocking.
+ *   - -EAGAIN if it would block, or the extent lock is contended.
+ */
+static int osfs_direct_write_ready(struct inode *inode, loff_t pos, size_t len)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    loff_t end = pos + len;
+    size_t mapped;
+    void *addr;
+    int ret = 0;
+
+    if (!RB_EMPTY_ROOT(&sb_info->shared_runs))
+        return -EAGAIN;
+    if (!down_read_trylock(osfs_ext_sem(inode)))
+        return -EAGAIN;
+    // Holes, unwritten and compressed extents all fail to map
+    while (!ret && pos < end) {
+        if (osfs_map_file_offset(inode, pos, &addr, &mapped, NULL))
+            ret = -EAGAIN;
+        else
+            pos += mapped;
+    }
+    up_read(osfs_ext_sem(inode));
+    return ret;
+}
+
+/**
+ * Function: osfs_file_direct_write
+ * Description: Performs an O_DIRECT write with the inode lock held. Cached
+ *              pages of the range are written back and dropped first so the
+ *              page cache cannot later overwrite the new data. An
+ *              IOCB_NOWAIT write only goes ahead when its blocks are ready,
+ *              see osfs_direct_write_ready.
+ * Inputs:
+ *   - iocb: The I/O control block of the write.
+ *   - from: The source of the data.
+ *   - count: Number of bytes to write, as clamped by generic_write_checks.
+ * Returns:
+ *   - The number of bytes written on success.
+ *   - A negative error code on failure.
+ */
+static ssize_t osfs_file_direct_write(struct kiocb *iocb, struct iov_iter *from, size_t count)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    ssize_t ret;
+
+    ret = kiocb_invalidate_pages(iocb, count);
+    if (ret)
+        return ret;
+
+    // Unlike buffered writes there is no folio to fall back on, so all blocks must exist
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        ret = osfs_direct_write_ready(inode, iocb->ki_pos, count);
+    else
+        ret = osfs_prepare_blocks(inode, iocb->ki_pos, count);
+    if (ret)
+        return ret;
+
+    ret = osfs_direct_io(iocb, from, WRITE);
+    if (ret <= 0)
+        return ret;
+
+    if (iocb->ki_pos > inode->i_size) {
+        i_size_write(inode, iocb->ki_pos);
+        osfs_inode->i_size = iocb->ki_pos;
+        mark_inode_dirty(inode);
+    }
+    kiocb_invalidate_post_direct_write(iocb, ret);
+
+    return ret;
+}
+
+/**
+ * Function: osfs_write_failed
+ * Description: Frees what a short buffered write allocated past the final
+ *              i_size, as ext4_truncate_failed_write does: the page cache
+ *              past i_size is dropped, then the blocks in [@old_end, @end)
+ *              past it are unmapped. Blocks mapped past EOF before the write,
+ *              such as FALLOC_FL_KEEP_SIZE reservations, all lie below
+ *              @old_end and stay.
+ * Inputs:
+ *   - inode: The VFS inode of the file; its i_rwsem is held.
+ *   - old_end: End of the last extent before the write.
+ *   - end: First block past the range the write asked for.
+ * Returns:
+ *   - None. Blocks that cannot be unmapped stay until truncate or unlink.
+ */
+static void osfs_write_failed(struct inode *inode, uint32_t old_end, uint32_t end)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    loff_t size = i_size_read(inode);
+    uint32_t from = max_t(uint32_t, old_end, DIV_ROUND_UP(size, BLOCK_SIZE));
+    struct osfs_handle handle;
+    int ret = 0;
+
+    if (from >= end)
+        return;
+
+    // The page cache goes first: a journal handle must not wait for folio locks
+    filemap_invalidate_lock(inode->i_mapping);
+    truncate_pagecache(inode, size);
+    osfs_journal_start(sb_info, &handle);
+    down_write(osfs_ext_sem(inode));
+    if (!osfs_inode_is_inline(osfs_inode))
+        ret = osfs_ext_punch(sb_info, osfs_inode, from, end - from);
+    osfs_ext_cache_reset(inode);
+    up_write(osfs_ext_sem(inode));
+    mark_inode_dirty(inode);
+    osfs_journal_stop(&handle);
+    filemap_invalidate_unlock(inode->i_mapping);
+
+    if (ret)
+        pr_err("osfs_write_failed: Blocks %u-%u of inode %lu stay allocated\n",
+               from, end - 1, inode->i_ino);
+}
+
+/**
+ * Function: osfs_file_do_write_iter
+ * Description: Writes to a regular file. The blocks for the whole write are
+ *              allocated up front with one request. Buffered writes are then
+ *              copied in folio by folio by generic_perform_write, and when
+ *              that stops short the blocks allocated past the new end are
+ *              freed again; O_DIRECT writes go straight to the data blocks
+ *              and the cached pages of the range are invalidated. Buffered
+ *              writes cannot avoid allocating, so IOCB_NOWAIT is only
+ *              honoured for O_DIRECT, as in ext4.
+ * Inputs:
+ *   - iocb: The I/O control block of the write.
+ *   - from: The source of the data.
  * Returns:
  *   - The number of bytes written on success.
- *   - -EFAULT if copying data from user space fails.
- *   - Adjusted length if the write exceeds the block size.
+ *   - -EOPNOTSUPP for a buffered IOCB_NOWAIT write.
+ *   - -EAGAIN if an IOCB_NOWAIT write would block.
+ *   - A negative error code on failure.
  */
-static ssize_t osfs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos)
+static ssize_t osfs_file_do_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    struct inode *inode = file_inode(filp);
-    struct osfs_inode *osfs_inode = inode->i_private;
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
     struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
-    void *data_block;
-    ssize_t bytes_written = 0;
-    size_t to_write;
-    int i, ret;
-
-    // 檢查是否分配了任何 extents，如果沒有，分配一個
-    if (osfs_inode->extent_count == 0) {
-        ret = osfs_alloc_extent(sb_info, 1, osfs_inode);
+    uint32_t old_end, end;
+    ssize_t ret;
+    size_t count;
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!(iocb->ki_flags & IOCB_DIRECT))
+            return -EOPNOTSUPP;
+        if (!inode_trylock(inode))
+            return -EAGAIN;
+    } else {
+        inode_lock(inode);
+    }
+
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0)
+        goto out;
+    count = ret;
+
+    // Drops suid/sgid and updates the times, or returns -EAGAIN under IOCB_NOWAIT
+    ret = kiocb_modified(iocb);
+    if (ret)
+        goto out;
+
+    if (iocb->ki_flags & IOCB_DIRECT) {
+        ret = osfs_file_direct_write(iocb, from, count);
+        goto out;
+    }
+
+    down_read(osfs_ext_sem(inode));
+    old_end = osfs_inode_is_inline(osfs_inode) ? 0 : osfs_ext_end(sb_info, osfs_inode);
+    up_read(osfs_ext_sem(inode));
+    end = DIV_ROUND_UP(iocb->ki_pos + count, BLOCK_SIZE);
+
+    // Best effort: on -ENOSPC write_begin allocates what it can and the write is short
+    osfs_prepare_blocks(inode, iocb->ki_pos, count);
+
+    ret = generic_perform_write(iocb, from);
+    if (ret < (ssize_t)count)
+        osfs_write_failed(inode, old_end, end);
+out:
+    inode_unlock(inode);
+    if (ret > 0)
+        ret = generic_write_sync(iocb, ret);
+    return ret;
+}
+
+/**
+ * Function: osfs_file_read_iter
+ * Description: .read_iter of regular files: osfs_file_do_read_iter with the
+ *              bytes read counted and, while the osfs_file_read tracepoint is
+ *              enabled, the request traced with its latency.
+ */
+static ssize_t osfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    bool direct = iocb->ki_flags & IOCB_DIRECT;
+    loff_t pos = iocb->ki_pos;
+    u64 start = 0;
+    ssize_t ret;
+
+    if (trace_osfs_file_read_enabled())
+        start = ktime_get_ns();
+    ret = osfs_file_do_read_iter(iocb, to);
+    if (ret > 0)
+        osfs_stat_add(inode->i_sb->s_fs_info, OSFS_STAT_READ_BYTES, ret);
+    if (trace_osfs_file_read_enabled())
+        trace_osfs_file_read(inode, pos, ret, direct, start ? ktime_get_ns() - start : 0);
+    return ret;
+}
+
+/**
+ * Function: osfs_file_write_iter
+ * Description: .write_iter of regular files, instrumented like
+ *              osfs_file_read_iter.
+ */
+static ssize_t osfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    bool direct = iocb->ki_flags & IOCB_DIRECT;
+    loff_t pos = iocb->ki_pos;
+    u64 start = 0;
+    ssize_t ret;
+
+    if (trace_osfs_file_write_enabled())
+        start = ktime_get_ns();
+    ret = osfs_file_do_write_iter(iocb, from);
+    if (ret > 0) {
+        osfs_stat_add(inode->i_sb->s_fs_info, OSFS_STAT_WRITE_BYTES, ret);
+        // An appending write starts at the EOF it found, known only now
+        pos = iocb->ki_pos - ret;
+    }
+    if (trace_osfs_file_write_enabled())
+        trace_osfs_file_write(inode, pos, ret, direct, start ? ktime_get_ns() - start : 0);
+    return ret;
+}
+
+/**
+ * Function: osfs_page_mkwrite
+ * Description: Called when a shared mapping first writes to a page. The blocks
+ *              backing the page are allocated here, so writeback of pages
+ *              dirtied through mmap never has to allocate.
+ * Inputs:
+ *   - vmf: The fault being handled.
+ * Returns:
+ *   - VM_FAULT_LOCKED with the folio locked and dirty on success.
+ *   - VM_FAULT_NOPAGE if the page was truncated meanwhile.
+ *   - A VM_FAULT error code on failure.
+ */
+static vm_fault_t osfs_page_mkwrite(struct vm_fault *vmf)
+{
+    struct folio *folio = page_folio(vmf->page);
+    struct file *file = vmf->vma->vm_file;
+    struct inode *inode = file_inode(file);
+    loff_t size, pos;
+    vm_fault_t ret;
+    int err;
+
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(file);
+    filemap_invalidate_lock_shared(inode->i_mapping);
+
+    folio_lock(folio);
+    size = i_size_read(inode);
+    pos = folio_pos(folio);
+    if (folio->mapping != inode->i_mapping || pos >= size) {
+        folio_unlock(folio);
+        ret = VM_FAULT_NOPAGE;
+        goto out;
+    }
+
+    err = osfs_prepare_blocks(inode, pos, min_t(loff_t, folio_size(folio), size - pos));
+    if (err) {
+        folio_unlock(folio);
+        ret = vmf_error(err);
+        goto out;
+    }
+
+    folio_mark_dirty(folio);
+    folio_wait_stable(folio);
+    ret = VM_FAULT_LOCKED;
+out:
+    filemap_invalidate_unlock_shared(inode->i_mapping);
+    sb_end_pagefault(inode->i_sb);
+    return ret;
+}
+
+/**
+ * Struct: osfs_file_vm_ops
+ * Description: Faults are resolved through the page cache: filemap_fault
+ *              looks the page up and fills misses through osfs_read_folio,
+ *              which follows the extent map.
+ */
+static const struct vm_operations_struct osfs_file_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = osfs_page_mkwrite,
+};
+
+/**
+ * Function: osfs_file_mmap
+ * Description: Maps a regular file into a process address space.
+ * Inputs:
+ *   - file: The file to map.
+ *   - vma: The virtual memory area being set up.
+ * Returns:
+ *   - 0 on success.
+ */
+static int osfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    file_accessed(file);
+    vma->vm_ops = &osfs_file_vm_ops;
+    return 0;
+}
+
+/**
+ * Function: osfs_file_open
+ * Description: Opens a regular file and advertises O_DIRECT and non-blocking
+ *              (IOCB_NOWAIT) support, which io_uring and AIO check for. Reads
+ *              and direct writes honour IOCB_NOWAIT; buffered writes refuse
+ *              it with -EOPNOTSUPP.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - file: The file being opened.
+ * Returns:
+ *   - 0 on success, or the error of generic_file_open.
+ */
+static int osfs_file_open(struct inode *inode, struct file *file)
+{
+    file->f_mode |= FMODE_CAN_ODIRECT | FMODE_NOWAIT;
+    return generic_file_open(inode, file);
+}
+
+/**
+ * Function: osfs_seek_hole_data
+ * Description: Finds the next data or hole at or after @offset from the
+ *              extent map. Unwritten extents count as holes, as they hold no
+ *              data yet, and so does everything from i_size on. Inline data
+ *              has no holes. Blocks are mapped before data reaches the page
+ *              cache, so the extent map also covers dirty pages.
+ * Inputs:
+ *   - inode: The VFS inode of the file; its i_rwsem is held shared.
+ *   - offset: The byte offset to search from.
+ *   - whence: SEEK_DATA or SEEK_HOLE.
+ * Returns:
+ *   - The offset found.
+ *   - -ENXIO if @offset is at or past i_size, or SEEK_DATA finds no data.
+ *   - -EIO if the extent tree is corrupted.
+ */
+static loff_t osfs_seek_hole_data(struct inode *inode, loff_t offset, int whence)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    loff_t isize = i_size_read(inode), found;
+    struct osfs_extent ext;
+    uint32_t lblk;
+    int ret;
+
+    if (offset < 0 || offset >= isize)
+        return -ENXIO;
+
+    down_read(osfs_ext_sem(inode));
+    if (osfs_inode_is_inline(osfs_inode)) {
+        found = whence == SEEK_DATA ? offset : isize;
+        goto out;
+    }
+
+    lblk = offset / BLOCK_SIZE;
+    if (whence == SEEK_DATA) {
+        // The first written extent ending past @offset
+        while (!(ret = osfs_ext_next(sb_info, osfs_inode, lblk, &ext)) &&
+               osfs_ext_is_unwritten(&ext))
+            lblk = ext.logical_block + ext.block_count;
         if (ret) {
-            pr_err("osfs_write: Failed to allocate extent\n");
+            found = ret == -ENOENT ? -ENXIO : ret;
+            goto out;
+        }
+        found = max(offset, (loff_t)ext.logical_block * BLOCK_SIZE);
+        if (found >= isize)
+            found = -ENXIO;
+    } else {
+        // Skip the written extents that cover @offset and follow it back to back
+        while (!(ret = osfs_ext_lookup(sb_info, osfs_inode, lblk, &ext)) &&
+               !osfs_ext_is_unwritten(&ext))
+            lblk = ext.logical_block + ext.block_count;
+        if (ret == -EIO) {
+            found = ret;
+            goto out;
+        }
+        found = min(max(offset, (loff_t)lblk * BLOCK_SIZE), isize);
+    }
+out:
+    up_read(osfs_ext_sem(inode));
+    return found;
+}
+
+/**
+ * Function: osfs_file_llseek
+ * Description: Repositions a regular file. SEEK_DATA and SEEK_HOLE are
+ *              answered from the extent map by osfs_seek_hole_data, so tools
+ *              such as cp --sparse=auto skip the holes of a sparse file;
+ *              everything else goes to generic_file_llseek.
+ * Inputs:
+ *   - file: The open file.
+ *   - offset: The offset argument of lseek.
+ *   - whence: The whence argument of lseek.
+ * Returns:
+ *   - The new file position.
+ *   - A negative error code on failure.
+ */
+static loff_t osfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+    struct inode *inode = file_inode(file);
+    loff_t ret;
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE)
+        return generic_file_llseek(file, offset, whence);
+
+    inode_lock_shared(inode);
+    ret = osfs_seek_hole_data(inode, offset, whence);
+    inode_unlock_shared(inode);
+    if (ret < 0)
+        return ret;
+    return vfs_setpos(file, ret, inode->i_sb->s_maxbytes);
+}
+
+/**
+ * Function: osfs_file_ioctl
+ * Description: Handles the osfs ioctls of regular files (osfs_ioctl.h).
+ *              OSFS_IOC_DEFRAG writes the page cache back and moves the file
+ *              into one contiguous run with osfs_defrag_file, while i_rwsem
+ *              and the invalidate lock keep writes, faults and direct I/O
+ *              out.
+ * Inputs:
+ *   - file: The open file; OSFS_IOC_DEFRAG needs it open for writing.
+ *   - cmd: The ioctl number.
+ *   - arg: User pointer to a struct osfs_defrag_info.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOTTY for an unknown ioctl, -EBADF if the file is not writable.
+ *   - A negative error code from osfs_defrag_file on failure.
+ */
+static long osfs_file_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct inode *inode = file_inode(file);
+    struct osfs_defrag_info info;
+    struct osfs_handle handle;
+    int ret;
+
+    switch (cmd) {
+    case OSFS_IOC_DEFRAG:
+        if (!(file->f_mode & FMODE_WRITE))
+            return -EBADF;
+        ret = mnt_want_write_file(file);
+        if (ret)
             return ret;
+
+        inode_lock(inode);
+        inode_dio_wait(inode);
+        filemap_invalidate_lock(inode->i_mapping);
+        ret = filemap_write_and_wait(inode->i_mapping);
+        if (!ret) {
+            osfs_journal_start(inode->i_sb->s_fs_info, &handle);
+            ret = osfs_defrag_file(inode, &info);
+            if (!ret && info.blocks)
+                mark_inode_dirty(inode);
+            osfs_journal_stop(&handle);
         }
-        osfs_inode->extent_count = 1;
+        filemap_invalidate_unlock(inode->i_mapping);
+        inode_unlock(inode);
+        mnt_drop_write_file(file);
+
+        if (!ret && copy_to_user((void __user *)arg, &info, sizeof(info)))
+            ret = -EFAULT;
+        return ret;
+    default:
+        return -ENOTTY;
     }
+}
 
-    // 循環寫入數據
-    while (len > 0) {
-        for (i = 0; i < osfs_inode->extent_count && len > 0; i++) {
-            struct osfs_extent *extent = &osfs_inode->extents[i];
-            uint32_t start_block = extent->start_block * BLOCK_SIZE;
-            uint32_t end_block = start_block + (extent->block_count * BLOCK_SIZE);
+/**
+ * Function: osfs_fallocate
+ * Description: Reserves the blocks of [offset, offset + len) ahead of the
+ *              writes that fill them. Each hole in the range is filled by
+ *              one osfs_alloc_extent call, so it becomes one contiguous
+ *              extent where free space allows, and mapped unwritten: the
+ *              blocks are not cleared now, and the range reads back as zeroes
+ *              until written. Blocks already mapped are left as they are.
+ *              Without FALLOC_FL_KEEP_SIZE the file grows to cover the range.
+ *              Like a write, it updates mtime and ctime and drops suid/sgid.
+ * Inputs:
+ *   - file: The file, open for writing.
+ *   - mode: 0 or FALLOC_FL_KEEP_SIZE.
+ *   - offset: First byte of the range.
+ *   - len: Length of the range, checked by vfs_fallocate.
+ * Returns:
+ *   - 0 on success.
+ *   - -EOPNOTSUPP for any other mode.
+ *   - -ENOSPC if the blocks cannot all be reserved; those that could stay.
+ *   - A negative error code on failure.
+ */
+static long osfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+    struct inode *inode = file_inode(file);
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    loff_t end = offset + len;
+    struct osfs_handle handle;
+    uint32_t first, needed;
+    bool retried = false;
+    int ret;
 
-            if (*ppos >= start_block && *ppos < end_block) {
-                to_write = min(len, (size_t)(end_block - *ppos));
-                data_block = sb_info->data_blocks + (*ppos - start_block);
+    if (mode & ~FALLOC_FL_KEEP_SIZE)
+        return -EOPNOTSUPP;
 
-                if (copy_from_user(data_block, buf + bytes_written, to_write)) {
-                    pr_err("osfs_write: copy_from_user failed\n");
-                    return -EFAULT;
-                }
+    inode_lock(inode);
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+        ret = inode_newsize_ok(inode, end);
+        if (ret)
+            goto out;
+    }
 
-                *ppos += to_write;
-                bytes_written += to_write;
-                len -= to_write;
+    // Like a write: the times change and suid/sgid are dropped
+    ret = file_modified(file);
+    if (ret)
+        goto out;
 
-                // 更新文件大小
-                if (*ppos > osfs_inode->i_size) {
-                    osfs_inode->i_size = *ppos;
-                }
-            }
+    first = offset / BLOCK_SIZE;
+    needed = DIV_ROUND_UP(end, BLOCK_SIZE);
+    // Blocks waiting for a commit to be freed may be enough for another pass
+    for (;;) {
+        osfs_journal_start(sb_info, &handle);
+        down_write(osfs_ext_sem(inode));
+        ret = 0;
+        // A range that fits inline is already backed by the inode
+        if (osfs_inode_is_inline(osfs_inode) && end > OSFS_INLINE_DATA_SIZE)
+            ret = osfs_inline_spill(inode);
+        if (!ret && !osfs_inode_is_inline(osfs_inode))
+            ret = osfs_alloc_file_blocks(sb_info, osfs_inode, first, needed - first, true);
+        up_write(osfs_ext_sem(inode));
+
+        if (!ret && !(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+            i_size_write(inode, end);
+            osfs_inode->i_size = end;
         }
+        // The extent root lives in the inode, even after a partial reservation
+        mark_inode_dirty(inode);
+        osfs_journal_stop(&handle);
+        if (ret != -ENOSPC || retried || !osfs_journal_retry(sb_info))
+            break;
+        retried = true;
+    }
+out:
+    inode_unlock(inode);
+    return ret;
+}
 
-        // 如果還有數據要寫，但當前 extents 已滿，則分配新 extent
-        if (len > 0) {
-            ret = osfs_alloc_extent(sb_info, 1, osfs_inode);
-            if (ret) {
-                pr_err("osfs_write: Failed to allocate additional extent\n");
-                return ret;
-            }
+/**
+ * Function: osfs_remap_file_range
+ * Description: Clones a range of one file into another, or elsewhere in the
+ *              same file (FICLONE, FICLONERANGE), by sharing its data blocks
+ *              with osfs_clone_range instead of copying them; the first write
+ *              to a shared block copies it. generic_remap_file_range_prep
+ *              writes back both page caches and checks the block alignment,
+ *              and the cached pages of the destination range are dropped
+ *              afterwards, as they no longer match its blocks. The range may
+ *              end past a block boundary only at the end of both the source
+ *              and the destination. Inline data has no blocks to share: the
+ *              destination spills, the source is refused.
+ * Inputs:
+ *   - file_in: The source file.
+ *   - pos_in: Offset of the range in the source.
+ *   - file_out: The destination file, open for writing.
+ *   - pos_out: Offset of the range in the destination.
+ *   - len: Bytes to clone; 0 clones up to the end of the source.
+ *   - remap_flags: REMAP_FILE_* flags.
+ * Returns:
+ *   - The number of bytes cloned.
+ *   - -EOPNOTSUPP for deduplication or an inline source.
+ *   - -EINVAL for a misaligned range.
+ *   - -ENOSPC if the destination's extent tree cannot grow.
+ *   - Another negative error code on failure.
+ */
+static loff_t osfs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out,
+                                    loff_t pos_out, loff_t len, unsigned int remap_flags)
+{
+    struct inode *src = file_inode(file_in), *dst = file_inode(file_out);
+    struct osfs_inode *osfs_dst = OSFS_I(dst)->raw;
+    struct osfs_handle handle;
+    int ret;
+
+    if (remap_flags & REMAP_FILE_DEDUP)
+        return -EOPNOTSUPP;
+    if (remap_flags & ~(REMAP_FILE_CAN_SHORTEN | REMAP_FILE_ADVISORY))
+        return -EINVAL;
+
+    lock_two_nondirectories(src, dst);
+    filemap_invalidate_lock_two(src->i_mapping, dst->i_mapping);
+
+    ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out, &len, remap_flags);
+    if (ret <= 0)
+        goto out;
+    if (osfs_inode_is_inline(OSFS_I(src)->raw)) {
+        ret = -EOPNOTSUPP;
+        goto out;
+    }
+    // A partial last block would take the bytes after it along
+    if (len % BLOCK_SIZE && pos_out + len < i_size_read(dst)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    // Pages straddling the range are dropped whole, so none may stay dirty
+    ret = filemap_write_and_wait_range(dst->i_mapping, round_down(pos_out, PAGE_SIZE),
+                                       round_up(pos_out + len, PAGE_SIZE) - 1);
+    if (ret)
+        goto out;
+
+    osfs_journal_start(dst->i_sb->s_fs_info, &handle);
+    if (osfs_inode_is_inline(osfs_dst)) {
+        down_write(osfs_ext_sem(dst));
+        ret = osfs_inline_spill(dst);
+        up_write(osfs_ext_sem(dst));
+        if (ret) {
+            osfs_journal_stop(&handle);
+            goto out;
         }
     }
 
-    inode->i_size = osfs_inode->i_size;
-    mark_inode_dirty(inode);
+    ret = osfs_clone_range(src, pos_in / BLOCK_SIZE, dst, pos_out / BLOCK_SIZE,
+                           DIV_ROUND_UP(len, BLOCK_SIZE));
+    if (!ret && pos_out + len > i_size_read(dst)) {
+        i_size_write(dst, pos_out + len);
+        osfs_dst->i_size = pos_out + len;
+    }
+    // The extent root lives in the inode, even after a partial clone
+    mark_inode_dirty(dst);
+    osfs_journal_stop(&handle);
+
+    // Dropping the pages takes their locks, which a journal handle must not wait for
+    invalidate_inode_pages2_range(dst->i_mapping, pos_out >> PAGE_SHIFT,
+                                  (pos_out + len - 1) >> PAGE_SHIFT);
+out:
+    filemap_invalidate_unlock_two(src->i_mapping, dst->i_mapping);
+    unlock_two_nondirectories(src, dst);
+    return ret < 0 ? ret : len;
+}
+
+/**
+ * Function: osfs_copy_file_range
+ * Description: copy_file_range between two files of a mount shares the
+ *              block-aligned part of the range with osfs_remap_file_range.
+ *              Whatever cannot be shared, such as an unaligned range, an
+ *              inline source or a file on another mount, is copied through
+ *              the page cache instead.
+ * Inputs:
+ *   - file_in: The source file.
+ *   - pos_in: Offset of the range in the source.
+ *   - file_out: The destination file.
+ *   - pos_out: Offset of the range in the destination.
+ *   - len: Bytes to copy.
+ *   - flags: Unused, checked by vfs_copy_file_range.
+ * Returns:
+ *   - The number of bytes copied, which may be short.
+ *   - A negative error code on failure.
+ */
+static ssize_t osfs_copy_file_range(struct file *file_in, loff_t pos_in, struct file *file_out,
+                                    loff_t pos_out, size_t len, unsigned int flags)
+{
+    loff_t ret = -EXDEV;
+
+    if (file_inode(file_in)->i_sb == file_inode(file_out)->i_sb)
+        ret = osfs_remap_file_range(file_in, pos_in, file_out, pos_out,
+                                    min_t(loff_t, MAX_RW_COUNT, len), REMAP_FILE_CAN_SHORTEN);
+    if (ret > 0)
+        return ret;
+    return splice_copy_file_range(file_in, pos_in, file_out, pos_out, len);
+}
+
+/**
+ * Function: osfs_sync_data_range
+ * Description: Writes the data blocks under [start, end] of a file on a block
+ *              device mount from the buffer cache, where osfs_write_folio put
+ *              them, to the device and waits for them.
+ * Returns:
+ *   - 0 on success, or the error of the writes.
+ */
+static int osfs_sync_data_range(struct inode *inode, loff_t start, loff_t end)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    uint32_t lblk = start / BLOCK_SIZE, last, from, to;
+    struct osfs_extent ext;
+    loff_t dev;
+    int ret = 0;
+
+    if (start >= i_size_read(inode))
+        return 0;
+    last = min_t(loff_t, end, i_size_read(inode) - 1) / BLOCK_SIZE;
 
-    return bytes_written;
+    down_read(osfs_ext_sem(inode));
+    // Inline data is part of the inode and commits with it
+    if (osfs_inode_is_inline(osfs_inode))
+        goto out;
+    while (!ret && !osfs_ext_next(sb_info, osfs_inode, lblk, &ext) &&
+           ext.logical_block <= last) {
+        from = max(lblk, ext.logical_block);
+        to = min(last, ext.logical_block + ext.block_count - 1);
+        lblk = ext.logical_block + ext.block_count;
+        if (osfs_ext_is_unwritten(&ext))
+            continue;
+        dev = (loff_t)sb_info->disk.s_data_start + osfs_ext_pblk(&ext) + (from - ext.logical_block);
+        ret = sync_blockdev_range(inode->i_sb->s_bdev, dev * BLOCK_SIZE,
+                                  (dev + to - from + 1) * BLOCK_SIZE - 1);
+    }
+out:
+    up_read(osfs_ext_sem(inode));
+    return ret;
 }
 
+/**
+ * Function: osfs_fsync
+ * Description: Makes a file durable. A memory mount has nothing to make
+ *              durable beyond __generic_file_fsync. On a block device
+ *              without a journal, the dirty folios are written into the
+ *              buffer cache, the inode into the inode table and the bitmaps
+ *              into their blocks, and then every dirty buffer of the device,
+ *              which includes the data and extent-tree blocks, is written out
+ *              and the device cache flushed. With a journal, the file's data
+ *              blocks are written first, then the inode goes into the running
+ *              transaction and the transaction that last changed the inode
+ *              is committed; a commit is shared by every fsync waiting for
+ *              it. When that transaction is already on disk, only the device
+ *              cache is flushed for the data.
+ * Inputs:
+ *   - file: The file to sync.
+ *   - start: First byte of the range.
+ *   - end: Last byte of the range.
+ *   - datasync: Unused; the inode is committed with the data either way.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code on failure.
+ */
+static int osfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    struct inode *inode = file->f_mapping->host;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    u64 tid;
+    int ret;
+
+    if (!osfs_on_bdev(sb_info))
+        return __generic_file_fsync(file, start, end, datasync);
+
+    if (!sb_info->journal) {
+        // Extent-tree blocks and bitmaps are not tracked per file: write them all
+        ret = file_write_and_wait_range(file, start, end);
+        if (!ret)
+            ret = sync_inode_metadata(inode, 1);
+        if (ret)
+            return ret;
+        osfs_write_bitmaps(sb_info);
+        ret = sync_blockdev(inode->i_sb->s_bdev);
+        if (ret)
+            return ret;
+        return blkdev_issue_flush(inode->i_sb->s_bdev);
+    }
 
+    ret = file_write_and_wait_range(file, start, end);
+    if (!ret)
+        ret = osfs_sync_data_range(inode, start, end);
+    if (!ret)
+        ret = sync_inode_metadata(inode, 1);
+    if (ret)
+        return ret;
 
+    tid = READ_ONCE(OSFS_I(inode)->i_sync_tid);
+    if (osfs_journal_committed(sb_info, tid))
+        return blkdev_issue_flush(inode->i_sb->s_bdev);
+    return osfs_journal_commit(sb_info, tid);
+}
 
 /**
  * Struct: osfs_file_operations
  * Description: Defines the file operations for regular files in osfs.
  */
 const struct file_operations osfs_file_operations = {
-    .open = generic_file_open, // Use generic open or implement osfs_open if needed
-    .read = osfs_read,
-    .write = osfs_write,
-    .llseek = default_llseek,
+    .open = osfs_file_open,
+    .read_iter = osfs_file_read_iter,
+    .write_iter = osfs_file_write_iter,
+    .splice_read = filemap_splice_read,
+    .splice_write = iter_file_splice_write,
+    .mmap = osfs_file_mmap,
+    .fsync = osfs_fsync,
+    .llseek = osfs_file_llseek,
+    .unlocked_ioctl = osfs_file_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .fallocate = osfs_fallocate,
+    .remap_file_range = osfs_remap_file_range,
+    .copy_file_range = osfs_copy_file_range,
     // Add other operations as needed
 };
 
+/**
+ * Function: osfs_setsize
+ * Description: Changes the size of a regular file. Shrinking drops the page
+ *              cache past the new end, frees the blocks past it and clears the
+ *              rest of the last block, so growing the file again reads zeroes.
+ *              Growing clears the cached tail of the old last page first.
+ *              Growing an inline file past the inline area spills it first.
+ *              The invalidate lock keeps page faults and reads from bringing
+ *              pages back in while the blocks go away.
+ * Inputs:
+ *   - inode: The VFS inode of the file; its i_rwsem is held.
+ *   - size: The new size in bytes.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if an inline file cannot get a block to spill to, or a shared
+ *     or compressed last block cannot be copied.
+ *   - -EIO if the extent tree is corrupted.
+ */
+static int osfs_setsize(struct inode *inode, loff_t size)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    loff_t old_size = i_size_read(inode);
+    struct osfs_handle handle;
+    size_t mapped;
+    uint32_t block;
+    long copied;
+    void *addr;
+    int ret = 0;
+
+    inode_dio_wait(inode);
+    filemap_invalidate_lock(inode->i_mapping);
+
+    // Inline data cannot describe a file larger than the inline area
+    if (size > OSFS_INLINE_DATA_SIZE && osfs_inode_is_inline(osfs_inode)) {
+        osfs_journal_start(sb_info, &handle);
+        down_write(osfs_ext_sem(inode));
+        ret = osfs_inline_spill(inode);
+        up_write(osfs_ext_sem(inode));
+        if (!ret)
+            mark_inode_dirty(inode);
+        osfs_journal_stop(&handle);
+        if (ret)
+            goto out;
+    }
+
+    // Clear what an mmap store left past the old EOF before it becomes file data
+    if (size > old_size)
+        osfs_zero_eof_folio(inode, old_size);
+
+    // The page cache goes first: a journal handle must not wait for folio locks
+    truncate_setsize(inode, size);
+    osfs_journal_start(sb_info, &handle);
+    osfs_inode->i_size = size;
+
+    if (size < old_size) {
+        ret = osfs_truncate_extents(inode, size);
+
+        // The last block is cleared in place, so another file must not share it
+        down_write(osfs_ext_sem(inode));
+        if (!ret && size % BLOCK_SIZE && !osfs_inode_is_inline(osfs_inode)) {
+            copied = osfs_unshare_blocks(inode, size / BLOCK_SIZE, 1);
+            if (copied) {
+                osfs_ext_cache_reset(inode);
+                mark_inode_dirty(inode);
+            }
+            if (copied < 0)
+                ret = copied;
+        }
+        if (!ret && size % BLOCK_SIZE &&
+            !osfs_map_file_offset(inode, size, &addr, &mapped, &block)) {
+            memset(addr, 0, min_t(size_t, mapped, BLOCK_SIZE - size % BLOCK_SIZE));
+            osfs_mapped_dirty(inode, block);
+        }
+        up_write(osfs_ext_sem(inode));
+    }
+    // The new size and the blocks freed past it commit together
+    mark_inode_dirty(inode);
+    osfs_journal_stop(&handle);
+out:
+    filemap_invalidate_unlock(inode->i_mapping);
+
+    return ret;
+}
+
+/**
+ * Function: osfs_setattr
+ * Description: Changes the attributes of a regular file, including its size.
+ * Inputs:
+ *   - idmap: The idmap of the mount.
+ *   - dentry: The dentry of the file.
+ *   - attr: The attributes to change.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code on failure.
+ */
+static int osfs_setattr(struct mnt_idmap *idmap, struct dentry *dentry, struct iattr *attr)
+{
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+    ret = setattr_prepare(idmap, dentry, attr);
+    if (ret)
+        return ret;
+
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        ret = osfs_setsize(inode, attr->ia_size);
+        if (ret)
+            return ret;
+    }
+
+    setattr_copy(idmap, inode, attr);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/**
+ * Function: osfs_fiemap
+ * Description: Reports the extents of a file for FS_IOC_FIEMAP. Physical
+ *              offsets are device offsets on a block device mount and offsets
+ *              into the data area on a memory mount. Inline data is reported
+ *              as one inline extent, blocks reserved by fallocate as
+ *              unwritten extents, compressed extents as encoded, and extents
+ *              with blocks another file maps too as shared. The extent lock
+ *              is dropped around each copy to the user buffer, which may
+ *              fault on this very file.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - fieinfo: The FIEMAP request.
+ *   - start: First byte of the range.
+ *   - len: Length of the range.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code on failure.
+ */
+static int osfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+                       u64 start, u64 len)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    struct osfs_extent ext, next;
+    uint32_t shared, shared_len;
+    u64 base, last;
+    loff_t isize;
+    u32 flags;
+    int ret, more;
+
+    ret = fiemap_prep(inode, fieinfo, start, &len, 0);
+    if (ret)
+        return ret;
+    if (!len)
+        return 0;
+
+    down_read(osfs_ext_sem(inode));
+    if (osfs_inode_is_inline(osfs_inode)) {
+        up_read(osfs_ext_sem(inode));
+        isize = i_size_read(inode);
+        if (start >= isize)
+            return 0;
+        ret = fiemap_fill_next_extent(fieinfo, 0, 0, isize, FIEMAP_EXTENT_DATA_INLINE |
+                                      FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_LAST);
+        return ret < 0 ? ret : 0;
+    }
+    ret = osfs_ext_next(sb_info, osfs_inode, start / BLOCK_SIZE, &ext);
+    up_read(osfs_ext_sem(inode));
+
+    base = osfs_on_bdev(sb_info) ? (u64)sb_info->disk.s_data_start * BLOCK_SIZE : 0;
+    last = (start + len - 1) / BLOCK_SIZE;
+    while (!ret && ext.logical_block <= last) {
+        down_read(osfs_ext_sem(inode));
+        more = osfs_ext_next(sb_info, osfs_inode, ext.logical_block + ext.block_count, &next);
+        up_read(osfs_ext_sem(inode));
+        if (more == -EIO)
+            return more;
+
+        flags = more ? FIEMAP_EXTENT_LAST : 0;
+        if (osfs_ext_is_unwritten(&ext))
+            flags |= FIEMAP_EXTENT_UNWRITTEN;
+        if (osfs_ext_is_compressed(&ext))
+            flags |= FIEMAP_EXTENT_ENCODED;
+        else if (osfs_share_find(sb_info, osfs_ext_pblk(&ext), ext.block_count, &shared, &shared_len))
+            flags |= FIEMAP_EXTENT_SHARED;
+        ret = fiemap_fill_next_extent(fieinfo, (u64)ext.logical_block * BLOCK_SIZE,
+                                      base + (u64)osfs_ext_pblk(&ext) * BLOCK_SIZE,
+                                      (u64)ext.block_count * BLOCK_SIZE, flags);
+        if (ret)
+            break;
+        if (more)
+            return 0;
+        ext = next;
+    }
+
+    // 1 means the user buffer is full, -ENOENT that nothing is mapped past @start
+    return ret == 1 || ret == -ENOENT ? 0 : ret;
+}
+
+/**
+ * Function: osfs_getattr
+ * Description: Reports the attributes of a regular file, with st_blocks
+ *              taken from the blocks its extents and tree nodes occupy, so
+ *              du shows what a sparse file really uses.
+ * Inputs:
+ *   - idmap: The idmap of the mount.
+ *   - path: The path of the file.
+ *   - stat: Filled with the attributes.
+ *   - request_mask: The STATX_* fields asked for.
+ *   - query_flags: AT_STATX_* flags.
+ * Returns:
+ *   - 0.
+ */
+static int osfs_getattr(struct mnt_idmap *idmap, const struct path *path, struct kstat *stat,
+                        u32 request_mask, unsigned int query_flags)
+{
+    struct inode *inode = d_inode(path->dentry);
+
+    generic_fillattr(idmap, request_mask, inode, stat);
+    stat->blocks = (u64)READ_ONCE(OSFS_I(inode)->raw->i_blocks) << (BLOCK_SIZE_BITS - 9);
+    return 0;
+}
+
 /**
  * Struct: osfs_file_inode_operations
  * Description: Defines the inode operations for regular files in osfs.
- * Note: Add additional operations such as getattr as needed.
  */
 const struct inode_operations osfs_file_inode_operations = {
-    // Add inode operations here, e.g., .getattr = osfs_getattr,
+    .setattr = osfs_setattr,
+    .getattr = osfs_getattr,
+    .fiemap = osfs_fiemap,
 };
@@ -1,6 +1,15 @@
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/writeback.h>
 #include "osfs.h"
+#include "osfs_trace.h"
+
+// The inode table block holding @ino on a block device mount
+static inline struct buffer_head *osfs_inode_bh(struct osfs_sb_info *sb_info, uint32_t ino)
+{
+    return osfs_disk_bh(sb_info, sb_info->disk.s_inode_table_start + ino / OSFS_INODES_PER_BLOCK,
+                        false);
+}
 
 /**
  * Function: osfs_get_osfs_inode
@@ -15,39 +24,311 @@
 struct osfs_inode *osfs_get_osfs_inode(struct super_block *sb, uint32_t ino)
 {
     struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct buffer_head *bh;
 
     if (ino == 0 || ino >= sb_info->inode_count) // File system inode count upper bound
         return NULL;
-    return &((struct osfs_inode *)(sb_info->inode_table))[ino];
+    if (!osfs_on_bdev(sb_info))
+        return &((struct osfs_inode *)(sb_info->inode_table))[ino];
+
+    // Inodes never straddle a device block
+    bh = osfs_inode_bh(sb_info, ino);
+    if (!bh)
+        return NULL;
+    return (struct osfs_inode *)bh->b_data + ino % OSFS_INODES_PER_BLOCK;
+}
+
+// Copies the VFS inode fields into the inode table entry
+static void osfs_inode_to_raw(struct inode *inode, struct osfs_inode *osfs_inode)
+{
+    osfs_inode->i_mode = inode->i_mode;
+    osfs_inode->i_uid = i_uid_read(inode);
+    osfs_inode->i_gid = i_gid_read(inode);
+    osfs_inode->i_links_count = inode->i_nlink;
+    osfs_inode->i_size = i_size_read(inode);
+    osfs_inode->__i_atime = inode->__i_atime;
+    osfs_inode->__i_mtime = inode->__i_mtime;
+    osfs_inode->__i_ctime = inode->__i_ctime;
+}
+
+/**
+ * Function: osfs_inode_dirty_bh
+ * Description: Records a change to the table entry of an inode on a block
+ *              device mount, in the running transaction if there is a
+ *              journal, which fsync of the inode then has to wait for.
+ * Returns:
+ *   - The table block, or NULL if it cannot be found.
+ */
+static struct buffer_head *osfs_inode_dirty_bh(struct inode *inode)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct buffer_head *bh;
+
+    // osfs_get_osfs_inode cached the block when the inode was loaded
+    bh = osfs_inode_bh(sb_info, inode->i_ino);
+    if (!bh)
+        return NULL;
+    osfs_journal_dirty(sb_info, bh);
+    if (sb_info->journal)
+        WRITE_ONCE(OSFS_I(inode)->i_sync_tid, osfs_journal_tid(sb_info));
+    return bh;
+}
+
+/**
+ * Function: osfs_dirty_inode
+ * Description: Called when the VFS marks an inode dirty. Inside a journal
+ *              handle the inode goes into the running transaction right away,
+ *              with the other changes of the operation; elsewhere it waits
+ *              for osfs_write_inode.
+ * Inputs:
+ *   - inode: The VFS inode marked dirty.
+ *   - flags: The I_DIRTY_* flags being set.
+ * Returns:
+ *   - None.
+ */
+void osfs_dirty_inode(struct inode *inode, int flags)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+
+    if (!sb_info->journal || current->journal_info != sb_info->journal || !osfs_inode)
+        return;
+    osfs_inode_to_raw(inode, osfs_inode);
+    osfs_inode_dirty_bh(inode);
+}
+
+/**
+ * Function: osfs_write_inode
+ * Description: Copies the VFS inode fields into the inode table entry. On a
+ *              block device the table block is marked dirty, and written out
+ *              right away for a data integrity sync; with a journal it joins
+ *              the running transaction instead and osfs_fsync commits it.
+ * Inputs:
+ *   - inode: The VFS inode to write back.
+ *   - wbc: The writeback control of this pass.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if the table block cannot be written.
+ */
+int osfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    struct osfs_handle handle;
+    struct buffer_head *bh;
+
+    if (!osfs_inode)
+        return 0;
+
+    if (!osfs_on_bdev(sb_info)) {
+        osfs_inode_to_raw(inode, osfs_inode);
+        return 0;
+    }
+
+    osfs_journal_start(sb_info, &handle);
+    osfs_inode_to_raw(inode, osfs_inode);
+    bh = osfs_inode_dirty_bh(inode);
+    osfs_journal_stop(&handle);
+    if (!bh)
+        return -EIO;
+    if (wbc->sync_mode == WB_SYNC_ALL && !sb_info->journal) {
+        sync_dirty_buffer(bh);
+        if (buffer_req(bh) && !buffer_uptodate(bh)) {
+            pr_err("osfs_write_inode: I/O error writing inode %lu\n", inode->i_ino);
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_find_inode_group
+ * Description: Picks the group a new inode should live in, in the spirit of
+ *              ext4's Orlov allocator. Directories are spread over groups
+ *              with an above-average share of free blocks, starting from this
+ *              CPU's rotor so that parallel mkdirs land in different groups.
+ *              Other inodes go to their parent's group, keeping a directory's
+ *              files and their data close together. The free counters are
+ *              read without the group locks, so the result is only a hint.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - dir: The parent directory.
+ *   - mode: Mode of the new inode.
+ * Returns:
+ *   - The preferred group number.
+ */
+static uint32_t osfs_find_inode_group(struct osfs_sb_info *sb_info, const struct inode *dir,
+                                      umode_t mode)
+{
+    uint32_t n = sb_info->group_count, parent, start, avg, i, g;
+    struct osfs_group *grp;
+
+    if (S_ISDIR(mode)) {
+        avg = percpu_counter_read_positive(&sb_info->nr_free_blocks) / n;
+        start = this_cpu_read(*sb_info->group_rotor);
+        for (i = 0; i < n; i++) {
+            g = (start + i) % n;
+            grp = &sb_info->groups[g];
+            if (READ_ONCE(grp->free_inodes) && READ_ONCE(grp->free_blocks) >= avg) {
+                this_cpu_write(*sb_info->group_rotor, g + 1);
+                return g;
+            }
+        }
+    }
+
+    // The parent's group first, then the nearest group with room for data too
+    parent = osfs_inode_group(sb_info, dir->i_ino);
+    for (i = 0; i < n; i++) {
+        grp = &sb_info->groups[(parent + i) % n];
+        if (READ_ONCE(grp->free_inodes) && READ_ONCE(grp->free_blocks))
+            return (parent + i) % n;
+    }
+    return parent;
 }
 
 /**
  * Function: osfs_get_free_inode
- * Description: Allocates a free inode number from the inode bitmap.
+ * Description: Allocates a free inode number, preferring the group chosen by
+ *              osfs_find_inode_group and moving on to the next group when it
+ *              is full.
  * Inputs:
  *   - sb_info: The superblock information of the filesystem.
+ *   - dir: The parent directory of the new inode.
+ *   - mode: Mode of the new inode.
  * Returns:
  *   - The allocated inode number on success.
  *   - -ENOSPC if no free inode is available.
  */
-int osfs_get_free_inode(struct osfs_sb_info *sb_info)
+int osfs_get_free_inode(struct osfs_sb_info *sb_info, const struct inode *dir, umode_t mode)
 {
-    uint32_t ino;
+    uint32_t n = sb_info->group_count, goal, i;
+    struct osfs_group *grp;
+    long ino;
+
+    goal = osfs_find_inode_group(sb_info, dir, mode);
+    for (i = 0; i < n; i++) {
+        grp = &sb_info->groups[(goal + i) % n];
+        if (!READ_ONCE(grp->free_inodes))
+            continue;
+
+        spin_lock(&grp->lock);
+        ino = osfs_bitmap_alloc_run(sb_info->inode_bitmap, grp->first_inode + grp->nr_inodes,
+                                    grp->first_inode, 1);
+        if (ino >= 0) {
+            grp->free_inodes--;
+            osfs_journal_bits(sb_info, true, ino, 1);
+        }
+        spin_unlock(&grp->lock);
 
-    for (ino = 1; ino < sb_info->inode_count; ino++) {
-        if (!test_bit(ino, sb_info->inode_bitmap)) {
-            set_bit(ino, sb_info->inode_bitmap);
-            sb_info->nr_free_inodes--;
+        if (ino >= 0) {
+            percpu_counter_dec(&sb_info->nr_free_inodes);
             return ino;
         }
     }
+
     pr_err("osfs_get_free_inode: No free inode available\n");
     return -ENOSPC;
 }
 
+/**
+ * Function: osfs_put_free_inode
+ * Description: Returns an inode number to its group.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ino: The inode number to release.
+ * Returns:
+ *   - None.
+ */
+void osfs_put_free_inode(struct osfs_sb_info *sb_info, uint32_t ino)
+{
+    struct osfs_group *grp = &sb_info->groups[osfs_inode_group(sb_info, ino)];
+    bool freed;
+
+    spin_lock(&grp->lock);
+    freed = test_and_clear_bit(ino, sb_info->inode_bitmap);
+    if (freed) {
+        grp->free_inodes++;
+        osfs_journal_bits(sb_info, true, ino, 1);
+    }
+    spin_unlock(&grp->lock);
+
+    if (freed)
+        percpu_counter_inc(&sb_info->nr_free_inodes);
+}
+
+/**
+ * Function: osfs_truncate_extents
+ * Description: Frees the blocks of a file past @size and forgets the extent
+ *              cached for it. Inline data has no blocks to free. A compressed
+ *              last block whose tail is cleared is inflated first.
+ * Inputs:
+ *   - inode: The VFS inode of the file.
+ *   - size: The new size in bytes.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if a compressed last block cannot be inflated.
+ *   - -EIO if the extent tree is corrupted.
+ */
+int osfs_truncate_extents(struct inode *inode, loff_t size)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode_info *oi = OSFS_I(inode);
+    long ret = 0;
+
+    down_write(osfs_ext_sem(inode));
+    if (!osfs_inode_is_inline(oi->raw) && size % BLOCK_SIZE)
+        ret = osfs_inflate_blocks(inode, size / BLOCK_SIZE, 1);
+    if (ret >= 0 && !osfs_inode_is_inline(oi->raw))
+        ret = osfs_ext_truncate(sb_info, oi->raw, DIV_ROUND_UP(size, BLOCK_SIZE));
+    osfs_ext_cache_reset(inode);
+    up_write(osfs_ext_sem(inode));
+
+    return ret;
+}
+
+/**
+ * Function: osfs_evict_inode
+ * Description: Drops an inode from memory. When its last link is gone its
+ *              extents go back to the allocator, its table entry is cleared
+ *              and its number becomes free again, in that order, so a new
+ *              inode taking the number finds a clean entry. All of it is one
+ *              journal transaction.
+ * Inputs:
+ *   - inode: The VFS inode being evicted.
+ * Returns:
+ *   - None.
+ */
+void osfs_evict_inode(struct inode *inode)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    bool release = !inode->i_nlink && osfs_inode && !is_bad_inode(inode);
+    struct osfs_handle handle;
+
+    truncate_inode_pages_final(&inode->i_data);
+    osfs_compress_forget(inode);
+
+    osfs_journal_start(sb_info, &handle);
+    if (release) {
+        if (osfs_truncate_extents(inode, 0))
+            pr_err("osfs_evict_inode: Blocks of inode %lu are lost\n", inode->i_ino);
+        osfs_inode->i_links_count = 0;
+        osfs_inode->i_size = 0;
+        if (osfs_on_bdev(sb_info))
+            osfs_inode_dirty_bh(inode);
+    }
+
+    clear_inode(inode);
+    if (release)
+        osfs_put_free_inode(sb_info, inode->i_ino);
+    osfs_journal_stop(&handle);
+}
+
 /**
  * Function: osfs_iget
- * Description: Creates or retrieves a VFS inode from a given inode number.
+ * Description: Returns the VFS inode for an inode number. An inode that is
+ *              already in memory is taken from the inode cache; only on a miss
+ *              is a new one filled from the inode table.
  * Inputs:
  *   - sb: The superblock of the filesystem.
  *   - ino: The inode number to load.
@@ -65,21 +346,22 @@ struct inode *osfs_iget(struct super_block *sb, unsigned long ino)
     if (!osfs_inode)
         return ERR_PTR(-EFAULT);
 
-    inode = new_inode(sb);
+    inode = iget_locked(sb, ino);
     if (!inode)
         return ERR_PTR(-ENOMEM);
+    if (!(inode->i_state & I_NEW))
+        return inode;
 
-    inode->i_ino = ino;
-    inode->i_sb = sb;
     inode->i_mode = osfs_inode->i_mode;
     i_uid_write(inode, osfs_inode->i_uid);
     i_gid_write(inode, osfs_inode->i_gid);
+    set_nlink(inode, osfs_inode->i_links_count);
     inode->__i_atime = osfs_inode->__i_atime;
     inode->__i_mtime = osfs_inode->__i_mtime;
     inode->__i_ctime = osfs_inode->__i_ctime;
     inode->i_size = osfs_inode->i_size;
     inode->i_blocks = osfs_inode->i_blocks;
-    inode->i_private = osfs_inode;
+    OSFS_I(inode)->raw = osfs_inode;
 
     if (S_ISDIR(inode->i_mode)) {
         inode->i_op = &osfs_dir_inode_operations;
@@ -87,96 +369,793 @@ struct inode *osfs_iget(struct super_block *sb, unsigned long ino)
     } else if (S_ISREG(inode->i_mode)) {
         inode->i_op = &osfs_file_inode_operations;
         inode->i_fop = &osfs_file_operations;
+        inode->i_mapping->a_ops = &osfs_aops;
     }
 
-    // Insert the inode into the inode hash
-    insert_inode_hash(inode);
-
+    unlock_new_inode(inode);
     return inode;
 }
 
+/**
+ * Function: osfs_claim_blocks
+ * Description: Marks a run handed out by a group's free-space index as used.
+ *              Called with the group lock held.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - grp: The group the run belongs to.
+ *   - start: First block of the run.
+ *   - count: Number of blocks in the run.
+ * Returns:
+ *   - None.
+ */
+static void osfs_claim_blocks(struct osfs_sb_info *sb_info, struct osfs_group *grp,
+                              uint32_t start, uint32_t count)
+{
+    bitmap_set(sb_info->block_bitmap, start, count);
+    osfs_journal_bits(sb_info, false, start, count);
+    grp->free_blocks -= count;
+    percpu_counter_sub(&sb_info->nr_free_blocks, count);
+    osfs_stat_add(sb_info, OSFS_STAT_ALLOC_BLOCKS, count);
+}
+
+/**
+ * Function: osfs_alloc_run
+ * Description: Takes up to @len contiguous free blocks. The goal group is
+ *              tried first, then every group starting from this CPU's rotor,
+ *              so that threads which miss their goal spread out instead of all
+ *              scanning from group 0. When no group holds a run of @len
+ *              blocks, the longest run seen is taken instead.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - goal: The preferred group.
+ *   - len: Number of blocks wanted.
+ *   - start: Pointer to store the first block of the run.
+ * Returns:
+ *   - The number of blocks taken; 0 if the data area is full.
+ */
+static uint32_t osfs_alloc_run(struct osfs_sb_info *sb_info, uint32_t goal, uint32_t len,
+                               uint32_t *start)
+{
+    uint32_t n = sb_info->group_count, rotor, best = goal, best_run = 0, run, taken, i, g;
+    struct osfs_group *grp;
+
+    osfs_stat_inc(sb_info, OSFS_STAT_ALLOC_REQUESTS);
+    rotor = this_cpu_read(*sb_info->group_rotor);
+    for (i = 0; i <= n; i++) {
+        g = i ? (rotor + i - 1) % n : goal;
+        if (i && g == goal)
+            continue;
+        grp = &sb_info->groups[g];
+        // The longest run of a group never exceeds its free count
+        if (READ_ONCE(grp->free_blocks) <= best_run)
+            continue;
+
+        osfs_stat_inc(sb_info, OSFS_STAT_ALLOC_SCANNED);
+        osfs_group_lock(grp);
+        run = osfs_free_index_max_run(grp);
+        if (run >= len && !osfs_free_index_alloc(grp, len, start)) {
+            osfs_claim_blocks(sb_info, grp, *start, len);
+            osfs_group_unlock(grp);
+            if (i)
+                this_cpu_write(*sb_info->group_rotor, g);
+            return len;
+        }
+        osfs_group_unlock(grp);
+
+        if (run > best_run) {
+            best = g;
+            best_run = run;
+        }
+    }
+
+    if (!best_run) {
+        osfs_stat_inc(sb_info, OSFS_STAT_ALLOC_FAILURES);
+        return 0;
+    }
+
+    grp = &sb_info->groups[best];
+    osfs_group_lock(grp);
+    taken = min(len, osfs_free_index_max_run(grp));
+    if (taken && !osfs_free_index_alloc(grp, taken, start))
+        osfs_claim_blocks(sb_info, grp, *start, taken);
+    else
+        taken = 0;
+    osfs_group_unlock(grp);
+
+    return taken;
+}
+
 /**
  * Function: osfs_alloc_data_block
- * Description: Allocates a free data block from the block bitmap.
+ * Description: Allocates a single free data block.
  * Inputs:
  *   - sb_info: The superblock information of the filesystem.
  *   - block_no: Pointer to store the allocated block number.
  * Returns:
  *   - 0 on successful allocation.
  *   - -ENOSPC if no free data block is available.
+ *   - -ENOMEM if the block cannot be backed.
  */
 int osfs_alloc_data_block(struct osfs_sb_info *sb_info, uint32_t *block_no)
 {
-    uint32_t i;
+    int ret;
 
-    for (i = 0; i < sb_info->block_count; i++) {
-        if (!test_bit(i, sb_info->block_bitmap)) {
-            set_bit(i, sb_info->block_bitmap);
-            sb_info->nr_free_blocks--;
-            *block_no = i;
-            return 0;
-        }
+    if (!osfs_alloc_run(sb_info, this_cpu_read(*sb_info->group_rotor) % sb_info->group_count,
+                        1, block_no)) {
+        pr_err("osfs_alloc_data_block: No free data block available\n");
+        return -ENOSPC;
     }
-    pr_err("osfs_alloc_data_block: No free data block available\n");
-    return -ENOSPC;
+
+    ret = osfs_data_blocks_prepare(sb_info, *block_no, 1);
+    if (ret)
+        osfs_free_data_block(sb_info, *block_no);
+    return ret;
 }
 
-int osfs_alloc_extent(struct osfs_sb_info *sb_info, uint32_t required_blocks, struct osfs_inode *inode) {
-    uint32_t start_block = 0;
-    uint32_t consecutive_free_blocks = 0;
-    int extent_index;
+/**
+ * Function: osfs_alloc_extent
+ * Description: Maps data blocks at logical block @lblk of an inode, as
+ *              contiguously as free space allows; the range must be a hole,
+ *              such as the end of the file. The goal is the block right after
+ *              the extent mapping @lblk - 1: blocks free at the goal grow that
+ *              extent in place. The rest comes from osfs_alloc_run, aimed at
+ *              the group of that extent, or at the inode's own group when
+ *              nothing precedes the range.
+ *              Unwritten blocks (fallocate) are only reserved: they are
+ *              neither backed nor cleared until osfs_ext_mark_written.
+ *              The caller holds the inode's extent lock exclusively.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - required_blocks: Number of blocks to allocate.
+ *   - inode: The osfs_inode receiving the blocks.
+ *   - lblk: The first logical block to map.
+ *   - unwritten: Map the blocks as OSFS_EXT_UNWRITTEN.
+ * Returns:
+ *   - 0 on successful allocation.
+ *   - -ENOSPC if the data area runs out or the extent tree cannot grow.
+ *   - -ENOMEM if memory for the blocks cannot be allocated (mem=sparse).
+ *   - -EIO if the extent tree is corrupted.
+ */
+int osfs_alloc_extent(struct osfs_sb_info *sb_info, uint32_t required_blocks, struct osfs_inode *inode,
+                      uint32_t lblk, bool unwritten) {
+    uint32_t flag = unwritten ? OSFS_EXT_UNWRITTEN : 0;
+    struct osfs_extent last, ext;
+    struct osfs_group *grp;
+    uint32_t start_block, goal, grown, goal_group;
+    int ret;
 
-    // 遍歷所有資料塊
-    for (uint32_t i = 0; i < sb_info->block_count; i++) {
-        if (!test_bit(i, sb_info->block_bitmap)) {
-            // 如果是第一個連續空閒塊，記錄起始位置
-            if (consecutive_free_blocks == 0) {
-                start_block = i;
-            }
-            consecutive_free_blocks++;
-
-            // 找到足夠的連續塊
-            if (consecutive_free_blocks == required_blocks) {
-                // 查找空閒的 extent 項
-                for (extent_index = 0; extent_index < 4; extent_index++) {
-                    if (inode->extents[extent_index].block_count == 0) {
-                        inode->extents[extent_index].start_block = start_block;
-                        inode->extents[extent_index].block_count = required_blocks;
-                        inode->extent_count++;
-                        break;
-                    }
-                }
+    goal_group = min(osfs_inode_group(sb_info, inode->i_ino), sb_info->group_count - 1);
 
-                if (extent_index == 4) {
-                    pr_err("osfs_alloc_extent: No free extents available\n");
-                    return -ENOSPC;
+    // 先嘗試從前一個 extent 的尾端原地延伸
+    ret = lblk ? osfs_ext_lookup(sb_info, inode, lblk - 1, &last) : -ENOENT;
+    if (ret == -EIO)
+        return ret;
+    if (ret == 0) {
+        goal = osfs_ext_pblk(&last) + last.block_count;
+        goal_group = (goal - 1) / OSFS_BLOCKS_PER_GROUP;
+        if (goal < sb_info->block_count) {
+            grp = osfs_block_group(sb_info, goal);
+            osfs_group_lock(grp);
+            grown = osfs_free_index_alloc_at(grp, goal, required_blocks);
+            if (grown)
+                osfs_claim_blocks(sb_info, grp, goal, grown);
+            osfs_group_unlock(grp);
+            if (grown) {
+                ext.logical_block = lblk;
+                ext.start_block = goal | flag;
+                ext.block_count = grown;
+                ret = unwritten ? 0 : osfs_data_blocks_prepare(sb_info, goal, grown);
+                if (!ret)
+                    ret = osfs_ext_insert(sb_info, inode, &ext);
+                if (ret) {
+                    osfs_free_blocks(sb_info, goal, grown);
+                    return ret;
                 }
+                trace_osfs_alloc_extent(sb_info, inode->i_ino, lblk, goal, grown);
+                inode->i_blocks += grown;
+                lblk += grown;
+                required_blocks -= grown;
+            }
+        }
+    }
 
-                // 標記這些塊為已使用
-                for (uint32_t j = start_block; j < start_block + required_blocks; j++) {
-                    set_bit(j, sb_info->block_bitmap);
-                }
+    // 其餘的塊從 goal group 開始尋找連續空間
+    while (required_blocks > 0) {
+        grown = osfs_alloc_run(sb_info, goal_group, required_blocks, &start_block);
+        if (!grown) {
+            pr_err_ratelimited("osfs_alloc_extent: No free block range available\n");
+            return -ENOSPC;
+        }
 
-                // 更新剩餘可用塊數
-                sb_info->nr_free_blocks -= required_blocks;
+        ext.logical_block = lblk;
+        ext.start_block = start_block | flag;
+        ext.block_count = grown;
+        ret = unwritten ? 0 : osfs_data_blocks_prepare(sb_info, start_block, grown);
+        if (!ret)
+            ret = osfs_ext_insert(sb_info, inode, &ext);
+        if (ret) {
+            pr_err("osfs_alloc_extent: Failed to insert extent into inode %u\n", inode->i_ino);
+            osfs_free_blocks(sb_info, start_block, grown);
+            return ret;
+        }
+        trace_osfs_alloc_extent(sb_info, inode->i_ino, lblk, start_block, grown);
+        inode->i_blocks += grown;
+        lblk += grown;
+        required_blocks -= grown;
+        goal_group = (start_block + grown - 1) / OSFS_BLOCKS_PER_GROUP;
+    }
 
-                return 0;
-            }
-        } else {
-            // 遇到已使用的塊，重置連續計數
-            consecutive_free_blocks = 0;
+    return 0;
+}
+
+
+
+/**
+ * Function: osfs_alloc_file_blocks
+ * Description: Fills the holes of [@lblk, @lblk + @count) in a file, one
+ *              allocator request per hole after a cheap check that enough
+ *              blocks are free at all. Blocks already mapped stay as they are,
+ *              and the rest of the file may stay sparse.
+ *              The caller holds the inode's extent lock exclusively.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inode: The osfs_inode receiving the blocks.
+ *   - lblk: The first logical block of the range.
+ *   - count: Number of blocks in the range.
+ *   - unwritten: Map the new blocks as OSFS_EXT_UNWRITTEN.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if the data area runs out; holes filled before that stay filled.
+ *   - -ENOMEM or -EIO on failure.
+ */
+int osfs_alloc_file_blocks(struct osfs_sb_info *sb_info, struct osfs_inode *inode, uint32_t lblk,
+                           uint32_t count, bool unwritten)
+{
+    uint32_t end = lblk + count, len;
+    struct osfs_extent ext;
+    int ret;
+
+    while (lblk < end) {
+        ret = osfs_ext_lookup(sb_info, inode, lblk, &ext);
+        if (!ret) {
+            lblk = ext.logical_block + ext.block_count;
+            continue;
         }
+        if (ret != -ENOENT)
+            return ret;
+
+        // ext.logical_block is where the hole ends
+        len = min(end, ext.logical_block) - lblk;
+        if (len > percpu_counter_read_positive(&sb_info->nr_free_blocks))
+            return -ENOSPC;
+        ret = osfs_alloc_extent(sb_info, len, inode, lblk, unwritten);
+        if (ret)
+            return ret;
+        lblk += len;
     }
+    return 0;
+}
 
-    // 找不到足夠的連續塊
-    pr_err("osfs_alloc_extent: No contiguous block range available\n");
-    return -ENOSPC;
+
+
+/**
+ * Function: osfs_copy_extent
+ * Description: Copies the data of one extent to @dst, a block at a time, for
+ *              defragmentation and copy-on-write. An unwritten extent has no
+ *              data to copy; a compressed one is copied as it is stored.
+ * Returns:
+ *   - 0 on success, -EIO if a block cannot be read.
+ */
+static int osfs_copy_extent(struct osfs_sb_info *sb_info, const struct osfs_extent *ext,
+                            uint32_t dst)
+{
+    uint32_t blocks, i;
+    void *from, *to;
+
+    if (osfs_ext_is_unwritten(ext))
+        return 0;
+
+    blocks = osfs_ext_blocks(sb_info, ext);
+    for (i = 0; i < blocks; i++) {
+        from = osfs_data_block(sb_info, osfs_ext_pblk(ext) + i);
+        to = osfs_data_block(sb_info, dst + i);
+        if (!from || !to)
+            return -EIO;
+        memcpy(to, from, BLOCK_SIZE);
+        osfs_data_block_dirty(sb_info, dst + i);
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_defrag_file
+ * Description: Moves the data blocks of a file into a single run found by
+ *              the allocator. The data is copied first and a new extent tree
+ *              is built in a scratch inode; only then is the inode's extent
+ *              root replaced and the old blocks freed, so readers under the
+ *              extent lock see either the old or the new layout and a failure
+ *              leaves the file as it was. Holes stay holes: extents only
+ *              separated by one stay separate, but sit next to each other.
+ *              Compressed extents move without being decompressed.
+ *              The caller holds i_rwsem and the invalidate lock, and has
+ *              written back the page cache.
+ * Inputs:
+ *   - inode: The VFS inode of the regular file.
+ *   - info: Filled with the extent counts before and after.
+ * Returns:
+ *   - 0 on success, including when there was nothing to do.
+ *   - -ENOSPC if no free run is long enough.
+ *   - -ENOMEM or -EIO on failure.
+ */
+int osfs_defrag_file(struct inode *inode, struct osfs_defrag_info *info)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    uint8_t old_root[OSFS_EXT_ROOT_SIZE];
+    struct osfs_inode *scratch;
+    struct osfs_extent ext, moved;
+    uint32_t lblk, total = 0, start, done = 0, goal, taken;
+    int ret;
+
+    memset(info, 0, sizeof(*info));
+    scratch = kmalloc(sizeof(*scratch), GFP_NOFS);
+    if (!scratch)
+        return -ENOMEM;
+
+    down_write(osfs_ext_sem(inode));
+    if (osfs_inode_is_inline(osfs_inode)) {
+        ret = 0;
+        goto out;
+    }
+
+    for (lblk = 0; !(ret = osfs_ext_next(sb_info, osfs_inode, lblk, &ext));
+         lblk = ext.logical_block + ext.block_count) {
+        info->extents_before++;
+        total += osfs_ext_blocks(sb_info, &ext);
+    }
+    info->extents_after = info->extents_before;
+    if (ret != -ENOENT)
+        goto out;
+    ret = 0;
+    if (info->extents_before < 2)
+        goto out;
+
+    // One run for all of the data, near where the file starts
+    goal = min(osfs_inode_group(sb_info, osfs_inode->i_ino), sb_info->group_count - 1);
+    if (total > percpu_counter_read_positive(&sb_info->nr_free_blocks)) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    taken = osfs_alloc_run(sb_info, goal, total, &start);
+    if (taken != total) {
+        // Only a shorter run is free, which would not reduce anything
+        if (taken)
+            osfs_free_blocks(sb_info, start, taken);
+        ret = -ENOSPC;
+        goto out;
+    }
+    ret = osfs_data_blocks_prepare(sb_info, start, total);
+    if (ret)
+        goto out_free;
+
+    memcpy(scratch, osfs_inode, sizeof(*scratch));
+    osfs_ext_init(scratch);
+    scratch->i_blocks = 0;
+
+    for (lblk = 0; !osfs_ext_next(sb_info, osfs_inode, lblk, &ext);
+         lblk = ext.logical_block + ext.block_count) {
+        ret = osfs_copy_extent(sb_info, &ext, start + done);
+        if (ret)
+            goto out_scratch;
+
+        moved.logical_block = ext.logical_block;
+        moved.start_block = (start + done) | (ext.start_block & OSFS_EXT_FLAGS);
+        moved.block_count = ext.block_count;
+        ret = osfs_ext_insert(sb_info, scratch, &moved);
+        if (ret)
+            goto out_scratch;
+        scratch->i_blocks += osfs_ext_blocks(sb_info, &moved);
+        done += osfs_ext_blocks(sb_info, &moved);
+    }
+
+    // Switch to the new tree, then drop the old one with its blocks
+    memcpy(old_root, osfs_inode->i_extent_root, sizeof(old_root));
+    memcpy(osfs_inode->i_extent_root, scratch->i_extent_root, sizeof(old_root));
+    memcpy(scratch->i_extent_root, old_root, sizeof(old_root));
+    swap(scratch->i_blocks, osfs_inode->i_blocks);
+    ret = osfs_ext_truncate(sb_info, scratch, 0);
+    if (ret)
+        pr_err("osfs_defrag_file: Old blocks of inode %lu are lost\n", inode->i_ino);
+    osfs_ext_cache_reset(inode);
+
+    info->blocks = total;
+    for (info->extents_after = 0, lblk = 0; !osfs_ext_next(sb_info, osfs_inode, lblk, &ext);
+         lblk = ext.logical_block + ext.block_count)
+        info->extents_after++;
+    ret = 0;
+    goto out;
+
+out_scratch:
+    // The tree built so far owns the blocks copied into; the rest of the run is freed directly
+    osfs_ext_truncate(sb_info, scratch, 0);
+    start += done;
+    total -= done;
+out_free:
+    osfs_free_blocks(sb_info, start, total);
+out:
+    up_write(osfs_ext_sem(inode));
+    kfree(scratch);
+    return ret;
+}
+
+/**
+ * Function: osfs_inflate_blocks
+ * Description: Stores the compressed extents under [@lblk, @lblk + @count)
+ *              back as ordinary blocks before they are modified: each one is
+ *              decompressed into a run from osfs_alloc_run as long as its
+ *              data, near its compressed blocks, remapped with
+ *              osfs_ext_remap, and its compressed blocks are freed. Does
+ *              nothing on a mount without compression.
+ *              The caller holds the inode's extent lock exclusively and,
+ *              when blocks were inflated, resets the extent cached by
+ *              osfs_map_file_offset.
+ * Inputs:
+ *   - inode: The VFS inode of the regular file.
+ *   - lblk: The first logical block of the range.
+ *   - count: Number of blocks in the range.
+ * Returns:
+ *   - The number of blocks inflated, 0 if none was compressed.
+ *   - -ENOSPC if no free run is long enough; extents inflated before stay so.
+ *   - -ENOMEM or -EIO on failure.
+ */
+long osfs_inflate_blocks(struct inode *inode, uint32_t lblk, uint32_t count)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    uint32_t end = lblk + count, start, taken, i;
+    struct osfs_extent ext;
+    long inflated = 0;
+    void *to;
+    int ret;
+
+    if (!sb_info->compress)
+        return 0;
+
+    while (lblk < end) {
+        ret = osfs_ext_lookup(sb_info, osfs_inode, lblk, &ext);
+        if (ret == -ENOENT) {
+            lblk = ext.logical_block;
+            continue;
+        }
+        if (ret)
+            return ret;
+        lblk = ext.logical_block + ext.block_count;
+        if (!osfs_ext_is_compressed(&ext))
+            continue;
+
+        taken = osfs_alloc_run(sb_info, osfs_ext_pblk(&ext) / OSFS_BLOCKS_PER_GROUP,
+                               ext.block_count, &start);
+        if (taken != ext.block_count) {
+            if (taken)
+                osfs_free_blocks(sb_info, start, taken);
+            pr_err("osfs_inflate_blocks: No free block range available\n");
+            return -ENOSPC;
+        }
+
+        ret = osfs_data_blocks_prepare(sb_info, start, taken);
+        for (i = 0; !ret && i < taken; i++) {
+            to = osfs_data_block(sb_info, start + i);
+            ret = to ? osfs_compress_read(inode, (loff_t)(ext.logical_block + i) * BLOCK_SIZE,
+                                          to, BLOCK_SIZE) : -EIO;
+            if (!ret)
+                osfs_data_block_dirty(sb_info, start + i);
+        }
+        if (!ret)
+            ret = osfs_ext_remap(sb_info, osfs_inode, ext.logical_block, ext.block_count, start);
+        if (ret) {
+            osfs_free_blocks(sb_info, start, taken);
+            return ret;
+        }
+        trace_osfs_alloc_extent(sb_info, osfs_inode->i_ino, ext.logical_block, start, taken);
+        osfs_inode->i_blocks += taken - osfs_compress_free(sb_info, &ext);
+        osfs_stat_inc(sb_info, OSFS_STAT_INFLATE_CHUNKS);
+        inflated += taken;
+    }
+    return inflated;
+}
+
+/**
+ * Function: osfs_inflate_cut
+ * Description: Inflates the compressed extent that a range starting or
+ *              ending at @lblk would cut in two, if there is one. The caller
+ *              holds the inode's extent lock exclusively.
+ * Returns:
+ *   - As osfs_inflate_blocks.
+ */
+static long osfs_inflate_cut(struct inode *inode, uint32_t lblk)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_extent ext;
+
+    if (!sb_info->compress || osfs_ext_lookup(sb_info, OSFS_I(inode)->raw, lblk, &ext) ||
+        !osfs_ext_is_compressed(&ext) || ext.logical_block == lblk)
+        return 0;
+    return osfs_inflate_blocks(inode, lblk, 1);
 }
 
+/**
+ * Function: osfs_clone_range
+ * Description: Maps [@lblk_in, @lblk_in + @count) of @src into @dst at
+ *              @lblk_out, sharing the blocks (FICLONE, copy_file_range):
+ *              what @dst mapped there is punched first, then every source
+ *              extent in the range is inserted into @dst as it is, unwritten
+ *              ones included, and its blocks gain an owner. The cost is
+ *              O(extents), however much data they hold. Compressed blocks
+ *              are not shared: the source range is inflated first, and so
+ *              are the compressed extents of @dst cut by the range. Neither
+ *              file keeps its data inline. The caller holds both i_rwsem
+ *              and invalidate locks, has written back both page caches and
+ *              made sure the ranges do not overlap when @src is @dst.
+ * Inputs:
+ *   - src: The VFS inode to clone from.
+ *   - lblk_in: The first logical block of @src to clone.
+ *   - dst: The VFS inode to clone into.
+ *   - lblk_out: Where the range starts in @dst.
+ *   - count: Number of blocks to clone.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if the extent tree of @dst cannot grow; part of the range may
+ *     be cloned already.
+ *   - -ENOMEM or -EIO on failure.
+ */
+int osfs_clone_range(struct inode *src, uint32_t lblk_in, struct inode *dst, uint32_t lblk_out,
+                     uint32_t count)
+{
+    struct osfs_sb_info *sb_info = dst->i_sb->s_fs_info;
+    struct osfs_inode *from = OSFS_I(src)->raw, *to = OSFS_I(dst)->raw;
+    uint32_t end = lblk_in + count, lblk, off;
+    struct osfs_extent ext, piece;
+    long ret;
+
+    if (sb_info->compress) {
+        down_write(osfs_ext_sem(src));
+        ret = osfs_inflate_blocks(src, lblk_in, count);
+        osfs_ext_cache_reset(src);
+        up_write(osfs_ext_sem(src));
+        if (ret < 0)
+            return ret;
+        if (ret)
+            mark_inode_dirty(src);
+    }
+
+    // Two extent locks are taken in inode number order; the source is only read
+    if (src == dst) {
+        down_write(osfs_ext_sem(dst));
+    } else if (src->i_ino < dst->i_ino) {
+        down_read(osfs_ext_sem(src));
+        down_write_nested(osfs_ext_sem(dst), SINGLE_DEPTH_NESTING);
+    } else {
+        down_write(osfs_ext_sem(dst));
+        down_read_nested(osfs_ext_sem(src), SINGLE_DEPTH_NESTING);
+    }
+
+    ret = osfs_inflate_cut(dst, lblk_out);
+    if (ret >= 0)
+        ret = osfs_inflate_cut(dst, lblk_out + count);
+    if (ret >= 0)
+        ret = osfs_ext_punch(sb_info, to, lblk_out, count);
+    for (lblk = lblk_in; !ret && lblk < end; lblk = ext.logical_block + ext.block_count) {
+        ret = osfs_ext_next(sb_info, from, lblk, &ext);
+        if (ret || ext.logical_block >= end)
+            break;
+
+        // Only the first extent can start before the range, only the last end after it
+        off = lblk > ext.logical_block ? lblk - ext.logical_block : 0;
+        piece.logical_block = ext.logical_block + off - lblk_in + lblk_out;
+        piece.start_block = ext.start_block + off;
+        piece.block_count = min(end, ext.logical_block + ext.block_count) -
+                            (ext.logical_block + off);
+
+        osfs_share_get(sb_info, osfs_ext_pblk(&piece), piece.block_count);
+        ret = osfs_ext_insert(sb_info, to, &piece);
+        if (ret) {
+            osfs_share_put(sb_info, osfs_ext_pblk(&piece), piece.block_count);
+            break;
+        }
+        to->i_blocks += piece.block_count;
+    }
+    if (ret == -ENOENT)
+        ret = 0;
+    osfs_ext_cache_reset(dst);
+
+    if (src != dst)
+        up_read(osfs_ext_sem(src));
+    up_write(osfs_ext_sem(dst));
+    return ret;
+}
+
+/**
+ * Function: osfs_unshare_blocks
+ * Description: Breaks the sharing of [@lblk, @lblk + @count) before data is
+ *              stored there: every run of shared blocks in the range is
+ *              copied into blocks from osfs_alloc_run, remapped with
+ *              osfs_ext_remap and put, so the other owners keep the old
+ *              data. Shared unwritten blocks get fresh unwritten ones, as
+ *              there is nothing to copy. Blocks of a folio outside the range
+ *              may stay shared; writeback stores the bytes they already hold.
+ *              The caller holds the inode's extent lock exclusively and,
+ *              when blocks were copied, resets the extent cached by
+ *              osfs_map_file_offset.
+ * Inputs:
+ *   - inode: The VFS inode of the regular file.
+ *   - lblk: The first logical block to unshare.
+ *   - count: Number of blocks to unshare.
+ * Returns:
+ *   - The number of blocks copied, 0 if none was shared.
+ *   - -ENOSPC if the data area runs out; blocks copied before stay copied.
+ *   - -ENOMEM or -EIO on failure.
+ */
+long osfs_unshare_blocks(struct inode *inode, uint32_t lblk, uint32_t count)
+{
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = OSFS_I(inode)->raw;
+    uint32_t end = lblk + count, pblk, len, shared, shared_len, start, taken, flag;
+    struct osfs_extent ext, piece;
+    long copied = 0;
+    int ret;
 
+    while (lblk < end) {
+        ret = osfs_ext_lookup(sb_info, osfs_inode, lblk, &ext);
+        if (ret == -ENOENT) {
+            lblk = ext.logical_block;
+            continue;
+        }
+        if (ret)
+            return ret;
+
+        pblk = osfs_ext_pblk(&ext) + (lblk - ext.logical_block);
+        len = min(end, ext.logical_block + ext.block_count) - lblk;
+        if (!osfs_share_find(sb_info, pblk, len, &shared, &shared_len)) {
+            lblk += len;
+            continue;
+        }
+        lblk += shared - pblk;
 
+        // The copy goes near the blocks it replaces
+        taken = osfs_alloc_run(sb_info, shared / OSFS_BLOCKS_PER_GROUP, shared_len, &start);
+        if (!taken) {
+            pr_err("osfs_unshare_blocks: No free block range available\n");
+            return -ENOSPC;
+        }
+
+        flag = ext.start_block & OSFS_EXT_UNWRITTEN;
+        piece.logical_block = lblk;
+        piece.start_block = shared | flag;
+        piece.block_count = taken;
+        ret = flag ? 0 : osfs_data_blocks_prepare(sb_info, start, taken);
+        if (!ret)
+            ret = osfs_copy_extent(sb_info, &piece, start);
+        if (!ret)
+            ret = osfs_ext_remap(sb_info, osfs_inode, lblk, taken, start | flag);
+        if (ret) {
+            osfs_free_blocks(sb_info, start, taken);
+            return ret;
+        }
+        trace_osfs_alloc_extent(sb_info, osfs_inode->i_ino, lblk, start, taken);
+        osfs_share_put(sb_info, shared, taken);
+
+        copied += taken;
+        lblk += taken;
+    }
+    return copied;
+}
+
+/**
+ * Function: osfs_free_data_block
+ * Description: Releases a data block and returns it to the free-space index,
+ *              or with a journal hands it over to osfs_journal_defer_free.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block_no: The block number to release.
+ * Returns:
+ *   - None.
+ */
 void osfs_free_data_block(struct osfs_sb_info *sb_info, uint32_t block_no)
 {
-    clear_bit(block_no, sb_info->block_bitmap);
-    sb_info->nr_free_blocks++;
-}
\ No newline at end of file
+    struct osfs_group *grp = osfs_block_group(sb_info, block_no);
+    bool freed, deferred = false;
+
+    osfs_group_lock(grp);
+    freed = test_and_clear_bit(block_no, sb_info->block_bitmap);
+    if (freed) {
+        osfs_journal_bits(sb_info, false, block_no, 1);
+        osfs_data_blocks_release(sb_info, block_no, 1);
+        deferred = sb_info->journal != NULL;
+        if (!deferred) {
+            osfs_free_index_insert(grp, block_no, 1);
+            grp->free_blocks++;
+        }
+    }
+    osfs_group_unlock(grp);
+
+    if (!freed)
+        return;
+    osfs_stat_inc(sb_info, OSFS_STAT_FREED_BLOCKS);
+    if (deferred)
+        osfs_journal_defer_free(sb_info, block_no, 1);
+    else
+        percpu_counter_inc(&sb_info->nr_free_blocks);
+}
+
+/**
+ * Function: osfs_free_blocks
+ * Description: Releases a run of data blocks and merges it back into the
+ *              free-space indexes, one bitmap_clear per group it spans. With
+ *              a journal the run stays out of the indexes until the
+ *              transaction freeing it is committed (osfs_reuse_blocks).
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block of the run.
+ *   - count: Number of blocks in the run.
+ * Returns:
+ *   - None.
+ */
+void osfs_free_blocks(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count)
+{
+    bool deferred = osfs_journal_defer_free(sb_info, start, count);
+    struct osfs_group *grp;
+    uint32_t chunk;
+
+    trace_osfs_free_extent(sb_info, start, count);
+    osfs_stat_add(sb_info, OSFS_STAT_FREED_BLOCKS, count);
+    while (count) {
+        grp = osfs_block_group(sb_info, start);
+        chunk = min(count, grp->first_block + grp->nr_blocks - start);
+
+        osfs_group_lock(grp);
+        bitmap_clear(sb_info->block_bitmap, start, chunk);
+        osfs_journal_bits(sb_info, false, start, chunk);
+        osfs_data_blocks_release(sb_info, start, chunk);
+        if (!deferred) {
+            osfs_free_index_insert(grp, start, chunk);
+            grp->free_blocks += chunk;
+        }
+        osfs_group_unlock(grp);
+
+        if (!deferred)
+            percpu_counter_add(&sb_info->nr_free_blocks, chunk);
+        start += chunk;
+        count -= chunk;
+    }
+}
+
+/**
+ * Function: osfs_reuse_blocks
+ * Description: Puts a run of blocks freed by a committed journal transaction
+ *              back into the free-space indexes and the free counters.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block of the run.
+ *   - count: Number of blocks in the run.
+ * Returns:
+ *   - None.
+ */
+void osfs_reuse_blocks(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count)
+{
+    struct osfs_group *grp;
+    uint32_t chunk;
+
+    while (count) {
+        grp = osfs_block_group(sb_info, start);
+        chunk = min(count, grp->first_block + grp->nr_blocks - start);
+
+        osfs_group_lock(grp);
+        osfs_free_index_insert(grp, start, chunk);
+        grp->free_blocks += chunk;
+        osfs_group_unlock(grp);
+
+        percpu_counter_add(&sb_info->nr_free_blocks, chunk);
+        start += chunk;
+        count -= chunk;
+    }
+}
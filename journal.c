@@ -0,0 +1,912 @@
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/crc32.h>
+#include <linux/sched/mm.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include "osfs.h"
+#include "osfs_trace.h"
+
+/**
+ * Metadata journal
+ *
+ * A block device filesystem formatted with journal=N keeps N device blocks
+ * between the inode table and the data area for a write-ahead log of its
+ * metadata: the bitmaps, the inode table, extent tree nodes and directory
+ * blocks. Every operation that changes metadata runs inside a handle
+ * (osfs_journal_start / osfs_journal_stop), and the journaled blocks it
+ * changes join the running transaction instead of being marked dirty, so
+ * the block device's writeback never writes them home on its own.
+ *
+ * Many operations share one transaction. It is committed when fsync or sync
+ * asks for it, when it grows past half of the log, or commit= seconds after
+ * it started; concurrent fsyncs wait for one commit instead of each issuing
+ * their own (group commit). A commit closes the transaction while no handle
+ * is open, copies its blocks and lets the next transaction start, then, with
+ * handles running again:
+ *
+ *   0. writes out the data blocks dirty in the block device's cache, so that
+ *      no committed metadata points at data that is not on the device yet;
+ *   1. writes descriptor blocks listing the home of each copy, followed by
+ *      the copies, from block 1 of the log;
+ *   2. writes a commit block with a crc32 of all of them, after a flush;
+ *   3. writes the copies home (checkpoint);
+ *   4. advances the journal superblock (block 0) past the transaction,
+ *      after a flush.
+ *
+ * Only one transaction is ever in the log, so the next one may overwrite it
+ * once step 4 is done. Mounting replays a transaction whose commit block is
+ * valid and whose id the journal superblock still expects, that is one that
+ * did not reach step 4.
+ *
+ * Blocks freed by a transaction are cleared in the bitmap right away but only
+ * go back to the free-space index after step 4: until then a crash can bring
+ * back metadata that still points at them, so they must not take new data.
+ *
+ * File data is not journaled. It reaches the device through the block
+ * device's writeback as before, or ahead of a commit by step 0, as with
+ * ext4's data=ordered: blocks a copy-on-write or a defrag filled, and new
+ * blocks cleared when allocated, are written before the extents mapping them.
+ * Data still in a file's page cache is not; fsync writes it first.
+ */
+
+#define OSFS_JOURNAL_MAGIC 0x051A10C0
+
+enum osfs_journal_type {
+    OSFS_JOURNAL_SUPER = 1,
+    OSFS_JOURNAL_DESCRIPTOR,
+    OSFS_JOURNAL_COMMIT,
+};
+
+struct osfs_journal_header {
+    uint32_t h_magic;                   // OSFS_JOURNAL_MAGIC
+    uint32_t h_type;                    // OSFS_JOURNAL_*
+    uint64_t h_tid;                     // Transaction; for the superblock, the one expected at block 1
+};
+
+#define OSFS_JOURNAL_TAGS ((BLOCK_SIZE - sizeof(struct osfs_journal_header) - sizeof(uint32_t)) / \
+                           sizeof(uint32_t))
+
+struct osfs_journal_descriptor {
+    struct osfs_journal_header d_header;
+    uint32_t d_count;                   // Copies following this block
+    uint32_t d_blocks[OSFS_JOURNAL_TAGS]; // Device block each copy belongs to
+};
+
+struct osfs_journal_commit {
+    struct osfs_journal_header c_header;
+    uint32_t c_blocks;                  // Copies in the transaction
+    uint32_t c_crc;                     // crc32 of its descriptors and copies, in log order
+};
+
+/**
+ * Struct: osfs_journal
+ * Description: The journal of a mount, with its running transaction.
+ */
+struct osfs_journal {
+    struct osfs_sb_info *sb_info;
+    sector_t start;                     // Device block of the journal superblock
+    uint32_t blocks;                    // Blocks in the log, the superblock included
+    uint32_t max_copies;                // Most blocks a transaction can log
+    unsigned long interval;             // Commit interval in jiffies
+
+    // The running transaction; see osfs_journal_start for the barrier
+    struct rw_semaphore barrier;
+    struct xarray dirty;                // Device block -> buffer head, with a reference
+    unsigned long *bitmap_dirty;        // Bitmap blocks changed, from s_inode_bitmap_start
+    uint32_t bitmap_blocks;
+    uint32_t block_bitmap_first;        // Bit of the first block bitmap block
+    atomic_t nr_dirty;                  // Blocks in the transaction
+    spinlock_t free_lock;
+    struct list_head frees;             // osfs_journal_free runs the transaction freed
+    atomic_t pending_frees;             // Blocks freed and not reusable yet, all transactions
+    u64 tid;                            // Id of the running transaction
+
+    struct mutex commit_mutex;          // One commit at a time
+    u64 committed;                      // Last transaction on disk
+    int error;                          // First commit error; the journal stops writing
+    struct delayed_work commit_work;
+};
+
+struct osfs_journal_free {
+    struct list_head list;
+    uint32_t start;
+    uint32_t count;
+};
+
+// A block to write: a copy of a journaled block or a log block
+struct osfs_journal_copy {
+    struct list_head list;
+    sector_t nr;
+    void *data;                         // BLOCK_SIZE bytes, from kmalloc so one page holds them
+};
+
+// Writes in flight; pending starts at 1 so that the count only drops to 0 in osfs_journal_wait
+struct osfs_journal_io {
+    atomic_t pending;
+    int error;
+    struct completion done;
+};
+
+static void osfs_journal_io_init(struct osfs_journal_io *io)
+{
+    atomic_set(&io->pending, 1);
+    io->error = 0;
+    init_completion(&io->done);
+}
+
+static void osfs_journal_end_io(struct bio *bio)
+{
+    struct osfs_journal_io *io = bio->bi_private;
+
+    if (bio->bi_status)
+        WRITE_ONCE(io->error, blk_status_to_errno(bio->bi_status));
+    bio_put(bio);
+    if (atomic_dec_and_test(&io->pending))
+        complete(&io->done);
+}
+
+static void osfs_journal_submit(struct osfs_journal *j, struct osfs_journal_io *io, sector_t nr,
+                                void *data, blk_opf_t flags)
+{
+    struct bio *bio;
+
+    bio = bio_alloc(j->sb_info->sb->s_bdev, 1, REQ_OP_WRITE | REQ_SYNC | flags, GFP_NOFS);
+    bio->bi_iter.bi_sector = nr << (BLOCK_SIZE_BITS - SECTOR_SHIFT);
+    __bio_add_page(bio, virt_to_page(data), BLOCK_SIZE, offset_in_page(data));
+    bio->bi_private = io;
+    bio->bi_end_io = osfs_journal_end_io;
+    atomic_inc(&io->pending);
+    submit_bio(bio);
+}
+
+static int osfs_journal_wait(struct osfs_journal_io *io)
+{
+    if (!atomic_dec_and_test(&io->pending))
+        wait_for_completion_io(&io->done);
+    return READ_ONCE(io->error);
+}
+
+// Writes every block of @list, the block layer merging neighbours, and waits for them
+static int osfs_journal_write_list(struct osfs_journal *j, struct list_head *list)
+{
+    struct osfs_journal_copy *copy;
+    struct osfs_journal_io io;
+    struct blk_plug plug;
+
+    osfs_journal_io_init(&io);
+    blk_start_plug(&plug);
+    list_for_each_entry(copy, list, list)
+        osfs_journal_submit(j, &io, copy->nr, copy->data, 0);
+    blk_finish_plug(&plug);
+    return osfs_journal_wait(&io);
+}
+
+static int osfs_journal_write_one(struct osfs_journal *j, sector_t nr, void *data, blk_opf_t flags)
+{
+    struct osfs_journal_io io;
+
+    osfs_journal_io_init(&io);
+    osfs_journal_submit(j, &io, nr, data, flags);
+    return osfs_journal_wait(&io);
+}
+
+// Appends a zeroed block for device block @nr to @list
+static struct osfs_journal_copy *osfs_journal_copy_new(struct list_head *list, sector_t nr)
+{
+    struct osfs_journal_copy *copy;
+
+    copy = kmalloc(sizeof(*copy), GFP_NOFS | __GFP_NOFAIL);
+    copy->data = kzalloc(BLOCK_SIZE, GFP_NOFS | __GFP_NOFAIL);
+    copy->nr = nr;
+    list_add_tail(&copy->list, list);
+    return copy;
+}
+
+static void osfs_journal_copies_free(struct list_head *list)
+{
+    struct osfs_journal_copy *copy, *tmp;
+
+    list_for_each_entry_safe(copy, tmp, list, list) {
+        kfree(copy->data);
+        kfree(copy);
+    }
+    INIT_LIST_HEAD(list);
+}
+
+static void osfs_journal_header_init(void *block, enum osfs_journal_type type, u64 tid)
+{
+    struct osfs_journal_header *hdr = block;
+
+    hdr->h_magic = OSFS_JOURNAL_MAGIC;
+    hdr->h_type = type;
+    hdr->h_tid = tid;
+}
+
+/**
+ * Function: osfs_journal_format
+ * Description: Fills the journal superblock of a new filesystem, in a zeroed
+ *              block, so that its first transaction is number 1.
+ */
+void osfs_journal_format(void *block)
+{
+    osfs_journal_header_init(block, OSFS_JOURNAL_SUPER, 1);
+}
+
+/**
+ * Function: osfs_journal_start
+ * Description: Opens a handle: the metadata changes made until
+ *              osfs_journal_stop belong to the running transaction as a whole.
+ *              Handles hold the journal's barrier shared and a commit takes it
+ *              exclusively to close the transaction, so it never sees half an
+ *              operation. A handle opened inside another one of the same task
+ *              just joins it. Allocations inside the handle do not recurse
+ *              into filesystem reclaim, which could need a handle itself.
+ *              A task holding a handle must not wait for i_rwsem, the
+ *              invalidate lock or a folio lock: another task may hold those
+ *              while it waits to open its handle behind a commit. Extent
+ *              locks nest inside the handle instead, so a handle must never
+ *              be opened while one is held. Without a journal this does
+ *              nothing.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - handle: The handle, on the caller's stack.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_start(struct osfs_sb_info *sb_info, struct osfs_handle *handle)
+{
+    struct osfs_journal *j = sb_info->journal;
+
+    handle->journal = NULL;
+    if (!j || current->journal_info == j)
+        return;
+
+    down_read(&j->barrier);
+    handle->journal = j;
+    handle->saved = current->journal_info;
+    current->journal_info = j;
+    handle->nofs = memalloc_nofs_save();
+}
+
+/**
+ * Function: osfs_journal_stop
+ * Description: Closes a handle opened by osfs_journal_start, and asks for a
+ *              commit right away once the transaction fills half of the log.
+ */
+void osfs_journal_stop(struct osfs_handle *handle)
+{
+    struct osfs_journal *j = handle->journal;
+
+    if (!j)
+        return;
+
+    memalloc_nofs_restore(handle->nofs);
+    current->journal_info = handle->saved;
+    up_read(&j->barrier);
+
+    if (atomic_read(&j->nr_dirty) >= j->max_copies / 2)
+        mod_delayed_work(system_wq, &j->commit_work, 0);
+}
+
+// Accounts one more block to the running transaction, starting the commit timer with the first
+static void osfs_journal_count(struct osfs_journal *j)
+{
+    if (atomic_inc_return(&j->nr_dirty) == 1)
+        queue_delayed_work(system_wq, &j->commit_work, j->interval);
+}
+
+/**
+ * Function: osfs_journal_dirty
+ * Description: Records that a cached metadata block was modified; called
+ *              after the change and inside the handle making it. With a
+ *              journal the block joins the running transaction, and if block
+ *              device writeback marked it dirty before it is cleaned, waiting
+ *              for a write of it in flight: from now on it only reaches its
+ *              home through a checkpoint. Without a journal the block is
+ *              marked dirty.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - bh: The buffer head of the block, pinned in sb_info->bh_cache.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_dirty(struct osfs_sb_info *sb_info, struct buffer_head *bh)
+{
+    struct osfs_journal *j = sb_info->journal;
+
+    if (!j) {
+        mark_buffer_dirty(bh);
+        return;
+    }
+
+    if (buffer_dirty(bh)) {
+        lock_buffer(bh);
+        clear_buffer_dirty(bh);
+        unlock_buffer(bh);
+    }
+    if (xa_load(&j->dirty, bh->b_blocknr))
+        return;
+
+    get_bh(bh);
+    if (xa_insert(&j->dirty, bh->b_blocknr, bh, GFP_NOFS | __GFP_NOFAIL))
+        put_bh(bh);     // Another handle added it meanwhile
+    else
+        osfs_journal_count(j);
+}
+
+/**
+ * Function: osfs_journal_bits
+ * Description: Records that bits of the inode or block bitmap changed. The
+ *              bitmaps live in memory, so the commit copies the device blocks
+ *              holding these bits from there. May be called under a group
+ *              lock.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - inodes: true for the inode bitmap, false for the block bitmap.
+ *   - bit: First bit changed.
+ *   - count: Number of bits changed.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_bits(struct osfs_sb_info *sb_info, bool inodes, uint32_t bit, uint32_t count)
+{
+    struct osfs_journal *j = sb_info->journal;
+    uint32_t first, last, base;
+
+    if (!j || !count)
+        return;
+
+    // A device block holds whole unsigned longs of a bitmap, so only the bit number matters
+    base = inodes ? 0 : j->block_bitmap_first;
+    first = base + bit / (BLOCK_SIZE * BITS_PER_BYTE);
+    last = base + (bit + count - 1) / (BLOCK_SIZE * BITS_PER_BYTE);
+    for (; first <= last; first++)
+        if (!test_and_set_bit(first, j->bitmap_dirty))
+            osfs_journal_count(j);
+}
+
+/**
+ * Function: osfs_journal_defer_free
+ * Description: Holds back freed blocks from reuse until the running
+ *              transaction is on disk. The caller clears them in the bitmap
+ *              and keeps them out of the free-space index and the free
+ *              counters; osfs_reuse_blocks adds them there after the commit.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block of the run.
+ *   - count: Number of blocks in the run.
+ * Returns:
+ *   - true if the blocks are held back, false without a journal.
+ */
+bool osfs_journal_defer_free(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count)
+{
+    struct osfs_journal *j = sb_info->journal;
+    struct osfs_journal_free *fr, *last;
+
+    if (!j)
+        return false;
+
+    fr = kmalloc(sizeof(*fr), GFP_NOFS | __GFP_NOFAIL);
+    fr->start = start;
+    fr->count = count;
+    atomic_add(count, &j->pending_frees);
+
+    // A truncation frees its extents one after the other, often back to back
+    spin_lock(&j->free_lock);
+    last = list_empty(&j->frees) ? NULL : list_last_entry(&j->frees, struct osfs_journal_free, list);
+    if (last && last->start + last->count == start) {
+        last->count += count;
+    } else {
+        list_add_tail(&fr->list, &j->frees);
+        fr = NULL;
+    }
+    spin_unlock(&j->free_lock);
+    kfree(fr);
+    return true;
+}
+
+/**
+ * Function: osfs_journal_tid
+ * Description: Returns the id of the running transaction; inside a handle,
+ *              the one the handle's changes go to. 0 without a journal.
+ */
+u64 osfs_journal_tid(struct osfs_sb_info *sb_info)
+{
+    return sb_info->journal ? READ_ONCE(sb_info->journal->tid) : 0;
+}
+
+/**
+ * Function: osfs_journal_committed
+ * Description: Tells whether transaction @tid is on disk, or there is no
+ *              journal to wait for.
+ */
+bool osfs_journal_committed(struct osfs_sb_info *sb_info, u64 tid)
+{
+    return !sb_info->journal || READ_ONCE(sb_info->journal->committed) >= tid;
+}
+
+// Copies the device block @bit of the bitmap area out of the in-memory bitmaps
+static void osfs_journal_copy_bitmap(struct osfs_journal *j, uint32_t bit, void *to)
+{
+    struct osfs_sb_info *sb_info = j->sb_info;
+    const void *bitmap = sb_info->inode_bitmap;
+    size_t bytes = INODE_BITMAP_SIZE(sb_info) * sizeof(unsigned long);
+    size_t offset;
+
+    if (bit >= j->block_bitmap_first) {
+        bitmap = sb_info->block_bitmap;
+        bytes = BLOCK_BITMAP_SIZE(sb_info) * sizeof(unsigned long);
+        bit -= j->block_bitmap_first;
+    }
+    offset = (size_t)bit * BLOCK_SIZE;
+    memcpy(to, bitmap + offset, min_t(size_t, bytes - offset, BLOCK_SIZE));
+}
+
+/**
+ * Function: osfs_journal_close
+ * Description: Ends the running transaction: waits for every handle to
+ *              close, copies its blocks into @copies, in device block order,
+ *              moves its freed runs to @frees and starts the next
+ *              transaction. Handles wait only for the copying.
+ * Returns:
+ *   - The number of blocks copied.
+ */
+static uint32_t osfs_journal_close(struct osfs_journal *j, struct list_head *copies,
+                                   struct list_head *frees)
+{
+    struct osfs_sb_info *sb_info = j->sb_info;
+    struct osfs_journal_copy *copy;
+    struct buffer_head *bh;
+    unsigned long nr, bit;
+    uint32_t count = 0;
+
+    down_write(&j->barrier);
+
+    // The bitmaps come first on the device
+    for_each_set_bit(bit, j->bitmap_dirty, j->bitmap_blocks) {
+        copy = osfs_journal_copy_new(copies, sb_info->disk.s_inode_bitmap_start + bit);
+        osfs_journal_copy_bitmap(j, bit, copy->data);
+        count++;
+    }
+    bitmap_zero(j->bitmap_dirty, j->bitmap_blocks);
+
+    xa_for_each(&j->dirty, nr, bh) {
+        copy = osfs_journal_copy_new(copies, nr);
+        memcpy(copy->data, bh->b_data, BLOCK_SIZE);
+        xa_erase(&j->dirty, nr);
+        put_bh(bh);
+        count++;
+    }
+    atomic_set(&j->nr_dirty, 0);
+
+    spin_lock(&j->free_lock);
+    list_splice_init(&j->frees, frees);
+    spin_unlock(&j->free_lock);
+
+    if (count || !list_empty(frees))
+        WRITE_ONCE(j->tid, j->tid + 1);
+    up_write(&j->barrier);
+    return count;
+}
+
+/**
+ * Function: osfs_journal_write
+ * Description: Writes the data out, then a closed transaction to the log,
+ *              commits it, checkpoints it and advances the journal superblock
+ *              past it.
+ *              A transaction larger than the log is written home directly,
+ *              which is not atomic.
+ * Returns:
+ *   - 0 on success, or the error of a failed write.
+ */
+static int osfs_journal_write(struct osfs_journal *j, u64 tid, struct list_head *copies,
+                              uint32_t count)
+{
+    struct osfs_journal_copy *copy, *next, *blk;
+    struct osfs_journal_descriptor *desc;
+    struct osfs_journal_commit *commit;
+    struct osfs_journal_io io;
+    struct blk_plug plug;
+    LIST_HEAD(log);
+    uint32_t pos = 1, crc = ~0U;
+    int ret;
+
+    ret = sync_blockdev(j->sb_info->sb->s_bdev);
+    if (ret)
+        return ret;
+
+    if (count > j->max_copies) {
+        pr_warn_ratelimited("osfs: Transaction %llu of %u blocks does not fit the journal of %s, writing it in place\n",
+                            tid, count, j->sb_info->sb->s_id);
+        goto checkpoint;
+    }
+
+    // Descriptors and copies, each descriptor ahead of the copies it lists
+    osfs_journal_io_init(&io);
+    blk_start_plug(&plug);
+    next = list_first_entry(copies, struct osfs_journal_copy, list);
+    while (!list_entry_is_head(next, copies, list)) {
+        blk = osfs_journal_copy_new(&log, j->start + pos++);
+        desc = blk->data;
+        osfs_journal_header_init(desc, OSFS_JOURNAL_DESCRIPTOR, tid);
+        for (copy = next; !list_entry_is_head(copy, copies, list) &&
+             desc->d_count < OSFS_JOURNAL_TAGS; copy = list_next_entry(copy, list))
+            desc->d_blocks[desc->d_count++] = copy->nr;
+        crc = crc32_le(crc, blk->data, BLOCK_SIZE);
+        osfs_journal_submit(j, &io, blk->nr, blk->data, 0);
+
+        for (; next != copy; next = list_next_entry(next, list)) {
+            crc = crc32_le(crc, next->data, BLOCK_SIZE);
+            osfs_journal_submit(j, &io, j->start + pos++, next->data, 0);
+        }
+    }
+    blk_finish_plug(&plug);
+    ret = osfs_journal_wait(&io);
+    if (ret)
+        goto out;
+
+    // The flush ahead of the commit block makes the log and the data of step 0 durable
+    blk = osfs_journal_copy_new(&log, j->start + pos);
+    commit = blk->data;
+    osfs_journal_header_init(commit, OSFS_JOURNAL_COMMIT, tid);
+    commit->c_blocks = count;
+    commit->c_crc = crc;
+    ret = osfs_journal_write_one(j, blk->nr, blk->data, REQ_PREFLUSH | REQ_FUA);
+    if (ret)
+        goto out;
+
+checkpoint:
+    ret = osfs_journal_write_list(j, copies);
+    if (ret)
+        goto out;
+
+    // The log may be reused once the checkpoint is durable
+    blk = osfs_journal_copy_new(&log, j->start);
+    osfs_journal_header_init(blk->data, OSFS_JOURNAL_SUPER, tid + 1);
+    ret = osfs_journal_write_one(j, blk->nr, blk->data, REQ_PREFLUSH | REQ_FUA);
+out:
+    osfs_journal_copies_free(&log);
+    return ret;
+}
+
+/**
+ * Function: osfs_journal_release
+ * Description: Makes the blocks freed by a committed transaction available
+ *              again. After a failed commit they stay held back.
+ */
+static void osfs_journal_release(struct osfs_journal *j, struct list_head *frees, bool reuse)
+{
+    struct osfs_journal_free *fr, *tmp;
+
+    list_for_each_entry_safe(fr, tmp, frees, list) {
+        if (reuse) {
+            osfs_reuse_blocks(j->sb_info, fr->start, fr->count);
+            atomic_sub(fr->count, &j->pending_frees);
+        }
+        kfree(fr);
+    }
+}
+
+/**
+ * Function: osfs_journal_commit
+ * Description: Makes transaction @tid durable, committing the running
+ *              transaction if it has not been yet. Callers of a transaction
+ *              another caller is committing wait for that commit instead of
+ *              starting their own, so concurrent fsyncs share one. Must not be
+ *              called inside a handle.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - tid: The transaction, as returned by osfs_journal_tid.
+ * Returns:
+ *   - 0 on success, also without a journal.
+ *   - The error of the commit, or of an earlier failed one.
+ */
+int osfs_journal_commit(struct osfs_sb_info *sb_info, u64 tid)
+{
+    struct osfs_journal *j = sb_info->journal;
+    LIST_HEAD(copies);
+    LIST_HEAD(frees);
+    unsigned int nofs;
+    uint32_t count;
+    u64 closed, start;
+    int ret;
+
+    if (!j)
+        return 0;
+
+    mutex_lock(&j->commit_mutex);
+    ret = j->error;
+    if (ret || j->committed >= tid)
+        goto out;
+
+    // Reclaim could evict an inode, which opens a handle
+    nofs = memalloc_nofs_save();
+    start = ktime_get_ns();
+    closed = READ_ONCE(j->tid);
+    count = osfs_journal_close(j, &copies, &frees);
+    if (count)
+        ret = osfs_journal_write(j, closed, &copies, count);
+    osfs_journal_copies_free(&copies);
+    memalloc_nofs_restore(nofs);
+
+    if (ret) {
+        pr_err("osfs: Commit of transaction %llu on %s failed (%d), the journal is stopped\n",
+               closed, sb_info->sb->s_id, ret);
+        j->error = ret;
+        osfs_journal_release(j, &frees, false);
+        goto out;
+    }
+    osfs_journal_release(j, &frees, true);
+    if (count || READ_ONCE(j->tid) != closed) {
+        WRITE_ONCE(j->committed, closed);
+        osfs_stat_inc(sb_info, OSFS_STAT_JOURNAL_COMMITS);
+        osfs_stat_add(sb_info, OSFS_STAT_JOURNAL_BLOCKS, count);
+        trace_osfs_journal_commit(sb_info, closed, count, ktime_get_ns() - start);
+    }
+out:
+    mutex_unlock(&j->commit_mutex);
+    return ret;
+}
+
+/**
+ * Function: osfs_journal_retry
+ * Description: Called when an allocation outside any handle failed: if
+ *              freed blocks are waiting for a commit, commits them so that
+ *              the allocation can be tried again.
+ * Returns:
+ *   - true if blocks may have become free.
+ */
+bool osfs_journal_retry(struct osfs_sb_info *sb_info)
+{
+    struct osfs_journal *j = sb_info->journal;
+
+    if (!j || current->journal_info == j || !atomic_read(&j->pending_frees))
+        return false;
+    return !osfs_journal_commit(sb_info, osfs_journal_tid(sb_info));
+}
+
+static void osfs_journal_commit_work(struct work_struct *work)
+{
+    struct osfs_journal *j = container_of(to_delayed_work(work), struct osfs_journal,
+                                          commit_work);
+
+    osfs_journal_commit(j->sb_info, READ_ONCE(j->tid));
+}
+
+/**
+ * Function: osfs_journal_scan
+ * Description: Walks the transaction at the start of the log. With @apply,
+ *              copies its blocks to their homes through the buffer cache.
+ * Returns:
+ *   - The number of blocks of a committed transaction the journal expects.
+ *   - 0 if there is none.
+ *   - -EIO if a block cannot be read or a logged block has no valid home.
+ */
+static long osfs_journal_scan(struct osfs_journal *j, bool apply)
+{
+    struct osfs_super_block *dsb = &j->sb_info->disk;
+    struct super_block *sb = j->sb_info->sb;
+    struct osfs_journal_descriptor *desc;
+    struct osfs_journal_commit *commit;
+    struct buffer_head *bh = NULL, *copy, *home;
+    uint32_t pos = 1, crc = ~0U, count = 0, nr, i;
+    long ret = 0;
+
+    while (pos < j->blocks) {
+        bh = sb_bread(sb, j->start + pos);
+        if (!bh)
+            return -EIO;
+        desc = (struct osfs_journal_descriptor *)bh->b_data;
+        if (desc->d_header.h_magic != OSFS_JOURNAL_MAGIC || desc->d_header.h_tid != j->tid)
+            break;
+        if (desc->d_header.h_type == OSFS_JOURNAL_COMMIT) {
+            commit = (struct osfs_journal_commit *)bh->b_data;
+            if (commit->c_blocks == count && commit->c_crc == crc)
+                ret = count;
+            break;
+        }
+        if (desc->d_header.h_type != OSFS_JOURNAL_DESCRIPTOR || desc->d_count > OSFS_JOURNAL_TAGS ||
+            pos + 1 + desc->d_count >= j->blocks)
+            break;
+
+        crc = crc32_le(crc, bh->b_data, BLOCK_SIZE);
+        for (i = 0; i < desc->d_count; i++) {
+            copy = sb_bread(sb, j->start + pos + 1 + i);
+            if (!copy) {
+                brelse(bh);
+                return -EIO;
+            }
+            crc = crc32_le(crc, copy->b_data, BLOCK_SIZE);
+
+            // Anything but the superblock and the log itself may be journaled
+            nr = desc->d_blocks[i];
+            if (apply && (nr < dsb->s_inode_bitmap_start ||
+                          (nr >= dsb->s_journal_start && nr < dsb->s_data_start) ||
+                          nr >= dsb->s_data_start + dsb->s_block_count)) {
+                pr_err("osfs: Journal of %s logs device block %u\n", sb->s_id, nr);
+                brelse(copy);
+                brelse(bh);
+                return -EIO;
+            }
+            if (apply) {
+                home = sb_getblk(sb, nr);
+                if (!home) {
+                    brelse(copy);
+                    brelse(bh);
+                    return -EIO;
+                }
+                lock_buffer(home);
+                memcpy(home->b_data, copy->b_data, BLOCK_SIZE);
+                set_buffer_uptodate(home);
+                unlock_buffer(home);
+                mark_buffer_dirty(home);
+                brelse(home);
+            }
+            brelse(copy);
+        }
+        count += desc->d_count;
+        pos += 1 + desc->d_count;
+        brelse(bh);
+        bh = NULL;
+    }
+    brelse(bh);
+    return ret;
+}
+
+/**
+ * Function: osfs_journal_replay
+ * Description: Replays a transaction that was committed but maybe not
+ *              checkpointed when the filesystem went down, then advances the
+ *              journal superblock past it.
+ * Returns:
+ *   - 0 on success, -EIO on failure.
+ */
+static int osfs_journal_replay(struct osfs_journal *j)
+{
+    struct super_block *sb = j->sb_info->sb;
+    struct buffer_head *bh;
+    long count;
+    int ret;
+
+    count = osfs_journal_scan(j, false);
+    if (count <= 0)
+        return count;
+    count = osfs_journal_scan(j, true);
+    if (count < 0)
+        return count;
+
+    ret = sync_blockdev(sb->s_bdev);
+    if (ret)
+        return ret;
+    bh = sb_bread(sb, j->start);
+    if (!bh)
+        return -EIO;
+    lock_buffer(bh);
+    osfs_journal_header_init(bh->b_data, OSFS_JOURNAL_SUPER, j->tid + 1);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    ret = __sync_dirty_buffer(bh, REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
+    brelse(bh);
+    if (ret)
+        return ret;
+
+    pr_info("osfs: Replayed transaction %llu (%ld blocks) on %s\n", j->tid, count, sb->s_id);
+    j->tid++;
+    return 0;
+}
+
+/**
+ * Function: osfs_journal_load
+ * Description: Sets up the journal of a block device mount whose superblock
+ *              has one and replays it. Runs before anything else is read from
+ *              the areas the journal covers.
+ * Inputs:
+ *   - sb_info: The superblock information; disk holds the checked superblock.
+ *   - opts: The mount options, for the commit interval.
+ * Returns:
+ *   - 0 on success, also when the filesystem has no journal.
+ *   - -EINVAL if the journal superblock is not valid.
+ *   - -ENOMEM or -EIO on failure.
+ */
+int osfs_journal_load(struct osfs_sb_info *sb_info, const struct osfs_mount_opts *opts)
+{
+    struct osfs_super_block *dsb = &sb_info->disk;
+    struct super_block *sb = sb_info->sb;
+    struct osfs_journal_header *hdr;
+    struct osfs_journal *j;
+    struct buffer_head *bh;
+    int ret;
+
+    if (!dsb->s_journal_blocks)
+        return 0;
+
+    j = kzalloc(sizeof(*j), GFP_KERNEL);
+    if (!j)
+        return -ENOMEM;
+    j->sb_info = sb_info;
+    j->start = dsb->s_journal_start;
+    j->blocks = dsb->s_journal_blocks;
+    // Besides the superblock and the commit block, each descriptor takes one block in OSFS_JOURNAL_TAGS + 1
+    j->max_copies = (j->blocks - 2) * OSFS_JOURNAL_TAGS / (OSFS_JOURNAL_TAGS + 1);
+    j->interval = (opts->commit_interval ?: OSFS_DEFAULT_COMMIT_INTERVAL) * HZ;
+    j->bitmap_blocks = dsb->s_inode_table_start - dsb->s_inode_bitmap_start;
+    j->block_bitmap_first = dsb->s_block_bitmap_start - dsb->s_inode_bitmap_start;
+    init_rwsem(&j->barrier);
+    xa_init(&j->dirty);
+    spin_lock_init(&j->free_lock);
+    INIT_LIST_HEAD(&j->frees);
+    mutex_init(&j->commit_mutex);
+    INIT_DELAYED_WORK(&j->commit_work, osfs_journal_commit_work);
+    // From here on osfs_journal_destroy frees the journal if the mount fails
+    sb_info->journal = j;
+
+    j->bitmap_dirty = bitmap_zalloc(j->bitmap_blocks, GFP_KERNEL);
+    if (!j->bitmap_dirty)
+        return -ENOMEM;
+
+    // Commits write around the buffer cache, so what it kept from an earlier mount is stale
+    invalidate_bdev(sb->s_bdev);
+
+    bh = sb_bread(sb, j->start);
+    if (!bh)
+        return -EIO;
+    hdr = (struct osfs_journal_header *)bh->b_data;
+    if (hdr->h_magic != OSFS_JOURNAL_MAGIC || hdr->h_type != OSFS_JOURNAL_SUPER) {
+        pr_err("osfs: Bad journal superblock on %s\n", sb->s_id);
+        brelse(bh);
+        return -EINVAL;
+    }
+    j->tid = hdr->h_tid;
+    brelse(bh);
+
+    ret = osfs_journal_replay(j);
+    if (ret) {
+        pr_err("osfs: Failed to replay the journal of %s (%d)\n", sb->s_id, ret);
+        return ret;
+    }
+    j->committed = j->tid - 1;
+    return 0;
+}
+
+/**
+ * Function: osfs_journal_destroy
+ * Description: Stops the commit timer and frees the journal. At unmount the
+ *              last transaction is committed first by osfs_put_super; after a
+ *              failed mount whatever it held is dropped.
+ */
+void osfs_journal_destroy(struct osfs_sb_info *sb_info)
+{
+    struct osfs_journal *j = sb_info->journal;
+    struct buffer_head *bh;
+    unsigned long nr;
+    LIST_HEAD(frees);
+
+    if (!j)
+        return;
+
+    cancel_delayed_work_sync(&j->commit_work);
+    xa_for_each(&j->dirty, nr, bh)
+        put_bh(bh);
+    xa_destroy(&j->dirty);
+    list_splice_init(&j->frees, &frees);
+    osfs_journal_release(j, &frees, false);
+    bitmap_free(j->bitmap_dirty);
+    kfree(j);
+    sb_info->journal = NULL;
+}
+
+/**
+ * Function: osfs_journal_show_options
+ * Description: Reports the journal geometry and commit interval in /proc/mounts.
+ */
+void osfs_journal_show_options(struct seq_file *m, struct osfs_sb_info *sb_info)
+{
+    struct osfs_journal *j = sb_info->journal;
+
+    if (j)
+        seq_printf(m, ",journal=%u,commit=%lu", j->blocks, j->interval / HZ);
+}
@@ -4,27 +4,122 @@
 #include <linux/types.h>      // Include basic type definitions
 #include <linux/fs.h>
 #include <linux/bitmap.h>    // For bitmap operations
+#include <linux/rbtree.h>    // For the free-space index
+#include <linux/spinlock.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/percpu_counter.h>
+#include <linux/seqlock.h>
+#include <linux/xarray.h>
+#include <linux/buffer_head.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/percpu.h>
 #include <linux/time.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include <linux/string.h>
 #include <linux/module.h>
+#include "osfs_ioctl.h"
 
 #define OSFS_MAGIC 0x051AB520
 //#define BLOCK_SIZE 4096       // Each data block size is 4KB
-#define INODE_COUNT 20         // Maximum of 20 inodes in the filesystem
-#define DATA_BLOCK_COUNT 20    // Assume there are 20 data blocks
+#define OSFS_DEFAULT_INODE_COUNT 20 // Inodes per mount unless overridden by -o inodes=N
+#define OSFS_DEFAULT_BLOCK_COUNT 20 // Data blocks per mount unless overridden by -o blocks=M
+#define OSFS_MIN_INODE_COUNT 2      // Inode 0 is reserved and inode 1 is the root
+#define OSFS_MAX_INODE_COUNT (1U << 24)
+#define OSFS_MAX_BLOCK_COUNT (1U << 28)
 #define MAX_FILENAME_LEN 255
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(struct osfs_dir_entry))
 
 #define BITMAP_SIZE(bits) (((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
 
-// Calculate the size of the bitmap (in units of unsigned long)
-#define INODE_BITMAP_SIZE BITMAP_SIZE(INODE_COUNT)
-#define BLOCK_BITMAP_SIZE BITMAP_SIZE(DATA_BLOCK_COUNT)
+// Calculate the size of the bitmap (in units of unsigned long) for a mount
+#define INODE_BITMAP_SIZE(sbi) BITMAP_SIZE((sbi)->inode_count)
+#define BLOCK_BITMAP_SIZE(sbi) BITMAP_SIZE((sbi)->block_count)
 
 #define ROOT_INODE 1            // Define the root inode as 1
 
+#define OSFS_BLOCKS_PER_GROUP 8192U  // One bitmap block's worth of bits, as in ext2
+
+/**
+ * On-disk layout of a block device mount, in BLOCK_SIZE device blocks:
+ *
+ *   | superblock | inode bitmap | block bitmap | inode table | journal | data blocks |
+ *
+ * The bitmaps are stored as the in-memory unsigned long arrays, and every
+ * structure in host byte order. The journal (journal.c) is optional; without
+ * one s_journal_start and s_journal_blocks are 0 and the data blocks follow
+ * the inode table.
+ */
+#define OSFS_SUPER_BLOCK 0
+#define OSFS_INODES_PER_BLOCK (BLOCK_SIZE / sizeof(struct osfs_inode))
+
+/**
+ * Struct: osfs_super_block
+ * Description: The superblock as stored in device block OSFS_SUPER_BLOCK.
+ */
+struct osfs_super_block {
+    uint32_t s_magic;                   // OSFS_MAGIC
+    uint32_t s_block_size;              // BLOCK_SIZE
+    uint32_t s_inode_count;             // Total number of inodes
+    uint32_t s_block_count;             // Total number of data blocks
+    uint32_t s_inode_bitmap_start;      // First device block of each area
+    uint32_t s_block_bitmap_start;
+    uint32_t s_inode_table_start;
+    uint32_t s_data_start;
+    uint32_t s_journal_start;           // First block of the journal, 0 without one
+    uint32_t s_journal_blocks;          // Blocks in the journal
+};
+
+#define OSFS_DEFAULT_JOURNAL_BLOCKS 1024U  // Journal of a new filesystem unless overridden by -o journal=N
+#define OSFS_MIN_JOURNAL_BLOCKS 8U
+#define OSFS_MAX_JOURNAL_BLOCKS 65536U
+#define OSFS_DEFAULT_COMMIT_INTERVAL 5U    // Seconds a transaction stays open unless overridden by -o commit=S
+
+/**
+ * Enum: osfs_mem_mode
+ * Description: Backing of the data area of a memory mount (-o mem=).
+ */
+enum osfs_mem_mode {
+    OSFS_MEM_VMALLOC,           // One vmalloc region reserved at mount
+    OSFS_MEM_HUGE,              // PMD-sized page chunks reserved at mount
+    OSFS_MEM_SPARSE,            // A page per PAGE_SIZE / BLOCK_SIZE blocks, allocated with them
+};
+
+// A huge chunk is PMD-sized where the page allocator can provide that
+#define OSFS_HUGE_ORDER min(PMD_SHIFT - PAGE_SHIFT, MAX_PAGE_ORDER)
+
+/**
+ * Enum: osfs_stat
+ * Description: Per-mount event counters, kept per CPU so the hot paths never
+ *              share a cache line over them, and summed when read through
+ *              /sys/fs/osfs/<mount>/ (sysfs.c). All count from mount time.
+ */
+enum osfs_stat {
+    OSFS_STAT_ALLOC_REQUESTS,   // osfs_alloc_run calls
+    OSFS_STAT_ALLOC_SCANNED,    // Groups osfs_alloc_run searched
+    OSFS_STAT_ALLOC_FAILURES,   // osfs_alloc_run calls that found no free block
+    OSFS_STAT_ALLOC_BLOCKS,     // Data blocks allocated
+    OSFS_STAT_FREED_BLOCKS,     // Data blocks freed
+    OSFS_STAT_EXTENTS_CREATED,  // Extent tree entries added, not counting merges
+    OSFS_STAT_EXTENTS_FREED,    // Extent tree entries removed by truncation
+    OSFS_STAT_LOOKUP_HITS,
+    OSFS_STAT_LOOKUP_MISSES,
+    OSFS_STAT_READ_BYTES,
+    OSFS_STAT_WRITE_BYTES,
+    OSFS_STAT_JOURNAL_COMMITS,  // Transactions committed
+    OSFS_STAT_JOURNAL_BLOCKS,   // Metadata blocks written through the journal
+    OSFS_STAT_COMPRESS_CHUNKS,  // Chunks compressed
+    OSFS_STAT_COMPRESS_SAVED,   // Data blocks freed by compressing them
+    OSFS_STAT_DECOMPRESS_CHUNKS, // Chunks decompressed for reading
+    OSFS_STAT_INFLATE_CHUNKS,   // Compressed extents stored back as ordinary blocks
+    OSFS_NR_STATS,
+};
+
+struct osfs_stats {
+    u64 count[OSFS_NR_STATS];
+};
+
 /**
  * Struct: osfs_sb_info
  * Description: Superblock information for the osfs filesystem.
@@ -34,31 +129,232 @@ struct osfs_sb_info {
     uint32_t block_size;         // Size of each data block
     uint32_t inode_count;        // Total number of inodes
     uint32_t block_count;        // Total number of data blocks
-    uint32_t nr_free_inodes;     // Number of free inodes
-    uint32_t nr_free_blocks;     // Number of free data blocks
+    struct percpu_counter nr_free_inodes; // Number of free inodes
+    struct percpu_counter nr_free_blocks; // Number of free data blocks
     unsigned long *inode_bitmap; // Pointer to the inode bitmap
     unsigned long *block_bitmap; // Pointer to the data block bitmap
-    void *inode_table;           // Pointer to the inode table
-    void *data_blocks;           // Pointer to the data blocks area
+    void *inode_table;           // Pointer to the inode table (memory mount only)
+    void *data_blocks;           // Pointer to the data blocks area (memory mount only)
+    void *memory;                // The allocation holding the above
+    enum osfs_mem_mode mem_mode;    // How a memory mount backs its data area
+    void **data_chunks;             // mem=huge/sparse: data area chunks, NULL while unbacked
+    unsigned int data_chunk_shift;  // log2 of the blocks in a chunk
+    unsigned int data_chunk_order;  // Page order of a chunk
+
+    // Block device mount, see block.c; sb->s_bdev is NULL for a memory mount
+    struct super_block *sb;
+    struct osfs_super_block disk;   // Layout read from the device
+    struct xarray bh_cache;         // Device block -> pinned buffer_head
+    struct osfs_journal *journal;   // Metadata journal, NULL without one, see journal.c
+    struct osfs_compress *compress; // Compression of cold data (-o compress), see compress.c
+
+    // Block and inode groups, see balloc.c
+    struct osfs_group *groups;
+    uint32_t group_count;
+    uint32_t inodes_per_group;
+    unsigned int __percpu *group_rotor; // Group each CPU starts spreading allocations from
+
+    // Data blocks mapped by more than one file, see refcount.c
+    struct rb_root shared_runs;
+    struct mutex share_lock;
+
+    // Instrumentation, see sysfs.c
+    struct osfs_stats __percpu *stats;
+    struct kobject s_kobj;                  // /sys/fs/osfs/<mount>
+    struct completion s_kobj_unregister;
+
+    /*
+     * Locking: each group's lock covers its part of the bitmaps, its free
+     * counters and its free-space index. The extent tree of a file is guarded
+     * by osfs_inode_info.i_extent_sem: readers of the block map take it
+     * shared, allocation takes it exclusive. share_lock nests inside the
+     * extent locks and outside the group locks. Directory contents and their
+     * hash index are serialised by the directory's i_rwsem. A journal
+     * handle (osfs_journal_start) is opened after i_rwsem, the invalidate
+     * lock and folio locks are taken, and before the extent locks; nobody
+     * opens a handle while holding an extent lock.
+     */
+};
+
+/**
+ * Struct: osfs_group
+ * Description: A block group: OSFS_BLOCKS_PER_GROUP data blocks and
+ *              inodes_per_group inodes with their own free counters, lock and
+ *              free-space index, so allocations in different groups never
+ *              contend.
+ */
+struct osfs_group {
+    spinlock_t lock;
+    uint32_t first_block;               // First data block of the group
+    uint32_t nr_blocks;                 // Data blocks in the group
+    uint32_t free_blocks;               // Free data blocks in the group
+    uint32_t first_inode;               // First inode number of the group
+    uint32_t nr_inodes;                 // Inodes in the group
+    uint32_t free_inodes;               // Free inodes in the group
+    struct rb_root free_extents;        // Free-space index of (start, length) runs
+    struct osfs_free_extent *free_extent_spare; // Index node for the next update under lock
+} ____cacheline_aligned_in_smp;
+
+static inline void osfs_stat_add(struct osfs_sb_info *sb_info, enum osfs_stat item, u64 delta)
+{
+    this_cpu_add(sb_info->stats->count[item], delta);
+}
+
+static inline void osfs_stat_inc(struct osfs_sb_info *sb_info, enum osfs_stat item)
+{
+    this_cpu_inc(sb_info->stats->count[item]);
+}
+
+static inline struct osfs_group *osfs_block_group(struct osfs_sb_info *sb_info, uint32_t block)
+{
+    return &sb_info->groups[block / OSFS_BLOCKS_PER_GROUP];
+}
+
+static inline uint32_t osfs_inode_group(struct osfs_sb_info *sb_info, uint32_t ino)
+{
+    return ino / sb_info->inodes_per_group;
+}
+
+/**
+ * Struct: osfs_mount_opts
+ * Description: Geometry requested through mount options (-o inodes=N,blocks=M).
+ */
+struct osfs_mount_opts {
+    uint32_t inode_count;        // Number of inodes, including reserved inode 0
+    uint32_t block_count;        // Number of data blocks, 0 for the default
+    bool format;                 // Write a new filesystem to the device first
+    enum osfs_mem_mode mem_mode; // Data area backing of a memory mount
+    uint32_t journal_blocks;     // Journal of a formatted filesystem, U32_MAX for the default
+    unsigned int commit_interval; // Seconds between commits, 0 for the default
+    bool compress;               // Compress cold data (memory mount only)
 };
 
 /**
  * Struct: osfs_dir_entry
- * Description: Directory entry structure.
+ * Description: Variable-length directory record, in the style of ext2. The
+ *              records of a directory block chain through rec_len and always
+ *              cover the whole block; a record never crosses a block boundary.
+ *              An unused record has inode_no == 0, and a record may carry
+ *              slack after its name that a new entry can be split out of.
  */
 struct osfs_dir_entry {
-    char filename[MAX_FILENAME_LEN]; // File name
-    uint32_t inode_no;               // Corresponding inode number
+    uint32_t inode_no;                  // Corresponding inode number, 0 if unused
+    uint16_t rec_len;                   // Length of this record including slack
+    uint8_t name_len;                   // Length of the name (not NUL-terminated)
+    uint8_t file_type;                  // FT_* type of the inode
+    char name[];                        // File name
+};
+
+#define OSFS_DIR_REC_ALIGN 4
+// Smallest record that can hold a name of @len bytes
+#define OSFS_DIR_REC_LEN(len) ALIGN(sizeof(struct osfs_dir_entry) + (len), OSFS_DIR_REC_ALIGN)
+
+/**
+ * Function: osfs_dir_rec_ok
+ * Description: Checks that the record at @offset of a directory block is
+ *              well formed and stays inside the block.
+ */
+static inline bool osfs_dir_rec_ok(const struct osfs_dir_entry *de, unsigned int offset)
+{
+    return de->rec_len >= OSFS_DIR_REC_LEN(0) &&
+           !(de->rec_len % OSFS_DIR_REC_ALIGN) &&
+           offset + de->rec_len <= BLOCK_SIZE &&
+           (!de->inode_no || de->rec_len >= OSFS_DIR_REC_LEN(de->name_len));
+}
+
+/**
+ * Extent tree
+ *
+ * A file's blocks are mapped by an ext4-style tree keyed by logical block.
+ * Every node is an osfs_extent_header followed by eh_max entries. Leaves
+ * (eh_depth == 0) hold osfs_extent entries, index nodes hold osfs_extent_idx
+ * entries pointing at the node one level down. The root lives inline in the
+ * osfs_inode and, once it is full, spills into nodes stored in data blocks.
+ */
+#define OSFS_EXT_MAGIC 0x05EA
+#define OSFS_EXT_MAX_DEPTH 5
+#define OSFS_EXT_ROOT_ENTRIES 4
+#define OSFS_EXT_ENTRY_SIZE 12
+#define OSFS_EXT_ROOT_SIZE (sizeof(struct osfs_extent_header) + \
+                            OSFS_EXT_ROOT_ENTRIES * OSFS_EXT_ENTRY_SIZE)
+#define OSFS_EXT_BLOCK_ENTRIES ((BLOCK_SIZE - sizeof(struct osfs_extent_header)) / \
+                                OSFS_EXT_ENTRY_SIZE)
+
+struct osfs_extent_header {
+    uint16_t eh_magic;                  // OSFS_EXT_MAGIC
+    uint16_t eh_entries;                // Number of valid entries
+    uint16_t eh_max;                    // Capacity of this node
+    uint16_t eh_depth;                  // 0 for leaves, levels below for index nodes
+};
+
+struct osfs_extent {
+    uint32_t logical_block;             // First file block covered
+    uint32_t start_block;               // First physical data block, | OSFS_EXT_FLAGS
+    uint32_t block_count;               // Number of blocks
+};
+
+/**
+ * Unwritten extents: blocks reserved by fallocate are mapped with
+ * OSFS_EXT_UNWRITTEN set in start_block (block numbers stay below
+ * OSFS_MAX_BLOCK_COUNT, so the top bit is free). They read back as zeroes
+ * without their data blocks being touched, and are cleared and converted
+ * when first written. Two unwritten extents can merge, as the flag carries
+ * through the start_block arithmetic, but never with a written one.
+ */
+#define OSFS_EXT_UNWRITTEN (1U << 31)
+
+/**
+ * Compressed extents (compress.c): OSFS_EXT_COMPRESSED in start_block marks
+ * an extent whose block_count blocks of data are stored LZ4-compressed in
+ * the blocks from its first one on; how many is recorded in a header there,
+ * see osfs_ext_blocks. Its blocks cannot be addressed one by one, so such
+ * an extent is never split, merged or shared: it is trimmed at its end or
+ * removed whole, or first inflated back (osfs_inflate_blocks).
+ */
+#define OSFS_EXT_COMPRESSED (1U << 30)
+#define OSFS_EXT_FLAGS (OSFS_EXT_UNWRITTEN | OSFS_EXT_COMPRESSED)
+
+static inline bool osfs_ext_is_unwritten(const struct osfs_extent *ext)
+{
+    return ext->start_block & OSFS_EXT_UNWRITTEN;
+}
+
+static inline bool osfs_ext_is_compressed(const struct osfs_extent *ext)
+{
+    return ext->start_block & OSFS_EXT_COMPRESSED;
+}
+
+// First data block of an extent, without the flags
+static inline uint32_t osfs_ext_pblk(const struct osfs_extent *ext)
+{
+    return ext->start_block & ~OSFS_EXT_FLAGS;
+}
+
+struct osfs_extent_idx {
+    uint32_t logical_block;             // Lowest file block covered by the subtree
+    uint32_t node_block;                // Data block holding the child node
+    uint32_t reserved;
 };
 
+/**
+ * Inline data: a regular file of at most OSFS_INLINE_DATA_SIZE bytes keeps
+ * them in the inode itself, in the area that otherwise holds the legacy
+ * i_block field and the extent root, and has no data blocks. It moves to an
+ * extent once it grows past that. OSFS_INLINE_BLOCK stands for the inode as
+ * the "block" osfs_map_file_offset maps inline data to.
+ */
+#define OSFS_INLINE_DATA_FL 0x1         // i_flags: the data is stored inline
+#define OSFS_INLINE_DATA_SIZE (sizeof(uint32_t) * 2 + OSFS_EXT_ROOT_SIZE)
+#define OSFS_INLINE_BLOCK U32_MAX
+
 /**
  * Struct: osfs_inode
  * Description: Filesystem-specific inode structure.
  */
- struct osfs_extent { uint32_t start_block; uint32_t block_count; };
 struct osfs_inode {
     uint32_t i_ino;                     // Inode number
-    uint32_t i_size;                    // File size in bytes
+    uint32_t i_flags;                   // OSFS_*_FL
+    uint64_t i_size;                    // File size in bytes
     uint32_t i_blocks;                  // Number of blocks occupied by the file
     uint16_t i_mode;                    // File mode (permissions and type)
     uint16_t i_links_count;             // Number of hard links
@@ -67,31 +363,202 @@ struct osfs_inode {
     struct timespec64 __i_atime;        // Last access time
     struct timespec64 __i_mtime;        // Last modification time
     struct timespec64 __i_ctime;        // Creation time
-    uint32_t i_block;                   // Simplified handling, single data block pointer
+    union {
+        struct {
+            uint32_t i_block;           // Simplified handling, single data block pointer
+
+            // Root of the extent tree (header followed by OSFS_EXT_ROOT_ENTRIES entries)
+            uint8_t i_extent_root[OSFS_EXT_ROOT_SIZE];
+            uint32_t i_reserved;
+        };
+        uint8_t i_inline_data[OSFS_INLINE_DATA_SIZE]; // With OSFS_INLINE_DATA_FL
+    };
+};
 
-    // sW extent 
-    struct osfs_extent extents[4];                // hӽdAo̳]m 4 ӧ@d
-    uint8_t extent_count;        // wϥΪ extent ƶq
+static inline bool osfs_inode_is_inline(const struct osfs_inode *inode)
+{
+    return inode->i_flags & OSFS_INLINE_DATA_FL;
+}
+
+/**
+ * Struct: osfs_inode_info
+ * Description: In-memory inode, allocated from osfs_inode_cachep with the VFS
+ *              inode embedded, so the fields every I/O touches sit next to it.
+ */
+struct osfs_inode_info {
+    struct osfs_inode *raw;             // The inode's entry in the inode table
+    struct rw_semaphore i_extent_sem;   // Guards the extent tree rooted in raw
+    seqlock_t i_ext_cache_lock;
+    struct osfs_extent i_ext_cache;     // Last extent found by osfs_map_file_offset
+    struct osfs_dir_index *i_dir_index; // Hash index of a directory, built on first use
+    u64 i_sync_tid;                     // Journal transaction fsync has to wait for
+    struct list_head i_compress_list;   // On the compression queue, see compress.c
+    unsigned long i_compress_time;      // jiffies of the writeback that queued it
+    struct inode vfs_inode;
 };
 
+static inline struct osfs_inode_info *OSFS_I(struct inode *inode)
+{
+    return container_of(inode, struct osfs_inode_info, vfs_inode);
+}
+
+static inline struct rw_semaphore *osfs_ext_sem(struct inode *inode)
+{
+    return &OSFS_I(inode)->i_extent_sem;
+}
 
 struct inode *osfs_iget(struct super_block *sb, unsigned long ino);
 struct osfs_inode *osfs_get_osfs_inode(struct super_block *sb, uint32_t ino);
-int osfs_get_free_inode(struct osfs_sb_info *sb_info);
+int osfs_get_free_inode(struct osfs_sb_info *sb_info, const struct inode *dir, umode_t mode);
+void osfs_put_free_inode(struct osfs_sb_info *sb_info, uint32_t ino);
 int osfs_alloc_data_block(struct osfs_sb_info *sb_info, uint32_t *block_no);
 int osfs_fill_super(struct super_block *sb, void *data, int silent);
+void osfs_write_bitmaps(struct osfs_sb_info *sb_info);
 struct inode *osfs_new_inode(const struct inode *dir, umode_t mode);
 void osfs_free_data_block(struct osfs_sb_info *sb_info, uint32_t block_no);
+void osfs_free_blocks(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count);
+void osfs_reuse_blocks(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count);
 void osfs_destroy_inode(struct inode *inode);
+int osfs_write_inode(struct inode *inode, struct writeback_control *wbc);
+void osfs_dirty_inode(struct inode *inode, int flags);
+void osfs_evict_inode(struct inode *inode);
+int osfs_truncate_extents(struct inode *inode, loff_t size);
+int osfs_init_inodecache(void);
+void osfs_destroy_inodecache(void);
 
 //
-int osfs_alloc_extent(struct osfs_sb_info *sb_info, uint32_t required_blocks, struct osfs_inode *inode);
+int osfs_alloc_extent(struct osfs_sb_info *sb_info, uint32_t required_blocks, struct osfs_inode *inode,
+                      uint32_t lblk, bool unwritten);
+int osfs_alloc_file_blocks(struct osfs_sb_info *sb_info, struct osfs_inode *inode, uint32_t lblk,
+                           uint32_t count, bool unwritten);
+int osfs_defrag_file(struct inode *inode, struct osfs_defrag_info *info);
+int osfs_clone_range(struct inode *src, uint32_t lblk_in, struct inode *dst, uint32_t lblk_out,
+                     uint32_t count);
+long osfs_unshare_blocks(struct inode *inode, uint32_t lblk, uint32_t count);
+long osfs_inflate_blocks(struct inode *inode, uint32_t lblk, uint32_t count);
+
+// Extent tree (extents.c)
+void osfs_ext_init(struct osfs_inode *inode);
+int osfs_ext_lookup(struct osfs_sb_info *sb_info, struct osfs_inode *inode,
+                    uint32_t lblk, struct osfs_extent *ext);
+int osfs_ext_last(struct osfs_sb_info *sb_info, struct osfs_inode *inode,
+                  struct osfs_extent *ext);
+uint32_t osfs_ext_end(struct osfs_sb_info *sb_info, struct osfs_inode *inode);
+int osfs_ext_insert(struct osfs_sb_info *sb_info, struct osfs_inode *inode,
+                    const struct osfs_extent *ext);
+int osfs_ext_truncate(struct osfs_sb_info *sb_info, struct osfs_inode *inode, uint32_t lblk);
+long osfs_ext_mark_written(struct osfs_sb_info *sb_info, struct osfs_inode *inode, uint32_t lblk,
+                           uint32_t count);
+int osfs_map_file_offset(struct inode *inode, loff_t pos, void **addr, size_t *len,
+                         uint32_t *block);
+void osfs_ext_cache_reset(struct inode *inode);
+int osfs_ext_next(struct osfs_sb_info *sb_info, struct osfs_inode *inode, uint32_t lblk,
+                  struct osfs_extent *ext);
+int osfs_ext_punch(struct osfs_sb_info *sb_info, struct osfs_inode *inode, uint32_t lblk,
+                   uint32_t count);
+int osfs_ext_remap(struct osfs_sb_info *sb_info, struct osfs_inode *inode, uint32_t lblk,
+                   uint32_t count, uint32_t start_block);
+
+// Reference counts of shared data blocks (refcount.c)
+void osfs_share_init(struct osfs_sb_info *sb_info);
+void osfs_share_destroy(struct osfs_sb_info *sb_info);
+int osfs_share_rebuild(struct osfs_sb_info *sb_info);
+void osfs_share_get(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count);
+void osfs_share_put(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count);
+bool osfs_share_find(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count,
+                     uint32_t *found, uint32_t *found_len);
+
+// Bitmap run search and free-space index (balloc.c)
+unsigned long osfs_bitmap_next_run(const unsigned long *bitmap, unsigned long size,
+                                   unsigned long start, unsigned long *run_len);
+long osfs_bitmap_alloc_run(unsigned long *bitmap, unsigned long size,
+                           unsigned long start, unsigned long len);
+int osfs_groups_init(struct osfs_sb_info *sb_info);
+void osfs_groups_destroy(struct osfs_sb_info *sb_info);
+void osfs_group_lock(struct osfs_group *grp);
+void osfs_group_unlock(struct osfs_group *grp);
+int osfs_free_index_alloc(struct osfs_group *grp, uint32_t len, uint32_t *start);
+uint32_t osfs_free_index_alloc_at(struct osfs_group *grp, uint32_t goal, uint32_t len);
+uint32_t osfs_free_index_max_run(struct osfs_group *grp);
+void osfs_free_index_insert(struct osfs_group *grp, uint32_t start, uint32_t len);
+
+// Block access for memory and block device mounts (block.c)
+static inline bool osfs_on_bdev(const struct osfs_sb_info *sb_info)
+{
+    return sb_info->sb->s_bdev != NULL;
+}
+
+static inline uint32_t osfs_chunk_mask(const struct osfs_sb_info *sb_info)
+{
+    return (1U << sb_info->data_chunk_shift) - 1;
+}
+
+struct buffer_head *osfs_disk_bh(struct osfs_sb_info *sb_info, sector_t nr, bool new);
+int osfs_data_area_init(struct osfs_sb_info *sb_info);
+void osfs_data_area_destroy(struct osfs_sb_info *sb_info);
+void *osfs_data_block(struct osfs_sb_info *sb_info, uint32_t block);
+uint32_t osfs_data_contig(struct osfs_sb_info *sb_info, uint32_t block);
+void osfs_data_block_dirty(struct osfs_sb_info *sb_info, uint32_t block);
+void osfs_meta_block_dirty(struct osfs_sb_info *sb_info, uint32_t block);
+int osfs_data_blocks_prepare(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count);
+void osfs_data_blocks_release(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count);
+void osfs_block_cache_release(struct osfs_sb_info *sb_info);
+
+// Metadata journal of block device mounts (journal.c)
+struct seq_file;
+
+struct osfs_handle {
+    struct osfs_journal *journal;       // NULL if the handle does nothing
+    void *saved;                        // current->journal_info before it
+    unsigned int nofs;                  // memalloc_nofs_save cookie
+};
+
+void osfs_journal_format(void *block);
+int osfs_journal_load(struct osfs_sb_info *sb_info, const struct osfs_mount_opts *opts);
+void osfs_journal_destroy(struct osfs_sb_info *sb_info);
+void osfs_journal_start(struct osfs_sb_info *sb_info, struct osfs_handle *handle);
+void osfs_journal_stop(struct osfs_handle *handle);
+void osfs_journal_dirty(struct osfs_sb_info *sb_info, struct buffer_head *bh);
+void osfs_journal_bits(struct osfs_sb_info *sb_info, bool inodes, uint32_t bit, uint32_t count);
+bool osfs_journal_defer_free(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count);
+bool osfs_journal_retry(struct osfs_sb_info *sb_info);
+u64 osfs_journal_tid(struct osfs_sb_info *sb_info);
+bool osfs_journal_committed(struct osfs_sb_info *sb_info, u64 tid);
+int osfs_journal_commit(struct osfs_sb_info *sb_info, u64 tid);
+void osfs_journal_show_options(struct seq_file *m, struct osfs_sb_info *sb_info);
+
+// Compression of cold data on memory mounts (compress.c)
+int osfs_compress_init(struct osfs_sb_info *sb_info);
+void osfs_compress_stop(struct osfs_sb_info *sb_info);
+void osfs_compress_destroy(struct osfs_sb_info *sb_info);
+void osfs_compress_queue(struct inode *inode);
+void osfs_compress_forget(struct inode *inode);
+int osfs_compress_read(struct inode *inode, loff_t pos, void *buf, size_t len);
+uint32_t osfs_compress_free(struct osfs_sb_info *sb_info, const struct osfs_extent *ext);
+uint32_t osfs_ext_blocks(struct osfs_sb_info *sb_info, const struct osfs_extent *ext);
+
+// Per-mount counters in sysfs (sysfs.c)
+int osfs_sysfs_init(void);
+void osfs_sysfs_exit(void);
+int osfs_sysfs_register(struct super_block *sb);
+void osfs_sysfs_unregister(struct osfs_sb_info *sb_info);
+
+// Directory hash index (dirindex.c)
+int osfs_dir_index_find(struct inode *dir, const char *name, size_t len, uint32_t *ino);
+int osfs_dir_index_reserve(struct inode *dir, size_t len);
+int osfs_dir_index_add(struct inode *dir, const char *name, size_t len, uint32_t ino,
+                       uint8_t file_type);
+int osfs_dir_index_remove(struct inode *dir, const char *name, size_t len);
+void *osfs_dir_block(struct inode *dir, uint32_t block);
+void osfs_dir_block_dirty(struct inode *dir, uint32_t block);
+void osfs_dir_index_release(struct inode *dir);
 
 
 // External Operations Structures
 
 extern const struct inode_operations osfs_file_inode_operations;
 extern const struct file_operations osfs_file_operations;
+extern const struct address_space_operations osfs_aops;
 extern const struct inode_operations osfs_dir_inode_operations;
 extern const struct file_operations osfs_dir_operations;
 extern const struct super_operations osfs_super_ops;
@@ -1,14 +1,18 @@
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/blkdev.h>
 #include "osfs.h"
 
+#define CREATE_TRACE_POINTS
+#include "osfs_trace.h"
+
 /**
  * Function: osfs_mount
  * Description: Mounts the osfs filesystem.
  * Inputs:
  *   - fs_type: The file system type structure.
  *   - flags: Mount flags.
- *   - dev_name: Device name (not used in nodev filesystem).
+ *   - dev_name: Block device to mount, or any other name for a memory mount.
  *   - data: Data passed during mount.
  * Returns:
  *   - A dentry pointer to the root of the mounted filesystem.
@@ -53,9 +57,24 @@ static int __init osfs_init(void)
 {
     int ret;
 
+    ret = osfs_init_inodecache();
+    if (ret) {
+        pr_err("Failed to create inode cache\n");
+        return ret;
+    }
+
+    ret = osfs_sysfs_init();
+    if (ret) {
+        pr_err("Failed to create /sys/fs/osfs\n");
+        osfs_destroy_inodecache();
+        return ret;
+    }
+
     ret = register_filesystem(&osfs_type);
     if (ret) {
         pr_err("Failed to register filesystem\n");
+        osfs_sysfs_exit();
+        osfs_destroy_inodecache();
         return ret;
     }
 
@@ -80,6 +99,8 @@ static void __exit osfs_exit(void)
         pr_err("Failed to unregister filesystem\n");
     else
         pr_info("osfs: Successfully unregistered\n");
+    osfs_sysfs_exit();
+    osfs_destroy_inodecache();
 }
 
 /**
@@ -88,7 +109,7 @@ static void __exit osfs_exit(void)
  * Inputs:
  *   - fs_type: The file system type structure.
  *   - flags: Mount flags.
- *   - dev_name: Device name (not used in nodev filesystem).
+ *   - dev_name: Block device to mount, or any other name for a memory mount.
  *   - data: Data passed during mount.
  * Returns:
  *   - A dentry pointer to the root of the mounted filesystem.
@@ -98,6 +119,15 @@ static struct dentry *osfs_mount(struct file_system_type *fs_type,
                                  const char *dev_name,
                                  void *data)
 {
+    dev_t dev;
+
+    // A block device path gives a persistent mount, anything else ("none") a memory one
+    if (dev_name && !lookup_bdev(dev_name, &dev)) {
+        // Unlike a memory mount, a device mount is not safe for user namespaces
+        if (!capable(CAP_SYS_ADMIN))
+            return ERR_PTR(-EPERM);
+        return mount_bdev(fs_type, flags, dev_name, data, osfs_fill_super);
+    }
     return mount_nodev(fs_type, flags, data, osfs_fill_super);
 }
 
@@ -115,10 +145,33 @@ static void osfs_kill_superblock(struct super_block *sb)
 
     pr_info("osfs_kill_superblock: Unmounting file system\n");
 
+    // The compression worker must not hold an inode while they are evicted
+    if (sb_info)
+        osfs_compress_stop(sb_info);
+
+    // A mounted filesystem unpins its cached blocks in put_super; a failed mount never gets there
+    if (sb_info && !sb->s_root) {
+        osfs_journal_destroy(sb_info);
+        osfs_block_cache_release(sb_info);
+    }
+
+    if (sb->s_bdev)
+        kill_block_super(sb);
+    else
+        kill_anon_super(sb);
+
     if (sb_info) {
         pr_info("osfs_kill_superblock: free blcok \n");
 
-        vfree(sb_info);
+        osfs_compress_destroy(sb_info);
+        osfs_share_destroy(sb_info);
+        osfs_groups_destroy(sb_info);
+        osfs_data_area_destroy(sb_info);
+        percpu_counter_destroy(&sb_info->nr_free_inodes);
+        percpu_counter_destroy(&sb_info->nr_free_blocks);
+        free_percpu(sb_info->stats);
+        kvfree(sb_info->memory);
+        kfree(sb_info);
         sb->s_fs_info = NULL;
     }
 
@@ -130,4 +183,4 @@ module_exit(osfs_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("OSLAB");
-MODULE_DESCRIPTION("A simple memory-based file system kernel module");
+MODULE_DESCRIPTION("A simple memory-based file system kernel module with an optional block device backing");
@@ -0,0 +1,29 @@
+#ifndef _OSFS_IOCTL_H
+#define _OSFS_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/**
+ * ioctls of osfs regular files, shared with userspace tools such as
+ * bench/osfs_bench.c. A file's extent list is read with the generic
+ * FS_IOC_FIEMAP (filefrag -v).
+ */
+
+/**
+ * Struct: osfs_defrag_info
+ * Description: Result of OSFS_IOC_DEFRAG.
+ */
+struct osfs_defrag_info {
+    __u32 extents_before;               // Extents mapping the file before
+    __u32 extents_after;                // Extents mapping it now
+    __u32 blocks;                       // Data blocks moved, 0 if nothing was done
+    __u32 reserved;
+};
+
+#define OSFS_IOC_MAGIC 'O'
+
+// Moves a file's data into one contiguous run of blocks, if the allocator has one
+#define OSFS_IOC_DEFRAG _IOR(OSFS_IOC_MAGIC, 1, struct osfs_defrag_info)
+
+#endif /* _OSFS_IOCTL_H */
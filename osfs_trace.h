@@ -0,0 +1,203 @@
+/**
+ * Tracepoints of the osfs hot paths, under events/osfs/ in tracefs:
+ *
+ *   echo 1 > /sys/kernel/tracing/events/osfs/enable
+ *
+ * They cost a static branch while disabled, unlike the pr_info calls they
+ * replace. Created in osfs_init.c.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM osfs
+
+#if !defined(_OSFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _OSFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(osfs_alloc_extent,
+    TP_PROTO(struct osfs_sb_info *sb_info, uint32_t ino, uint32_t lblk,
+             uint32_t start, uint32_t count),
+    TP_ARGS(sb_info, ino, lblk, start, count),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(uint32_t, ino)
+        __field(uint32_t, lblk)
+        __field(uint32_t, start)
+        __field(uint32_t, count)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb_info->sb->s_dev;
+        __entry->ino = ino;
+        __entry->lblk = lblk;
+        __entry->start = start;
+        __entry->count = count;
+    ),
+
+    TP_printk("dev %d:%d ino %u lblk %u start %u count %u",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+              __entry->lblk, __entry->start, __entry->count)
+);
+
+TRACE_EVENT(osfs_free_extent,
+    TP_PROTO(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count),
+    TP_ARGS(sb_info, start, count),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(uint32_t, start)
+        __field(uint32_t, count)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb_info->sb->s_dev;
+        __entry->start = start;
+        __entry->count = count;
+    ),
+
+    TP_printk("dev %d:%d start %u count %u",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->start, __entry->count)
+);
+
+TRACE_EVENT(osfs_lookup,
+    TP_PROTO(struct inode *dir, const struct qstr *name, uint32_t ino, bool found),
+    TP_ARGS(dir, name, ino, found),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __string(name, name->name)
+        __field(uint32_t, ino)
+        __field(bool, found)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __assign_str(name, name->name);
+        __entry->ino = found ? ino : 0;
+        __entry->found = found;
+    ),
+
+    TP_printk("dev %d:%d dir %lu name %s %s ino %u",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __get_str(name),
+              __entry->found ? "hit" : "miss", __entry->ino)
+);
+
+TRACE_EVENT(osfs_create,
+    TP_PROTO(struct inode *dir, const struct qstr *name, unsigned long ino),
+    TP_ARGS(dir, name, ino),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __string(name, name->name)
+        __field(unsigned long, ino)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __assign_str(name, name->name);
+        __entry->ino = ino;
+    ),
+
+    TP_printk("dev %d:%d dir %lu name %s ino %lu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __get_str(name),
+              __entry->ino)
+);
+
+DECLARE_EVENT_CLASS(osfs_file_io,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret, bool direct, u64 latency_ns),
+    TP_ARGS(inode, pos, ret, direct, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(loff_t, pos)
+        __field(ssize_t, ret)
+        __field(bool, direct)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->ret = ret;
+        __entry->direct = direct;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("dev %d:%d ino %lu pos %lld ret %zd%s latency %llu ns",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->pos,
+              __entry->ret, __entry->direct ? " direct" : "", __entry->latency_ns)
+);
+
+DEFINE_EVENT(osfs_file_io, osfs_file_read,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret, bool direct, u64 latency_ns),
+    TP_ARGS(inode, pos, ret, direct, latency_ns)
+);
+
+DEFINE_EVENT(osfs_file_io, osfs_file_write,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret, bool direct, u64 latency_ns),
+    TP_ARGS(inode, pos, ret, direct, latency_ns)
+);
+
+TRACE_EVENT(osfs_journal_commit,
+    TP_PROTO(struct osfs_sb_info *sb_info, u64 tid, uint32_t blocks, u64 latency_ns),
+    TP_ARGS(sb_info, tid, blocks, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, tid)
+        __field(uint32_t, blocks)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb_info->sb->s_dev;
+        __entry->tid = tid;
+        __entry->blocks = blocks;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("dev %d:%d tid %llu blocks %u latency %llu ns",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->tid, __entry->blocks,
+              __entry->latency_ns)
+);
+
+TRACE_EVENT(osfs_compress_extent,
+    TP_PROTO(struct osfs_sb_info *sb_info, uint32_t ino, uint32_t lblk, uint32_t count,
+             uint32_t blocks),
+    TP_ARGS(sb_info, ino, lblk, count, blocks),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(uint32_t, ino)
+        __field(uint32_t, lblk)
+        __field(uint32_t, count)
+        __field(uint32_t, blocks)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb_info->sb->s_dev;
+        __entry->ino = ino;
+        __entry->lblk = lblk;
+        __entry->count = count;
+        __entry->blocks = blocks;
+    ),
+
+    TP_printk("dev %d:%d ino %u lblk %u count %u blocks %u",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+              __entry->lblk, __entry->count, __entry->blocks)
+);
+
+#endif /* _OSFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE osfs_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,330 @@
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/rbtree.h>
+#include <linux/mutex.h>
+#include "osfs.h"
+
+/**
+ * Shared data blocks
+ *
+ * A reflink (FICLONE, copy_file_range) maps the same data blocks into more
+ * than one file. The reference count of a block is 1 while it is set in
+ * block_bitmap and listed nowhere else; blocks with more owners are kept in
+ * an rbtree of runs with one count each, so cloning an extent is one update
+ * whatever its length, and a filesystem without clones carries an empty
+ * tree. A block leaves the tree when its count drops back to 1, and goes back
+ * to the allocator when its last owner puts it.
+ *
+ * The counts are not stored on the device: a block device mount rebuilds
+ * them from the extent trees (osfs_share_rebuild).
+ *
+ * Blocks of a file only become shared by a clone, which holds that file's
+ * extent lock. A caller putting blocks holds the lock of the file they came
+ * from, so it sees an empty tree only when none of them can be shared, and
+ * frees them without taking share_lock.
+ */
+
+/**
+ * Struct: osfs_shared_run
+ * Description: A run of data blocks with the same number of owners.
+ */
+struct osfs_shared_run {
+    struct rb_node node;
+    uint32_t start;              // First block of the run
+    uint32_t len;                // Number of blocks in the run
+    uint32_t refs;               // Files mapping each block, at least 2
+};
+
+#define to_shared_run(n) rb_entry_safe(n, struct osfs_shared_run, node)
+
+static inline uint32_t osfs_shared_end(const struct osfs_shared_run *run)
+{
+    return run->start + run->len;
+}
+
+// First run that ends past @block; runs never overlap, so their ends are sorted too
+static struct osfs_shared_run *osfs_share_first(struct osfs_sb_info *sb_info, uint32_t block)
+{
+    struct rb_node *node = sb_info->shared_runs.rb_node;
+    struct osfs_shared_run *run, *best = NULL;
+
+    while (node) {
+        run = to_shared_run(node);
+        if (osfs_shared_end(run) > block) {
+            best = run;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+    return best;
+}
+
+static struct osfs_shared_run *osfs_share_add(struct osfs_sb_info *sb_info, uint32_t start,
+                                              uint32_t len, uint32_t refs)
+{
+    struct rb_node **link = &sb_info->shared_runs.rb_node, *parent = NULL;
+    struct osfs_shared_run *run = kmalloc(sizeof(*run), GFP_NOFS | __GFP_NOFAIL);
+
+    run->start = start;
+    run->len = len;
+    run->refs = refs;
+    while (*link) {
+        parent = *link;
+        if (start < to_shared_run(parent)->start)
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+    rb_link_node(&run->node, parent, link);
+    rb_insert_color(&run->node, &sb_info->shared_runs);
+    return run;
+}
+
+static void osfs_share_erase(struct osfs_sb_info *sb_info, struct osfs_shared_run *run)
+{
+    rb_erase(&run->node, &sb_info->shared_runs);
+    kfree(run);
+}
+
+// Cuts the run containing @block in two, so that a run starts at @block
+static void osfs_share_split(struct osfs_sb_info *sb_info, uint32_t block)
+{
+    struct osfs_shared_run *run = osfs_share_first(sb_info, block);
+
+    if (!run || run->start >= block)
+        return;
+    osfs_share_add(sb_info, block, osfs_shared_end(run) - block, run->refs);
+    run->len = block - run->start;
+}
+
+// Joins back the runs around [@start, @end) that continue each other with the same count
+static void osfs_share_merge(struct osfs_sb_info *sb_info, uint32_t start, uint32_t end)
+{
+    struct osfs_shared_run *run, *next;
+
+    run = osfs_share_first(sb_info, start ? start - 1 : 0);
+    while (run && run->start <= end) {
+        next = to_shared_run(rb_next(&run->node));
+        if (!next)
+            break;
+        if (osfs_shared_end(run) == next->start && run->refs == next->refs) {
+            run->len += next->len;
+            osfs_share_erase(sb_info, next);
+            continue;
+        }
+        run = next;
+    }
+}
+
+/**
+ * Function: osfs_share_get
+ * Description: Adds an owner to every block of a run, as a clone maps it into
+ *              one more file. The blocks are in use by at least one file.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block of the run.
+ *   - count: Number of blocks in the run.
+ * Returns:
+ *   - None.
+ */
+void osfs_share_get(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count)
+{
+    struct osfs_shared_run *run;
+    uint32_t block = start, end = start + count;
+
+    if (!count)
+        return;
+
+    mutex_lock(&sb_info->share_lock);
+    osfs_share_split(sb_info, start);
+    osfs_share_split(sb_info, end);
+
+    // Every run met now lies inside the range; the gaps between them had one owner
+    run = osfs_share_first(sb_info, start);
+    while (block < end) {
+        if (!run || run->start >= end) {
+            osfs_share_add(sb_info, block, end - block, 2);
+            break;
+        }
+        if (run->start > block)
+            osfs_share_add(sb_info, block, run->start - block, 2);
+        run->refs++;
+        block = osfs_shared_end(run);
+        run = to_shared_run(rb_next(&run->node));
+    }
+
+    osfs_share_merge(sb_info, start, end);
+    mutex_unlock(&sb_info->share_lock);
+}
+
+/**
+ * Function: osfs_share_put
+ * Description: Drops an owner from every block of a run, as a file unmaps
+ *              it. Blocks nobody else owns go back to the allocator with
+ *              osfs_free_blocks; this is how every data extent is freed.
+ *              The caller holds the extent lock of the file the run is
+ *              unmapped from.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block of the run.
+ *   - count: Number of blocks in the run.
+ * Returns:
+ *   - None.
+ */
+void osfs_share_put(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count)
+{
+    struct osfs_shared_run *run, *next;
+    uint32_t block = start, end = start + count, gap_end;
+
+    if (!count)
+        return;
+    if (RB_EMPTY_ROOT(&sb_info->shared_runs)) {
+        osfs_free_blocks(sb_info, start, count);
+        return;
+    }
+
+    mutex_lock(&sb_info->share_lock);
+    osfs_share_split(sb_info, start);
+    osfs_share_split(sb_info, end);
+
+    run = osfs_share_first(sb_info, start);
+    while (block < end) {
+        gap_end = (!run || run->start >= end) ? end : run->start;
+        if (gap_end > block)
+            osfs_free_blocks(sb_info, block, gap_end - block);
+        if (gap_end == end)
+            break;
+
+        block = osfs_shared_end(run);
+        next = to_shared_run(rb_next(&run->node));
+        if (--run->refs == 1)
+            osfs_share_erase(sb_info, run);
+        run = next;
+    }
+
+    osfs_share_merge(sb_info, start, end);
+    mutex_unlock(&sb_info->share_lock);
+}
+
+/**
+ * Function: osfs_share_find
+ * Description: Finds the first blocks of a run that are shared, for a write
+ *              that has to copy them first.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: First block of the run.
+ *   - count: Number of blocks in the run.
+ *   - found: Set to the first shared block of the run.
+ *   - found_len: Set to the number of shared blocks from *found on.
+ * Returns:
+ *   - true if any block of the run is shared, false if none is.
+ */
+bool osfs_share_find(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count,
+                     uint32_t *found, uint32_t *found_len)
+{
+    struct osfs_shared_run *run;
+    uint32_t end = start + count, last;
+
+    if (!count || RB_EMPTY_ROOT(&sb_info->shared_runs))
+        return false;
+
+    mutex_lock(&sb_info->share_lock);
+    run = osfs_share_first(sb_info, start);
+    if (!run || run->start >= end) {
+        mutex_unlock(&sb_info->share_lock);
+        return false;
+    }
+
+    *found = max(start, run->start);
+    last = osfs_shared_end(run);
+    for (run = to_shared_run(rb_next(&run->node)); run && run->start == last && last < end;
+         run = to_shared_run(rb_next(&run->node)))
+        last = osfs_shared_end(run);
+    *found_len = min(end, last) - *found;
+    mutex_unlock(&sb_info->share_lock);
+    return true;
+}
+
+/**
+ * Function: osfs_share_rebuild
+ * Description: Recomputes the shared runs of a block device mount from the
+ *              extent trees of its regular files. A bitmap of the blocks seen
+ *              so far finds the ones mapped again, run by run.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the bitmap cannot be allocated.
+ *   - -EIO if an inode or extent tree cannot be read.
+ */
+int osfs_share_rebuild(struct osfs_sb_info *sb_info)
+{
+    struct osfs_inode *raw;
+    struct osfs_extent ext;
+    unsigned long *seen;
+    unsigned long ino, block, end, run_end;
+    uint32_t lblk;
+    int ret = 0;
+
+    seen = kvcalloc(BLOCK_BITMAP_SIZE(sb_info), sizeof(unsigned long), GFP_KERNEL);
+    if (!seen)
+        return -ENOMEM;
+
+    ino = ROOT_INODE;
+    for_each_set_bit_from(ino, sb_info->inode_bitmap, sb_info->inode_count) {
+        raw = osfs_get_osfs_inode(sb_info->sb, ino);
+        if (!raw) {
+            ret = -EIO;
+            break;
+        }
+        if (!S_ISREG(raw->i_mode) || osfs_inode_is_inline(raw))
+            continue;
+
+        for (lblk = 0; !(ret = osfs_ext_next(sb_info, raw, lblk, &ext));
+             lblk = ext.logical_block + ext.block_count) {
+            block = osfs_ext_pblk(&ext);
+            end = block + ext.block_count;
+            if (end > sb_info->block_count) {
+                pr_err("osfs_share_rebuild: Inode %lu maps blocks past the data area\n", ino);
+                ret = -EIO;
+                break;
+            }
+            for (block = find_next_bit(seen, end, block); block < end;
+                 block = find_next_bit(seen, end, run_end)) {
+                run_end = find_next_zero_bit(seen, end, block);
+                osfs_share_get(sb_info, block, run_end - block);
+            }
+            bitmap_set(seen, osfs_ext_pblk(&ext), ext.block_count);
+        }
+        if (ret != -ENOENT)
+            break;
+        ret = 0;
+    }
+
+    kvfree(seen);
+    return ret;
+}
+
+/**
+ * Function: osfs_share_init
+ * Description: Starts a mount with no shared blocks.
+ */
+void osfs_share_init(struct osfs_sb_info *sb_info)
+{
+    sb_info->shared_runs = RB_ROOT;
+    mutex_init(&sb_info->share_lock);
+}
+
+/**
+ * Function: osfs_share_destroy
+ * Description: Frees the shared runs at unmount.
+ */
+void osfs_share_destroy(struct osfs_sb_info *sb_info)
+{
+    struct osfs_shared_run *run, *tmp;
+
+    rbtree_postorder_for_each_entry_safe(run, tmp, &sb_info->shared_runs, node)
+        kfree(run);
+    sb_info->shared_runs = RB_ROOT;
+}
@@ -1,33 +1,692 @@
 #include <linux/fs.h>
 #include <linux/pagemap.h>
 #include <linux/slab.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/overflow.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/cred.h>
 #include "osfs.h"
 
+static int osfs_show_options(struct seq_file *m, struct dentry *root);
+static int osfs_sync_fs(struct super_block *sb, int wait);
+static void osfs_put_super(struct super_block *sb);
+static int osfs_statfs(struct dentry *dentry, struct kstatfs *buf);
+
+static struct kmem_cache *osfs_inode_cachep;
+
+/**
+ * Function: osfs_alloc_inode
+ * Description: Allocates an in-memory inode from the osfs inode cache.
+ * Inputs:
+ *   - sb: The superblock the inode belongs to.
+ * Returns:
+ *   - The embedded VFS inode, or NULL if the allocation fails.
+ */
+static struct inode *osfs_alloc_inode(struct super_block *sb)
+{
+    struct osfs_inode_info *oi;
+
+    oi = alloc_inode_sb(sb, osfs_inode_cachep, GFP_KERNEL);
+    if (!oi)
+        return NULL;
+
+    oi->raw = NULL;
+    oi->i_dir_index = NULL;
+    oi->i_sync_tid = 0;
+    memset(&oi->i_ext_cache, 0, sizeof(oi->i_ext_cache));
+    return &oi->vfs_inode;
+}
+
+/**
+ * Function: osfs_free_inode
+ * Description: Returns an in-memory inode to the osfs inode cache once the
+ *              RCU grace period after its destruction has passed.
+ */
+static void osfs_free_inode(struct inode *inode)
+{
+    kmem_cache_free(osfs_inode_cachep, OSFS_I(inode));
+}
+
 /**
  * Struct: osfs_super_ops
  * Description: Defines the superblock operations for the osfs filesystem.
  */
 const struct super_operations osfs_super_ops = {
-    .statfs = simple_statfs,            // Provides filesystem statistics
-    .drop_inode = generic_delete_inode, // Generic inode deletion
+    .statfs = osfs_statfs,              // Provides filesystem statistics
+    .alloc_inode = osfs_alloc_inode,
+    .free_inode = osfs_free_inode,
+    .drop_inode = generic_drop_inode,   // Keep unused inodes cached while they have links
     .destroy_inode = osfs_destroy_inode,
+    .dirty_inode = osfs_dirty_inode,
+    .write_inode = osfs_write_inode,
+    .evict_inode = osfs_evict_inode,
+    .sync_fs = osfs_sync_fs,
+    .put_super = osfs_put_super,
+    .show_options = osfs_show_options,
 
 };
 
+/**
+ * Function: osfs_statfs
+ * Description: Reports block and inode usage from the free counters, so that
+ *              df shows how much space files actually take.
+ * Inputs:
+ *   - dentry: Any dentry of the filesystem.
+ *   - buf: The statistics to fill in.
+ * Returns:
+ *   - 0.
+ */
+static int osfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+    struct osfs_sb_info *sb_info = dentry->d_sb->s_fs_info;
+
+    buf->f_type = OSFS_MAGIC;
+    buf->f_bsize = BLOCK_SIZE;
+    buf->f_blocks = sb_info->block_count;
+    buf->f_bfree = percpu_counter_sum_positive(&sb_info->nr_free_blocks);
+    buf->f_bavail = buf->f_bfree;
+    buf->f_files = sb_info->inode_count;
+    buf->f_ffree = percpu_counter_sum_positive(&sb_info->nr_free_inodes);
+    buf->f_namelen = MAX_FILENAME_LEN;
+    return 0;
+}
+
+/**
+ * Function: osfs_destroy_inode
+ * Description: Releases what an in-memory inode built up while it was in use;
+ *              the inode itself is freed later by osfs_free_inode.
+ */
 void osfs_destroy_inode(struct inode *inode)
 {
-    if (inode->i_private) {
-        inode->i_private = NULL;
+    if (S_ISDIR(inode->i_mode))
+        osfs_dir_index_release(inode);
+}
+
+static void osfs_inode_init_once(void *obj)
+{
+    struct osfs_inode_info *oi = obj;
+
+    init_rwsem(&oi->i_extent_sem);
+    seqlock_init(&oi->i_ext_cache_lock);
+    // osfs_compress_forget leaves it empty again before the inode is freed
+    INIT_LIST_HEAD(&oi->i_compress_list);
+    inode_init_once(&oi->vfs_inode);
+}
+
+/**
+ * Function: osfs_init_inodecache
+ * Description: Creates the slab cache osfs_inode_info objects come from.
+ * Returns:
+ *   - 0 on success, -ENOMEM on failure.
+ */
+int osfs_init_inodecache(void)
+{
+    osfs_inode_cachep = kmem_cache_create("osfs_inode_cache", sizeof(struct osfs_inode_info), 0,
+                                          SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT,
+                                          osfs_inode_init_once);
+    return osfs_inode_cachep ? 0 : -ENOMEM;
+}
+
+void osfs_destroy_inodecache(void)
+{
+    // Make sure every delayed osfs_free_inode has run before the cache goes away
+    rcu_barrier();
+    kmem_cache_destroy(osfs_inode_cachep);
+}
+
+
+/**
+ * Function: osfs_show_options
+ * Description: Reports the mount geometry in /proc/mounts.
+ * Inputs:
+ *   - m: The seq_file to print into.
+ *   - root: The root dentry of the mount.
+ * Returns:
+ *   - 0 always.
+ */
+static int osfs_show_options(struct seq_file *m, struct dentry *root)
+{
+    struct osfs_sb_info *sb_info = root->d_sb->s_fs_info;
+
+    seq_printf(m, ",inodes=%u,blocks=%u", sb_info->inode_count, sb_info->block_count);
+    if (sb_info->mem_mode == OSFS_MEM_HUGE)
+        seq_puts(m, ",mem=huge");
+    else if (sb_info->mem_mode == OSFS_MEM_SPARSE)
+        seq_puts(m, ",mem=sparse");
+    if (sb_info->compress)
+        seq_puts(m, ",compress");
+    osfs_journal_show_options(m, sb_info);
+    return 0;
+}
+
+enum {
+    Opt_inodes,
+    Opt_blocks,
+    Opt_format,
+    Opt_mem_vmalloc,
+    Opt_mem_huge,
+    Opt_mem_sparse,
+    Opt_journal,
+    Opt_commit,
+    Opt_compress,
+    Opt_err,
+};
+
+static const match_table_t osfs_tokens = {
+    {Opt_inodes, "inodes=%u"},
+    {Opt_blocks, "blocks=%u"},
+    {Opt_format, "format"},
+    {Opt_mem_vmalloc, "mem=vmalloc"},
+    {Opt_mem_huge, "mem=huge"},
+    {Opt_mem_sparse, "mem=sparse"},
+    {Opt_journal, "journal=%u"},
+    {Opt_commit, "commit=%u"},
+    {Opt_compress, "compress"},
+    {Opt_err, NULL},
+};
+
+/**
+ * Function: osfs_parse_options
+ * Description: Parses the comma separated mount option string
+ *              ("inodes=N,blocks=M,format,mem=vmalloc|huge|sparse,journal=J,commit=S,
+ *              compress").
+ * Inputs:
+ *   - options: The option string passed to mount (may be NULL).
+ *   - opts: Filled with the requested geometry; defaults are kept for
+ *           options that are not given.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if an option is unknown or out of range.
+ */
+static int osfs_parse_options(char *options, struct osfs_mount_opts *opts)
+{
+    substring_t args[MAX_OPT_ARGS];
+    unsigned int value;
+    char *p;
+
+    opts->inode_count = OSFS_DEFAULT_INODE_COUNT;
+    opts->block_count = 0;
+    opts->format = false;
+    opts->mem_mode = OSFS_MEM_VMALLOC;
+    opts->journal_blocks = U32_MAX;
+    opts->commit_interval = 0;
+    opts->compress = false;
+
+    if (!options)
+        return 0;
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+
+        switch (match_token(p, osfs_tokens, args)) {
+        case Opt_inodes:
+            if (match_uint(&args[0], &value))
+                return -EINVAL;
+            if (value < OSFS_MIN_INODE_COUNT || value > OSFS_MAX_INODE_COUNT) {
+                pr_err("osfs: inodes=%u out of range [%u, %u]\n",
+                       value, OSFS_MIN_INODE_COUNT, OSFS_MAX_INODE_COUNT);
+                return -EINVAL;
+            }
+            opts->inode_count = value;
+            break;
+        case Opt_blocks:
+            if (match_uint(&args[0], &value))
+                return -EINVAL;
+            if (value == 0 || value > OSFS_MAX_BLOCK_COUNT) {
+                pr_err("osfs: blocks=%u out of range [1, %u]\n",
+                       value, OSFS_MAX_BLOCK_COUNT);
+                return -EINVAL;
+            }
+            opts->block_count = value;
+            break;
+        case Opt_format:
+            opts->format = true;
+            break;
+        case Opt_mem_vmalloc:
+            opts->mem_mode = OSFS_MEM_VMALLOC;
+            break;
+        case Opt_mem_huge:
+            opts->mem_mode = OSFS_MEM_HUGE;
+            break;
+        case Opt_mem_sparse:
+            opts->mem_mode = OSFS_MEM_SPARSE;
+            break;
+        case Opt_journal:
+            if (match_uint(&args[0], &value))
+                return -EINVAL;
+            if (value && (value < OSFS_MIN_JOURNAL_BLOCKS || value > OSFS_MAX_JOURNAL_BLOCKS)) {
+                pr_err("osfs: journal=%u out of range [%u, %u], or 0 for none\n",
+                       value, OSFS_MIN_JOURNAL_BLOCKS, OSFS_MAX_JOURNAL_BLOCKS);
+                return -EINVAL;
+            }
+            opts->journal_blocks = value;
+            break;
+        case Opt_commit:
+            if (match_uint(&args[0], &value))
+                return -EINVAL;
+            if (value == 0 || value > 3600) {
+                pr_err("osfs: commit=%u out of range [1, 3600]\n", value);
+                return -EINVAL;
+            }
+            opts->commit_interval = value;
+            break;
+        case Opt_compress:
+            opts->compress = true;
+            break;
+        default:
+            pr_err("osfs: Unrecognized mount option '%s'\n", p);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Function: osfs_bitmap_blocks
+ * Description: Returns the number of device blocks a bitmap of @bits needs.
+ */
+static inline uint32_t osfs_bitmap_blocks(uint32_t bits)
+{
+    return DIV_ROUND_UP(BITMAP_SIZE(bits) * sizeof(unsigned long), BLOCK_SIZE);
+}
+
+/**
+ * Function: osfs_disk_layout
+ * Description: Places the areas of a block device filesystem one after the
+ *              other, from the inode, block and journal block counts of @dsb.
+ */
+static void osfs_disk_layout(struct osfs_super_block *dsb)
+{
+    uint32_t table_end;
+
+    dsb->s_inode_bitmap_start = OSFS_SUPER_BLOCK + 1;
+    dsb->s_block_bitmap_start = dsb->s_inode_bitmap_start + osfs_bitmap_blocks(dsb->s_inode_count);
+    dsb->s_inode_table_start = dsb->s_block_bitmap_start + osfs_bitmap_blocks(dsb->s_block_count);
+    table_end = dsb->s_inode_table_start + DIV_ROUND_UP(dsb->s_inode_count, OSFS_INODES_PER_BLOCK);
+    dsb->s_journal_start = dsb->s_journal_blocks ? table_end : 0;
+    dsb->s_data_start = table_end + dsb->s_journal_blocks;
+}
+
+/**
+ * Function: osfs_format
+ * Description: Writes an empty filesystem to the device: the superblock,
+ *              zeroed bitmaps and inode table and an empty journal. The data
+ *              blocks are left as they are; they are cleared when allocated.
+ *              Without blocks=, the data area takes the rest of the device;
+ *              without journal=, the journal takes 1/16 of it up to
+ *              OSFS_DEFAULT_JOURNAL_BLOCKS.
+ * Inputs:
+ *   - sb: The superblock of the mount.
+ *   - opts: The requested geometry.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if the device is too small for the geometry.
+ *   - -ENOMEM if a buffer cannot be allocated, -EIO if it cannot be written.
+ */
+static int osfs_format(struct super_block *sb, const struct osfs_mount_opts *opts)
+{
+    uint64_t dev_blocks = bdev_nr_bytes(sb->s_bdev) >> BLOCK_SIZE_BITS;
+    struct osfs_super_block dsb = {
+        .s_magic = OSFS_MAGIC,
+        .s_block_size = BLOCK_SIZE,
+        .s_inode_count = opts->inode_count,
+    };
+    struct buffer_head *bh;
+    sector_t nr;
+    int ret;
+
+    dsb.s_journal_blocks = opts->journal_blocks;
+    if (dsb.s_journal_blocks == U32_MAX) {
+        dsb.s_journal_blocks = min_t(uint64_t, dev_blocks / 16, OSFS_DEFAULT_JOURNAL_BLOCKS);
+        if (dsb.s_journal_blocks < OSFS_MIN_JOURNAL_BLOCKS)
+            dsb.s_journal_blocks = 0;
+    }
+    dsb.s_block_count = opts->block_count ?:
+                        (uint32_t)min_t(uint64_t, dev_blocks, OSFS_MAX_BLOCK_COUNT);
+    osfs_disk_layout(&dsb);
+    if (!opts->block_count && dsb.s_data_start < dev_blocks) {
+        // Fewer data blocks shrink the block bitmap, so the data area still fits
+        dsb.s_block_count = min_t(uint64_t, dsb.s_block_count, dev_blocks - dsb.s_data_start);
+        osfs_disk_layout(&dsb);
     }
+    if (!dsb.s_block_count || (uint64_t)dsb.s_data_start + dsb.s_block_count > dev_blocks) {
+        pr_err("osfs_format: Device of %llu blocks is too small for %u inodes and %u blocks\n",
+               dev_blocks, dsb.s_inode_count, dsb.s_block_count);
+        return -ENOSPC;
+    }
+
+    for (nr = OSFS_SUPER_BLOCK; nr < dsb.s_data_start; nr++) {
+        bh = sb_getblk(sb, nr);
+        if (!bh)
+            return -ENOMEM;
+        lock_buffer(bh);
+        memset(bh->b_data, 0, bh->b_size);
+        if (nr == OSFS_SUPER_BLOCK)
+            memcpy(bh->b_data, &dsb, sizeof(dsb));
+        else if (dsb.s_journal_blocks && nr == dsb.s_journal_start)
+            osfs_journal_format(bh->b_data);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+        brelse(bh);
+    }
+
+    // The journal writes around the buffer cache, so the new filesystem has to be on disk first
+    ret = sync_blockdev(sb->s_bdev);
+    if (ret)
+        return ret;
+
+    pr_info("osfs_format: %u inodes, %u data blocks starting at device block %u, %u journal blocks\n",
+            dsb.s_inode_count, dsb.s_block_count, dsb.s_data_start, dsb.s_journal_blocks);
+    return 0;
 }
 
+/**
+ * Function: osfs_check_super
+ * Description: Validates the superblock read from a device.
+ * Inputs:
+ *   - sb: The superblock of the mount.
+ *   - dsb: The on-disk superblock.
+ *   - silent: If non-zero, do not report a missing magic number.
+ * Returns:
+ *   - 0 if the superblock describes a usable filesystem.
+ *   - -EINVAL otherwise.
+ */
+static int osfs_check_super(struct super_block *sb, const struct osfs_super_block *dsb, int silent)
+{
+    uint64_t dev_blocks = bdev_nr_bytes(sb->s_bdev) >> BLOCK_SIZE_BITS;
+    struct osfs_super_block expect = *dsb;
+
+    if (dsb->s_magic != OSFS_MAGIC) {
+        if (!silent)
+            pr_err("osfs: No osfs filesystem on %s (mount with -o format to create one)\n",
+                   sb->s_id);
+        return -EINVAL;
+    }
+    if (dsb->s_block_size != BLOCK_SIZE ||
+        dsb->s_inode_count < OSFS_MIN_INODE_COUNT || dsb->s_inode_count > OSFS_MAX_INODE_COUNT ||
+        !dsb->s_block_count || dsb->s_block_count > OSFS_MAX_BLOCK_COUNT ||
+        (dsb->s_journal_blocks && (dsb->s_journal_blocks < OSFS_MIN_JOURNAL_BLOCKS ||
+                                   dsb->s_journal_blocks > OSFS_MAX_JOURNAL_BLOCKS))) {
+        pr_err("osfs: Bad geometry in superblock of %s\n", sb->s_id);
+        return -EINVAL;
+    }
+
+    osfs_disk_layout(&expect);
+    if (memcmp(&expect, dsb, sizeof(expect)) ||
+        (uint64_t)dsb->s_data_start + dsb->s_block_count > dev_blocks) {
+        pr_err("osfs: Superblock layout of %s does not match the device\n", sb->s_id);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_read_bitmap
+ * Description: Loads a bitmap from consecutive device blocks into memory.
+ * Returns:
+ *   - 0 on success, -EIO if a block cannot be read.
+ */
+static int osfs_read_bitmap(struct super_block *sb, sector_t start, void *bitmap, size_t bytes)
+{
+    struct buffer_head *bh;
+    size_t done, chunk;
+
+    for (done = 0; done < bytes; done += chunk, start++) {
+        chunk = min_t(size_t, bytes - done, BLOCK_SIZE);
+        bh = sb_bread(sb, start);
+        if (!bh)
+            return -EIO;
+        memcpy(bitmap + done, bh->b_data, chunk);
+        brelse(bh);
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_write_bitmap
+ * Description: Copies an in-memory bitmap into its device blocks and marks
+ *              them dirty. The bitmap is copied without the group locks: a
+ *              concurrent allocation is caught by the next sync, and at
+ *              unmount nothing runs concurrently.
+ */
+static void osfs_write_bitmap(struct osfs_sb_info *sb_info, sector_t start, const void *bitmap,
+                              size_t bytes)
+{
+    struct buffer_head *bh;
+    size_t done, chunk;
+
+    for (done = 0; done < bytes; done += chunk, start++) {
+        chunk = min_t(size_t, bytes - done, BLOCK_SIZE);
+        bh = osfs_disk_bh(sb_info, start, true);
+        if (!bh) {
+            pr_err("osfs_write_bitmap: Lost update of device block %llu\n",
+                   (unsigned long long)start);
+            continue;
+        }
+        lock_buffer(bh);
+        memcpy(bh->b_data, bitmap + done, chunk);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+    }
+}
+
+/**
+ * Function: osfs_write_bitmaps
+ * Description: Copies the inode and block bitmaps of a block device mount
+ *              into their device blocks with osfs_write_bitmap; writing those
+ *              blocks out is left to the caller.
+ */
+void osfs_write_bitmaps(struct osfs_sb_info *sb_info)
+{
+    osfs_write_bitmap(sb_info, sb_info->disk.s_inode_bitmap_start, sb_info->inode_bitmap,
+                      INODE_BITMAP_SIZE(sb_info) * sizeof(unsigned long));
+    osfs_write_bitmap(sb_info, sb_info->disk.s_block_bitmap_start, sb_info->block_bitmap,
+                      BLOCK_BITMAP_SIZE(sb_info) * sizeof(unsigned long));
+}
+
+/**
+ * Function: osfs_sync_fs
+ * Description: Moves the bitmaps into their device blocks; sync_filesystem
+ *              then writes the block device out. Inodes are written through
+ *              osfs_write_inode and data blocks by osfs_write_folio.
+ *              With a journal, the waiting pass commits the running
+ *              transaction instead, which writes the data out first.
+ */
+static int osfs_sync_fs(struct super_block *sb, int wait)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+
+    if (sb_info->journal)
+        return wait ? osfs_journal_commit(sb_info, osfs_journal_tid(sb_info)) : 0;
+    if (osfs_on_bdev(sb_info))
+        osfs_write_bitmaps(sb_info);
+    return 0;
+}
+
+/**
+ * Function: osfs_put_super
+ * Description: Writes the bitmaps, or commits the journal, a last time and
+ *              unpins the cached device blocks once every inode has been
+ *              evicted.
+ */
+static void osfs_put_super(struct super_block *sb)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+
+    osfs_sysfs_unregister(sb_info);
+    if (sb_info->journal) {
+        osfs_journal_commit(sb_info, osfs_journal_tid(sb_info));
+        osfs_journal_destroy(sb_info);
+    } else if (osfs_on_bdev(sb_info)) {
+        osfs_write_bitmaps(sb_info);
+    }
+    osfs_block_cache_release(sb_info);
+}
+
+/**
+ * Function: osfs_setup_memory
+ * Description: Allocates the vmalloc region of a memory mount and partitions
+ *              it into the bitmaps, the inode table and, for mem=vmalloc, the
+ *              data area. The other modes back the data area in chunks.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if the geometry overflows, -ENOMEM if the memory cannot be allocated.
+ */
+static int osfs_setup_memory(struct osfs_sb_info *sb_info, const struct osfs_mount_opts *opts)
+{
+    size_t inode_bitmap_bytes, block_bitmap_bytes, inode_table_bytes, data_bytes;
+    size_t total_memory_size;
+
+    sb_info->inode_count = opts->inode_count;
+    sb_info->block_count = opts->block_count ?: OSFS_DEFAULT_BLOCK_COUNT;
+    sb_info->mem_mode = opts->mem_mode;
+
+    // Calculate total memory size required for the requested geometry
+    inode_bitmap_bytes = array_size(INODE_BITMAP_SIZE(sb_info), sizeof(unsigned long));
+    block_bitmap_bytes = array_size(BLOCK_BITMAP_SIZE(sb_info), sizeof(unsigned long));
+    inode_table_bytes = array_size(sb_info->inode_count, sizeof(struct osfs_inode));
+    data_bytes = sb_info->mem_mode == OSFS_MEM_VMALLOC ?
+                 array_size(sb_info->block_count, BLOCK_SIZE) : 0;
+    total_memory_size = size_add(size_add(inode_bitmap_bytes, block_bitmap_bytes),
+                                 size_add(inode_table_bytes, data_bytes));
+    if (total_memory_size == SIZE_MAX)
+        return -EINVAL;
+
+    // Allocate zeroed memory for the bitmaps, the inode table and the data blocks
+    sb_info->memory = vzalloc(total_memory_size);
+    if (!sb_info->memory)
+        return -ENOMEM;
+
+    // Partition the memory region into respective components
+    sb_info->inode_bitmap = sb_info->memory;
+    sb_info->block_bitmap = sb_info->inode_bitmap + INODE_BITMAP_SIZE(sb_info);
+    sb_info->inode_table = (void *)(sb_info->block_bitmap + BLOCK_BITMAP_SIZE(sb_info));
+    if (sb_info->mem_mode != OSFS_MEM_VMALLOC)
+        return osfs_data_area_init(sb_info);
+    sb_info->data_blocks = (void *)((char *)sb_info->inode_table + inode_table_bytes);
+    return 0;
+}
+
+/**
+ * Function: osfs_setup_bdev
+ * Description: Opens the filesystem on the mounted block device, formatting
+ *              it first when asked to, and replays its journal. Only the
+ *              superblock and the bitmaps are read here; inodes and data
+ *              blocks are read on first use.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if the device holds no valid osfs filesystem.
+ *   - -ENOMEM or -EIO on failure.
+ */
+static int osfs_setup_bdev(struct super_block *sb, struct osfs_sb_info *sb_info,
+                           const struct osfs_mount_opts *opts, int silent)
+{
+    struct buffer_head *bh;
+    size_t inode_bitmap_bytes;
+    int ret;
+
+    if (!sb_set_blocksize(sb, BLOCK_SIZE)) {
+        pr_err("osfs: Device %s does not support %u byte blocks\n", sb->s_id, BLOCK_SIZE);
+        return -EINVAL;
+    }
+
+    if (opts->format) {
+        ret = osfs_format(sb, opts);
+        if (ret)
+            return ret;
+    }
+
+    bh = sb_bread(sb, OSFS_SUPER_BLOCK);
+    if (!bh)
+        return -EIO;
+    memcpy(&sb_info->disk, bh->b_data, sizeof(sb_info->disk));
+    brelse(bh);
+
+    ret = osfs_check_super(sb, &sb_info->disk, silent);
+    if (ret)
+        return ret;
+    sb_info->inode_count = sb_info->disk.s_inode_count;
+    sb_info->block_count = sb_info->disk.s_block_count;
+
+    if (!sb_info->disk.s_journal_blocks && opts->commit_interval) {
+        pr_err("osfs: commit= needs a journal and %s has none\n", sb->s_id);
+        return -EINVAL;
+    }
+    ret = osfs_journal_load(sb_info, opts);
+    if (ret)
+        return ret;
+
+    inode_bitmap_bytes = INODE_BITMAP_SIZE(sb_info) * sizeof(unsigned long);
+    sb_info->memory = kvzalloc(inode_bitmap_bytes +
+                               BLOCK_BITMAP_SIZE(sb_info) * sizeof(unsigned long), GFP_KERNEL);
+    if (!sb_info->memory)
+        return -ENOMEM;
+    sb_info->inode_bitmap = sb_info->memory;
+    sb_info->block_bitmap = sb_info->inode_bitmap + INODE_BITMAP_SIZE(sb_info);
+
+    ret = osfs_read_bitmap(sb, sb_info->disk.s_inode_bitmap_start, sb_info->inode_bitmap,
+                           inode_bitmap_bytes);
+    if (!ret)
+        ret = osfs_read_bitmap(sb, sb_info->disk.s_block_bitmap_start, sb_info->block_bitmap,
+                               BLOCK_BITMAP_SIZE(sb_info) * sizeof(unsigned long));
+    return ret;
+}
+
+/**
+ * Function: osfs_init_root
+ * Description: Sets up the root directory of a new filesystem in the inode
+ *              table and marks inode 0 and the root as used.
+ * Returns:
+ *   - 0 on success, -EIO if the root inode cannot be read.
+ */
+static int osfs_init_root(struct super_block *sb)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct osfs_inode *root_osfs_inode = osfs_get_osfs_inode(sb, ROOT_INODE);
+    struct buffer_head *bh;
+
+    if (!root_osfs_inode)
+        return -EIO;
+
+    // Inode 0 is reserved and inode 1 is the root directory
+    set_bit(0, sb_info->inode_bitmap);
+    set_bit(ROOT_INODE, sb_info->inode_bitmap);
+    osfs_journal_bits(sb_info, true, 0, ROOT_INODE + 1);
+
+    memset(root_osfs_inode, 0, sizeof(*root_osfs_inode));
+    root_osfs_inode->i_ino = ROOT_INODE;
+    osfs_ext_init(root_osfs_inode);
+    root_osfs_inode->i_mode = S_IFDIR | 0755;
+    root_osfs_inode->i_links_count = 2;
+    root_osfs_inode->i_uid = from_kuid_munged(sb->s_user_ns, current_fsuid());
+    root_osfs_inode->i_gid = from_kgid_munged(sb->s_user_ns, current_fsgid());
+    ktime_get_coarse_real_ts64(&root_osfs_inode->__i_atime);
+    root_osfs_inode->__i_mtime = root_osfs_inode->__i_ctime = root_osfs_inode->__i_atime;
+
+    if (osfs_on_bdev(sb_info)) {
+        bh = osfs_disk_bh(sb_info, sb_info->disk.s_inode_table_start +
+                          ROOT_INODE / OSFS_INODES_PER_BLOCK, false);
+        if (!bh)
+            return -EIO;
+        osfs_journal_dirty(sb_info, bh);
+    }
+    return 0;
+}
 
 /**
  * Function: osfs_fill_super
  * Description: Initializes the superblock with filesystem-specific information during mount.
+ *              Without a block device the filesystem lives in a vmalloc region
+ *              and starts out empty; on a block device it is read from the
+ *              device and persists across mounts.
  * Inputs:
  *   - sb: The superblock to be filled.
- *   - data: Data passed during mount.
+ *   - data: Mount option string ("inodes=N,blocks=M,format").
  *   - silent: If non-zero, suppress certain error messages.
  * Returns:
  *   - 0 on successful initialization.
@@ -38,91 +697,103 @@ int osfs_fill_super(struct super_block *sb, void *data, int silent)
     pr_info("osfs: Filling super start\n");
     struct inode *root_inode;
     struct osfs_sb_info *sb_info;
-    void *memory_region;
-    size_t total_memory_size;
+    struct osfs_mount_opts opts;
+    uint64_t free_inodes = 0, free_blocks = 0;
+    unsigned int i;
+    int ret;
 
-    // Calculate total memory size required
-    total_memory_size = sizeof(struct osfs_sb_info) +
-                        INODE_BITMAP_SIZE * sizeof(unsigned long) +
-                        BLOCK_BITMAP_SIZE * sizeof(unsigned long) +
-                        INODE_COUNT * sizeof(struct osfs_inode) +
-                        DATA_BLOCK_COUNT * BLOCK_SIZE;
+    ret = osfs_parse_options(data, &opts);
+    if (ret)
+        return ret;
 
-    // Allocate memory for superblock information and related structures
-    memory_region = vmalloc(total_memory_size);
-    if (!memory_region)
+    sb_info = kzalloc(sizeof(*sb_info), GFP_KERNEL);
+    if (!sb_info)
         return -ENOMEM;
-
-    memset(memory_region, 0, total_memory_size);
+    sb_info->stats = alloc_percpu(struct osfs_stats);
+    if (!sb_info->stats) {
+        kfree(sb_info);
+        return -ENOMEM;
+    }
 
     // Initialize superblock information
-    sb_info = (struct osfs_sb_info *)memory_region;
     sb_info->magic = OSFS_MAGIC;
     sb_info->block_size = BLOCK_SIZE;
-    sb_info->inode_count = INODE_COUNT;
-    sb_info->block_count = DATA_BLOCK_COUNT;
-    sb_info->nr_free_inodes = INODE_COUNT - 1;
-    sb_info->nr_free_blocks = DATA_BLOCK_COUNT;
+    sb_info->sb = sb;
+    xa_init(&sb_info->bh_cache);
+    osfs_share_init(sb_info);
 
-    // Partition the memory region into respective components
-    sb_info->inode_bitmap = (unsigned long *)(sb_info + 1);
-    sb_info->block_bitmap = sb_info->inode_bitmap + INODE_BITMAP_SIZE;
-    sb_info->inode_table = (void *)(sb_info->block_bitmap + BLOCK_BITMAP_SIZE);
-    sb_info->data_blocks = (void *)((char *)sb_info->inode_table +
-                                    INODE_COUNT * sizeof(struct osfs_inode));
-
-    // Initialize bitmaps
-    memset(sb_info->inode_bitmap, 0, INODE_BITMAP_SIZE * sizeof(unsigned long));
-    memset(sb_info->block_bitmap, 0, BLOCK_BITMAP_SIZE * sizeof(unsigned long));
-
-    // Set superblock fields
+    // Set superblock fields; from here on osfs_kill_superblock releases sb_info if the mount fails
     sb->s_magic = sb_info->magic;
     sb->s_fs_info = sb_info;
     sb->s_op = &osfs_super_ops;
+    sb->s_maxbytes = (loff_t)U32_MAX * BLOCK_SIZE;
+
+    if (sb->s_bdev) {
+        if (opts.mem_mode != OSFS_MEM_VMALLOC || opts.compress) {
+            pr_err("osfs: mem= and compress only apply to memory mounts\n");
+            return -EINVAL;
+        }
+        ret = osfs_setup_bdev(sb, sb_info, &opts, silent);
+    } else {
+        if (opts.journal_blocks != U32_MAX || opts.commit_interval) {
+            pr_err("osfs: journal= and commit= only apply to block device mounts\n");
+            return -EINVAL;
+        }
+        // A memory mount is formatted every time
+        opts.format = true;
+        // Block-aligned checks such as those of FICLONE go by the block size
+        sb->s_blocksize = BLOCK_SIZE;
+        sb->s_blocksize_bits = BLOCK_SIZE_BITS;
+        ret = osfs_setup_memory(sb_info, &opts);
+    }
+    if (!ret && opts.format)
+        ret = osfs_init_root(sb);
+    if (ret)
+        return ret;
+
+    ret = osfs_groups_init(sb_info);
+    if (ret)
+        return ret;
+
+    // Reference counts of shared blocks live in memory only
+    if (sb->s_bdev && !opts.format) {
+        ret = osfs_share_rebuild(sb_info);
+        if (ret)
+            return ret;
+    }
 
-    // Create root directory inode
-    root_inode = new_inode(sb);
-    if (!root_inode) {
-        vfree(memory_region);
+    for (i = 0; i < sb_info->group_count; i++) {
+        free_inodes += sb_info->groups[i].free_inodes;
+        free_blocks += sb_info->groups[i].free_blocks;
+    }
+    if (percpu_counter_init(&sb_info->nr_free_inodes, free_inodes, GFP_KERNEL) ||
+        percpu_counter_init(&sb_info->nr_free_blocks, free_blocks, GFP_KERNEL))
         return -ENOMEM;
+
+    if (opts.compress) {
+        ret = osfs_compress_init(sb_info);
+        if (ret)
+            return ret;
     }
 
-    root_inode->i_ino = ROOT_INODE;
-    root_inode->i_sb = sb;
-    root_inode->i_op = &osfs_dir_inode_operations;
-    root_inode->i_fop = &osfs_dir_operations;
-    root_inode->i_mode = S_IFDIR | 0755;
-    set_nlink(root_inode, 2);
-    simple_inode_init_ts(root_inode);
-    
-    // Initialize root directory's osfs_inode
-    struct osfs_inode *root_osfs_inode = osfs_get_osfs_inode(sb, ROOT_INODE);
-    if (!root_osfs_inode) {
+    // Load the root directory inode
+    root_inode = osfs_iget(sb, ROOT_INODE);
+    if (IS_ERR(root_inode))
+        return PTR_ERR(root_inode);
+    if (!S_ISDIR(root_inode->i_mode)) {
+        pr_err("osfs: Root inode of %s is not a directory\n", sb->s_id);
         iput(root_inode);
-        vfree(memory_region);
         return -EIO;
     }
-    memset(root_osfs_inode, 0, sizeof(*root_osfs_inode));
 
-    root_osfs_inode->i_ino = ROOT_INODE;
-    root_osfs_inode->i_mode = root_inode->i_mode;
-    root_osfs_inode->i_links_count = 2;
-    root_osfs_inode->__i_atime = root_osfs_inode->__i_mtime = root_osfs_inode->__i_ctime = current_time(root_inode);
-    root_inode->i_private = root_osfs_inode;
-
-    // Mark root directory inode as used
-    set_bit(ROOT_INODE, sb_info->inode_bitmap);
-
-    // Update root directory size
-    root_inode->i_size = 0;
-    inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
     // Set the root directory
     sb->s_root = d_make_root(root_inode);
-    if (!sb->s_root) {
-        iput(root_inode);
-        vfree(memory_region);
+    if (!sb->s_root)
         return -ENOMEM;
-    }
+
+    ret = osfs_sysfs_register(sb);
+    if (ret)
+        return ret;
     pr_info("osfs: Superblock filled successfully \n");
     return 0;
 }
@@ -0,0 +1,236 @@
+#include <linux/fs.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/percpu.h>
+#include <linux/math64.h>
+#include "osfs.h"
+
+/**
+ * Per-mount counters
+ *
+ * Every mount gets a directory /sys/fs/osfs/<mount>/, named after the block
+ * device (e.g. loop0) or, for a memory mount, the major:minor shown in
+ * /proc/self/mountinfo. Each file holds one counter as a decimal number:
+ *
+ *   free_blocks, free_inodes       current free space
+ *   alloc_requests                 searches for a run of free blocks
+ *   alloc_groups_scanned           groups those searches looked at; divided by
+ *                                  alloc_requests, the average scan length
+ *   alloc_failures                 searches that found no free block
+ *   alloc_blocks, freed_blocks     data blocks allocated and freed
+ *   extents_created, extents_freed extent tree entries added and removed
+ *   extents_per_file               live extents created since mount per used inode
+ *   lookup_hits, lookup_misses     osfs_lookup results
+ *   read_bytes, write_bytes        bytes moved by read_iter and write_iter
+ *   journal_commits                journal transactions committed
+ *   journal_blocks                 metadata blocks they logged; divided by
+ *                                  journal_commits, the average batch
+ *   compress_chunks                chunks of cold data compressed (-o compress)
+ *   compress_saved_blocks          data blocks that freed
+ *   decompress_chunks              chunks decompressed for reads
+ *   inflated_chunks                compressed chunks written back uncompressed,
+ *                                  as they were modified
+ */
+
+static struct kset *osfs_kset;
+
+struct osfs_attr {
+    struct attribute attr;
+    ssize_t (*show)(struct osfs_sb_info *sb_info, struct osfs_attr *a, char *buf);
+    enum osfs_stat stat;
+};
+
+/**
+ * Function: osfs_stat_sum
+ * Description: Adds up a counter over every CPU. The result may be off by the
+ *              updates running at the same time, which is fine for statistics.
+ */
+static u64 osfs_stat_sum(struct osfs_sb_info *sb_info, enum osfs_stat item)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += per_cpu_ptr(sb_info->stats, cpu)->count[item];
+    return sum;
+}
+
+static ssize_t osfs_stat_show(struct osfs_sb_info *sb_info, struct osfs_attr *a, char *buf)
+{
+    return sysfs_emit(buf, "%llu\n", osfs_stat_sum(sb_info, a->stat));
+}
+
+static ssize_t osfs_free_blocks_show(struct osfs_sb_info *sb_info, struct osfs_attr *a, char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", percpu_counter_sum_positive(&sb_info->nr_free_blocks));
+}
+
+static ssize_t osfs_free_inodes_show(struct osfs_sb_info *sb_info, struct osfs_attr *a, char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", percpu_counter_sum_positive(&sb_info->nr_free_inodes));
+}
+
+static ssize_t osfs_extents_per_file_show(struct osfs_sb_info *sb_info, struct osfs_attr *a,
+                                          char *buf)
+{
+    u64 created = osfs_stat_sum(sb_info, OSFS_STAT_EXTENTS_CREATED);
+    u64 freed = osfs_stat_sum(sb_info, OSFS_STAT_EXTENTS_FREED);
+    u64 live = created > freed ? created - freed : 0;
+    s64 used;
+
+    // Inode 0 is reserved and never holds extents
+    used = sb_info->inode_count - 1 - percpu_counter_sum_positive(&sb_info->nr_free_inodes);
+    if (used <= 0)
+        return sysfs_emit(buf, "0.00\n");
+
+    live = div64_u64(live * 100, used);
+    return sysfs_emit(buf, "%llu.%02llu\n", live / 100, live % 100);
+}
+
+#define OSFS_STAT_ATTR(_name, _stat)                                    \
+    static struct osfs_attr osfs_attr_##_name = {                       \
+        .attr = { .name = __stringify(_name), .mode = 0444 },           \
+        .show = osfs_stat_show,                                         \
+        .stat = _stat,                                                  \
+    }
+
+#define OSFS_ATTR(_name)                                                \
+    static struct osfs_attr osfs_attr_##_name = {                       \
+        .attr = { .name = __stringify(_name), .mode = 0444 },           \
+        .show = osfs_##_name##_show,                                    \
+    }
+
+OSFS_ATTR(free_blocks);
+OSFS_ATTR(free_inodes);
+OSFS_STAT_ATTR(alloc_requests, OSFS_STAT_ALLOC_REQUESTS);
+OSFS_STAT_ATTR(alloc_groups_scanned, OSFS_STAT_ALLOC_SCANNED);
+OSFS_STAT_ATTR(alloc_failures, OSFS_STAT_ALLOC_FAILURES);
+OSFS_STAT_ATTR(alloc_blocks, OSFS_STAT_ALLOC_BLOCKS);
+OSFS_STAT_ATTR(freed_blocks, OSFS_STAT_FREED_BLOCKS);
+OSFS_STAT_ATTR(extents_created, OSFS_STAT_EXTENTS_CREATED);
+OSFS_STAT_ATTR(extents_freed, OSFS_STAT_EXTENTS_FREED);
+OSFS_ATTR(extents_per_file);
+OSFS_STAT_ATTR(lookup_hits, OSFS_STAT_LOOKUP_HITS);
+OSFS_STAT_ATTR(lookup_misses, OSFS_STAT_LOOKUP_MISSES);
+OSFS_STAT_ATTR(read_bytes, OSFS_STAT_READ_BYTES);
+OSFS_STAT_ATTR(write_bytes, OSFS_STAT_WRITE_BYTES);
+OSFS_STAT_ATTR(journal_commits, OSFS_STAT_JOURNAL_COMMITS);
+OSFS_STAT_ATTR(journal_blocks, OSFS_STAT_JOURNAL_BLOCKS);
+OSFS_STAT_ATTR(compress_chunks, OSFS_STAT_COMPRESS_CHUNKS);
+OSFS_STAT_ATTR(compress_saved_blocks, OSFS_STAT_COMPRESS_SAVED);
+OSFS_STAT_ATTR(decompress_chunks, OSFS_STAT_DECOMPRESS_CHUNKS);
+OSFS_STAT_ATTR(inflated_chunks, OSFS_STAT_INFLATE_CHUNKS);
+
+static struct attribute *osfs_attrs[] = {
+    &osfs_attr_free_blocks.attr,
+    &osfs_attr_free_inodes.attr,
+    &osfs_attr_alloc_requests.attr,
+    &osfs_attr_alloc_groups_scanned.attr,
+    &osfs_attr_alloc_failures.attr,
+    &osfs_attr_alloc_blocks.attr,
+    &osfs_attr_freed_blocks.attr,
+    &osfs_attr_extents_created.attr,
+    &osfs_attr_extents_freed.attr,
+    &osfs_attr_extents_per_file.attr,
+    &osfs_attr_lookup_hits.attr,
+    &osfs_attr_lookup_misses.attr,
+    &osfs_attr_read_bytes.attr,
+    &osfs_attr_write_bytes.attr,
+    &osfs_attr_journal_commits.attr,
+    &osfs_attr_journal_blocks.attr,
+    &osfs_attr_compress_chunks.attr,
+    &osfs_attr_compress_saved_blocks.attr,
+    &osfs_attr_decompress_chunks.attr,
+    &osfs_attr_inflated_chunks.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(osfs);
+
+static ssize_t osfs_attr_show(struct kobject *kobj, struct attribute *attr, char *buf)
+{
+    struct osfs_sb_info *sb_info = container_of(kobj, struct osfs_sb_info, s_kobj);
+    struct osfs_attr *a = container_of(attr, struct osfs_attr, attr);
+
+    return a->show(sb_info, a, buf);
+}
+
+static const struct sysfs_ops osfs_attr_ops = {
+    .show = osfs_attr_show,
+};
+
+// The kobject is embedded in sb_info, which osfs_sysfs_unregister waits for before it is freed
+static void osfs_sb_release(struct kobject *kobj)
+{
+    struct osfs_sb_info *sb_info = container_of(kobj, struct osfs_sb_info, s_kobj);
+
+    complete(&sb_info->s_kobj_unregister);
+}
+
+static const struct kobj_type osfs_sb_ktype = {
+    .default_groups = osfs_groups,
+    .sysfs_ops = &osfs_attr_ops,
+    .release = osfs_sb_release,
+};
+
+/**
+ * Function: osfs_sysfs_register
+ * Description: Creates the counter directory of a mount.
+ * Inputs:
+ *   - sb: The superblock of the mount; s_fs_info and its counters are set up.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code if the directory cannot be created.
+ */
+int osfs_sysfs_register(struct super_block *sb)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    int ret;
+
+    init_completion(&sb_info->s_kobj_unregister);
+    sb_info->s_kobj.kset = osfs_kset;
+    if (sb->s_bdev)
+        ret = kobject_init_and_add(&sb_info->s_kobj, &osfs_sb_ktype, NULL, "%s", sb->s_id);
+    else
+        ret = kobject_init_and_add(&sb_info->s_kobj, &osfs_sb_ktype, NULL, "%u:%u",
+                                   MAJOR(sb->s_dev), MINOR(sb->s_dev));
+    if (ret) {
+        pr_err("osfs_sysfs_register: Failed to add /sys/fs/osfs entry for %s\n", sb->s_id);
+        kobject_put(&sb_info->s_kobj);
+        wait_for_completion(&sb_info->s_kobj_unregister);
+    }
+    return ret;
+}
+
+/**
+ * Function: osfs_sysfs_unregister
+ * Description: Removes the counter directory of a mount, if it was created,
+ *              and waits until no reader can still reach sb_info through it.
+ */
+void osfs_sysfs_unregister(struct osfs_sb_info *sb_info)
+{
+    if (!sb_info->s_kobj.state_in_sysfs)
+        return;
+
+    kobject_del(&sb_info->s_kobj);
+    kobject_put(&sb_info->s_kobj);
+    wait_for_completion(&sb_info->s_kobj_unregister);
+}
+
+/**
+ * Function: osfs_sysfs_init
+ * Description: Creates /sys/fs/osfs at module load.
+ */
+int osfs_sysfs_init(void)
+{
+    osfs_kset = kset_create_and_add("osfs", NULL, fs_kobj);
+    return osfs_kset ? 0 : -ENOMEM;
+}
+
+/**
+ * Function: osfs_sysfs_exit
+ * Description: Removes /sys/fs/osfs at module unload.
+ */
+void osfs_sysfs_exit(void)
+{
+    kset_unregister(osfs_kset);
+}